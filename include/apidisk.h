@@ -38,4 +38,83 @@ Retorna:"0", se a leitura foi realizada corretamente
 ------------------------------------------------------------------------*/
 int write_sector(unsigned int sector, unsigned char *buffer);
 
+
+/*------------------------------------------------------------------------
+Função:  Abre a imagem de um disco montado (t2fs_mount)
+
+Entra:  path -> caminho do arquivo com a imagem
+
+Retorna:Ponteiro para o disco, usado por useDisk e closeDisk
+  ZERO (NULL), caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+struct disk *openDisk(char *path);
+
+
+/*------------------------------------------------------------------------
+Função:  Abre um disco formado por "n" imagens em faixas (RAID-0): a unidade de faixa
+  u, de "stripeSectors" setores, fica na imagem u % n. Leituras e escritas que
+  atravessam várias imagens são divididas e feitas em paralelo, uma thread por
+  imagem.
+
+Entra:  paths -> caminhos das imagens, na ordem da formatação
+  n -> quantidade de imagens
+  stripeSectors -> setores por unidade de faixa (ignorado com uma imagem)
+
+Retorna:Ponteiro para o disco, usado por useDisk e closeDisk
+  ZERO (NULL), caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+struct disk *openStripedDisk(char **paths, int n, int stripeSectors);
+
+
+/*------------------------------------------------------------------------
+Função:  Fecha o disco aberto por openDisk ou openStripedDisk. Nenhuma thread pode estar usando o disco.
+------------------------------------------------------------------------*/
+void closeDisk(struct disk *disk);
+
+
+/*------------------------------------------------------------------------
+Função:  Escolhe o disco lido e escrito por read_sector e write_sector na thread
+  que chama. Sem escolha, ou com ZERO, é usado o disco implícito, t2fs_disk.dat,
+  aberto no primeiro acesso.
+
+Entra:  disk -> disco aberto por openDisk, ou ZERO
+
+Retorna:O disco escolhido antes da chamada (ZERO se era o implícito)
+------------------------------------------------------------------------*/
+struct disk *useDisk(struct disk *disk);
+
+
+/*------------------------------------------------------------------------
+Função:  Retorna o disco escolhido na thread que chama (ZERO se é o implícito)
+------------------------------------------------------------------------*/
+struct disk *currentDisk(void);
+
+
+/*------------------------------------------------------------------------
+Função:  Lê ou escreve "count" setores consecutivos com um único pedido ao disco
+  (um por imagem, em paralelo, num disco em faixas)
+
+Entra:  sector -> primeiro setor
+  count -> quantidade de setores
+  buffer -> área de count * SECTOR_SIZE bytes
+
+Retorna:"0", se a operação foi realizada corretamente
+  Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sectors(unsigned int sector, int count, unsigned char *buffer);
+int write_sectors(unsigned int sector, int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+Função:  Pede que "count" setores consecutivos comecem a ser lidos em segundo plano,
+  sem esperar por eles: um read_sectors posterior os encontra no cache do sistema
+
+Entra:  sector -> primeiro setor
+  count -> quantidade de setores
+
+Retorna:"0", se o pedido foi aceito
+  Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int prefetch_sectors(unsigned int sector, int count);
+
 #endif
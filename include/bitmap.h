@@ -0,0 +1,162 @@
+#ifndef __BITMAP__
+#define __BITMAP__
+
+#ifndef BITMAP_INODE
+#define BITMAP_INODE  0
+#define BITMAP_DADOS  1
+#endif
+
+/*------------------------------------------------------------------------
+  Bitmaps do T2FS mantidos inteiros em memória.
+  Todos os setores são lidos na inicialização; cada alteração é escrita no disco
+  antes do retorno, um setor por vez (pelo journal, se houver).
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Bitmaps de um disco montado (t2fs_mount). newBitmaps cria um conjunto
+  vazio, a ser carregado por initBitmaps; useBitmaps escolhe o conjunto
+  usado pelas demais funções na thread que chama e retorna o anterior
+  (ZERO escolhe o do disco implícito); freeBitmaps libera um conjunto que
+  nenhuma thread usa mais.
+------------------------------------------------------------------------*/
+struct bitmaps;
+struct bitmaps *newBitmaps(void);
+struct bitmaps *useBitmaps(struct bitmaps *bitmaps);
+void freeBitmaps(struct bitmaps *bitmaps);
+
+
+/*------------------------------------------------------------------------
+  Carrega os dois bitmaps do disco
+Entra:
+  firstSector -> primeiro setor do bitmap de blocos (logo após o superbloco)
+  blockSectors -> setores do bitmap de blocos
+  inodeSectors -> setores do bitmap de i-nodes, que segue o de blocos
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int initBitmaps(unsigned int firstSector, int blockSectors, int inodeSectors);
+
+
+/*------------------------------------------------------------------------
+  Recupera o bit indicado do bitmap solicitado
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  bitNumber -> bit a ser retornado
+Retorna:
+  Sucesso: valor do bit: ZERO ou UM (0 ou 1)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int getBitmap(int handle, int bitNumber);
+
+
+/*------------------------------------------------------------------------
+  Copia uma faixa contínua de bits do bitmap solicitado
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  firstBit -> primeiro bit da faixa
+  count -> quantidade de bits
+  bits -> recebe os bits, a partir do bit 0 do primeiro byte
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int getBitmapRange(int handle, int firstBit, int count, unsigned char *bits);
+
+
+/*------------------------------------------------------------------------
+  Seta o bit indicado do bitmap solicitado
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  bitNumber -> bit a ser alterado
+  bitValue -> valor a ser escrito no bit
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int setBitmap(int handle, int bitNumber, int bitValue);
+
+
+/*------------------------------------------------------------------------
+  Seta uma faixa contínua de bits do bitmap solicitado.
+  Cada setor do bitmap tocado pela faixa é escrito uma única vez.
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  firstBit -> primeiro bit da faixa
+  count -> quantidade de bits
+  bitValue -> valor a ser escrito nos bits
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int setBitmapRange(int handle, int firstBit, int count, int bitValue);
+
+
+/*------------------------------------------------------------------------
+  Conta os bits livres (ZERO) do bitmap solicitado, sem percorrê-lo: a
+  contagem é feita na carga e mantida a cada alteração. Bits zerados
+  ainda retidos por holdFreedBits já contam como livres.
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+Retorna
+  Sucesso: quantidade de bits livres
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int countFreeBits(int handle);
+
+
+/*------------------------------------------------------------------------
+  Procura no bitmap solicitado pelo primeiro bit com o valor indicado
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  bitValue -> valor procurado
+Retorna
+  Sucesso
+    Achou o bit: índice associado ao bit (número positivo)
+    Não achou: ZERO
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int searchBitmap(int handle, int bitValue);
+
+/*------------------------------------------------------------------------
+  Procura no bitmap solicitado uma faixa contínua de bits livres (ZERO).
+  Devolve a primeira faixa com "count" bits; se não houver, a maior faixa
+    livre encontrada. Os bits não são alterados.
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+  count -> tamanho desejado da faixa
+  length -> recebe o tamanho da faixa encontrada (no máximo "count")
+Retorna
+  Sucesso
+    Achou a faixa: índice do primeiro bit (número positivo)
+    Não achou: ZERO
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int searchBitmapRun(int handle, int count, int *length);
+
+/*------------------------------------------------------------------------
+  A partir desta chamada, bits zerados no bitmap solicitado continuam
+  ocupados para searchBitmap e searchBitmapRun até releaseFreedBits.
+  Com journal, um bloco liberado só pode ser reusado depois que a
+  liberação chegou ao disco.
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int holdFreedBits(int handle);
+
+
+/*------------------------------------------------------------------------
+  Torna livres para as buscas os bits zerados desde a última chamada
+Entra:
+  handle -> bitmap (BITMAP_INODE ou BITMAP_DADOS)
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int releaseFreedBits(int handle);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef __CHECKSUM__
+#define __CHECKSUM__
+
+/*------------------------------------------------------------------------
+  Somas de verificação dos setores de dados do T2FS (T2FS_FEATURE_CHECKSUM).
+  Cada setor da área de blocos tem uma entrada de 32 bits, little endian,
+  na tabela gravada entre a tabela de contadores e o journal. A entrada
+  guarda o complemento do CRC32C do setor, de modo que ZERO (a tabela nova
+  é toda zerada) indica um setor sem soma, que não é verificado.
+  Os setores da tabela são lidos no primeiro acesso e escritos pelo journal
+  em flushChecksums, chamada depois da escrita dos dados: as somas entram no
+  mesmo commit que os metadados da operação. Os dados de arquivos não passam
+  pelo journal, então uma queda antes do commit ainda deixa a soma antiga de
+  um bloco reescrito no lugar, que o fsck2 aponta.
+  Blocos liberados mantêm as suas somas: um bloco de dados novo é escrito
+  inteiro, e os setores que ficam sem escrever têm a soma apagada.
+  Sem tabela carregada, as leituras e escritas não são verificadas.
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Tabela de um disco montado (t2fs_mount). newChecksums cria uma tabela
+  vazia, a ser habilitada por initChecksums; useChecksums escolhe a tabela
+  usada pelas demais funções na thread que chama e retorna a anterior
+  (ZERO escolhe a do disco implícito); freeChecksums libera uma tabela que
+  nenhuma thread usa mais, sem gravá-la.
+------------------------------------------------------------------------*/
+struct checksums;
+struct checksums *newChecksums(void);
+struct checksums *useChecksums(struct checksums *checksums);
+void freeChecksums(struct checksums *checksums);
+
+
+/*------------------------------------------------------------------------
+  Habilita a tabela de somas
+Entra:
+  firstSector -> primeiro setor da tabela
+  sectors -> setores da tabela
+  dataStart -> primeiro setor da área de blocos de dados
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int initChecksums(unsigned int firstSector, int sectors, unsigned int dataStart);
+
+
+/*------------------------------------------------------------------------
+  Lê um setor de dados e confere a sua soma, se houver
+Entra:
+  sector -> setor do disco
+  buffer -> buffer de SECTOR_SIZE bytes
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo (também se os dados não conferem com a soma)
+------------------------------------------------------------------------*/
+int checkedRead(unsigned int sector, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Escreve um setor de dados e atualiza a sua soma na memória.
+  A tabela só vai para o disco em flushChecksums.
+Entra:
+  sector -> setor do disco
+  buffer -> dados, SECTOR_SIZE bytes
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int checkedWrite(unsigned int sector, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Lê setores de dados seguidos numa só requisição ao disco e confere
+  as suas somas, como checkedRead, até o primeiro que não confere
+Entra:
+  sector -> primeiro setor
+  count -> quantidade de setores
+  buffer -> buffer de count * SECTOR_SIZE bytes
+Retorna
+  Sucesso: count
+  Setor que não confere com a soma: quantos setores antes dele conferem
+  Erro de leitura: número negativo
+------------------------------------------------------------------------*/
+int checkedReadSectors(unsigned int sector, int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Escreve setores de dados seguidos numa só requisição ao disco e
+  atualiza as suas somas, como checkedWrite
+Entra:
+  sector -> primeiro setor
+  count -> quantidade de setores
+  buffer -> dados, count * SECTOR_SIZE bytes
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int checkedWriteSectors(unsigned int sector, int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Apaga as somas de setores entregues a um arquivo sem serem escritos, que
+  ainda têm as do dono anterior. A tabela só vai para o disco em
+  flushChecksums.
+Entra:
+  sector -> primeiro setor
+  count -> quantidade de setores
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int clearChecksums(unsigned int sector, int count);
+
+
+/*------------------------------------------------------------------------
+  Escreve os setores da tabela alterados desde a última chamada
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int flushChecksums(void);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __CRC32C__
+#define __CRC32C__
+
+/*------------------------------------------------------------------------
+  CRC32C (polinômio de Castagnoli, 0x1EDC6F41, refletido) usado nas somas
+  de verificação dos setores de dados do T2FS.
+  Em processadores x86 com SSE4.2 a soma usa a instrução crc32; nos demais
+  usa tabelas de 8 x 256 entradas (oito bytes por passo). A escolha é feita
+  na primeira chamada. Não há outro estado global: as funções podem ser
+  chamadas por várias threads.
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Calcula o CRC32C de um buffer
+Entra:
+  crc -> CRC dos bytes anteriores (ZERO no início dos dados)
+  data -> dados
+  size -> tamanho dos dados, em bytes
+Retorna
+  CRC32C dos bytes anteriores seguidos dos dados
+------------------------------------------------------------------------*/
+unsigned int crc32c(unsigned int crc, const unsigned char *data, int size);
+
+
+/*------------------------------------------------------------------------
+  Calcula os CRC32C de vários trechos seguidos do mesmo tamanho, como
+  crc32c(0, ...) em cada um. Com SSE4.2 três trechos são somados ao mesmo
+  tempo, o que dobra a velocidade em trechos curtos como setores.
+Entra:
+  data -> trechos, um depois do outro
+  count -> quantidade de trechos
+  size -> tamanho de cada trecho, em bytes
+  crcs -> recebe os count CRCs
+------------------------------------------------------------------------*/
+void crc32cMany(const unsigned char *data, int count, int size, unsigned int *crcs);
+
+
+/*------------------------------------------------------------------------
+  Calcula o CRC32C de um buffer sempre pelas tabelas, como crc32c
+Entra:
+  crc -> CRC dos bytes anteriores (ZERO no início dos dados)
+  data -> dados
+  size -> tamanho dos dados, em bytes
+Retorna
+  CRC32C dos bytes anteriores seguidos dos dados
+------------------------------------------------------------------------*/
+unsigned int crc32cPortable(unsigned int crc, const unsigned char *data, int size);
+
+
+/*------------------------------------------------------------------------
+  Informa se crc32c usa a instrução do processador
+Retorna
+  1 com SSE4.2, ZERO com as tabelas
+------------------------------------------------------------------------*/
+int crc32cHardware(void);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef __JOURNAL__
+#define __JOURNAL__
+
+/*------------------------------------------------------------------------
+  Journal de metadados do T2FS.
+  Setores de metadados (superbloco, bitmaps, i-nodes, diretórios e blocos
+  de indireção) escritos por journalWrite ficam em memória e são gravados
+  juntos, em sequência, numa região reservada do disco (commit). Depois do
+  registro de commit eles são copiados para suas posições (checkpoint).
+  Operações executadas entre journalStart e journalStop entram inteiras
+  num mesmo commit. Blocos de dados não passam pelo journal.
+  Sem journal habilitado, leituras e escritas vão direto ao disco.
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Journal de um disco montado (t2fs_mount). newJournal cria um journal
+  desabilitado, a ser habilitado por initJournal com o disco escolhido
+  pela thread (useDisk); useJournal escolhe o journal usado pelas demais
+  funções na thread que chama e retorna o anterior (ZERO escolhe o do
+  disco implícito). freeJournal grava as operações terminadas, encerra
+  a thread de commit e libera um journal que nenhuma thread usa mais.
+------------------------------------------------------------------------*/
+struct journal;
+struct journal *newJournal(void);
+struct journal *useJournal(struct journal *journal);
+void freeJournal(struct journal *journal);
+
+
+/*------------------------------------------------------------------------
+  Habilita o journal e refaz o último commit que não chegou ao checkpoint
+Entra:
+  firstSector -> primeiro setor da região do journal (cabeçalho)
+  sectors -> setores da região
+  checkpointed -> chamada após cada checkpoint, sem nenhuma operação em
+    andamento, talvez em outra thread (pode ser ZERO)
+  arg -> repassado a checkpointed
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int initJournal(unsigned int firstSector, int sectors, void (*checkpointed)(void *arg), void *arg);
+
+
+/*------------------------------------------------------------------------
+  Lê um setor, vendo as escritas de metadados ainda não copiadas ao disco
+Entra:
+  sector -> setor a ser lido
+  buffer -> recebe os SECTOR_SIZE bytes do setor
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int journalRead(unsigned int sector, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Lê setores consecutivos num único pedido ao disco, vendo as escritas de
+  metadados ainda não copiadas ao disco, como journalRead
+Entra:
+  sector -> primeiro setor a ser lido
+  count -> quantidade de setores
+  buffer -> recebe os count * SECTOR_SIZE bytes
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int journalReadSectors(unsigned int sector, int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Escreve um setor de metadados no commit em andamento
+Entra:
+  sector -> setor a ser escrito
+  buffer -> SECTOR_SIZE bytes do setor
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int journalWrite(unsigned int sector, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+  Início e fim de uma operação. As chamadas podem ser aninhadas numa mesma
+  thread; só a mais externa conta. journalStart espera o fim de um commit
+  que esteja sendo gravado.
+------------------------------------------------------------------------*/
+void journalStart(void);
+void journalStop(void);
+
+
+/*------------------------------------------------------------------------
+  Informa se o commit em andamento já ocupa metade da região. Uma operação
+  longa consulta journalFull entre os seus passos e, quando ele fica cheio,
+  deixa o disco consistente e chama journalStop e journalStart: o commit é
+  gravado e ela continua no seguinte. Numa chamada aninhada o par não tem
+  efeito, e a operação externa segue no mesmo commit.
+Retorna
+  1 se a operação deve recomeçar, ZERO se não (também sem journal)
+------------------------------------------------------------------------*/
+int journalFull(void);
+
+
+/*------------------------------------------------------------------------
+  Grava no disco as operações já terminadas e espera o checkpoint.
+  Chamadas simultâneas esperam pelo mesmo commit.
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int journalCommit(void);
+
+#endif
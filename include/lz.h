@@ -0,0 +1,41 @@
+#ifndef __LZ__
+#define __LZ__
+
+/*------------------------------------------------------------------------
+  Compressor da família LZ usado nos arquivos comprimidos do T2FS.
+  O código é uma sequência de trechos: um byte de controle (4 bits com a
+  quantidade de literais, 4 bits com o tamanho da cópia menos 4), os bytes
+  de tamanho excedente (255 enquanto continuar), os literais, e a distância
+  da cópia em 2 bytes, little endian. O último trecho só tem literais.
+  Não há estado global: as funções podem ser chamadas por várias threads.
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Comprime um buffer
+Entra:
+  in -> dados
+  size -> tamanho dos dados, em bytes
+  out -> buffer para o código
+  max -> tamanho do buffer "out"
+Retorna
+  Sucesso: tamanho do código, em bytes
+  Erro: número negativo (também se o código não cabe em "max" bytes)
+------------------------------------------------------------------------*/
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int max);
+
+
+/*------------------------------------------------------------------------
+  Descomprime um código gerado por lzCompress
+Entra:
+  in -> código
+  size -> tamanho do código, em bytes
+  out -> buffer para os dados
+  max -> tamanho do buffer "out"
+Retorna
+  Sucesso: tamanho dos dados, em bytes
+  Erro: número negativo (código inválido ou dados maiores que "max")
+------------------------------------------------------------------------*/
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int max);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __REFCOUNT__
+#define __REFCOUNT__
+
+/*------------------------------------------------------------------------
+  Contadores de referência dos blocos de dados do T2FS (T2FS_FEATURE_REFLINK).
+  Cada bloco tem um contador de 16 bits, little endian, na tabela gravada
+  depois do último bloco de dados. O contador guarda as referências além
+  da primeira: ZERO é um bloco com um único dono, e a tabela nova é toda
+  zerada. Um bloco de indireção compartilhado conta como uma referência
+  para cada bloco que aponta, qualquer que seja o número de donos dele.
+  Setores da tabela são lidos do disco no primeiro acesso; cada alteração
+  é escrita antes do retorno (pelo journal, se houver).
+  Sem tabela carregada, todo bloco tem um único dono.
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Tabela de um disco montado (t2fs_mount). newRefcounts cria uma tabela
+  vazia, a ser habilitada por initRefcounts; useRefcounts escolhe a tabela
+  usada pelas demais funções na thread que chama e retorna a anterior
+  (ZERO escolhe a do disco implícito); freeRefcounts libera uma tabela que
+  nenhuma thread usa mais.
+------------------------------------------------------------------------*/
+struct refcounts;
+struct refcounts *newRefcounts(void);
+struct refcounts *useRefcounts(struct refcounts *refcounts);
+void freeRefcounts(struct refcounts *refcounts);
+
+
+/*------------------------------------------------------------------------
+  Habilita a tabela de contadores
+Entra:
+  firstSector -> primeiro setor da tabela
+  sectors -> setores da tabela
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int initRefcounts(unsigned int firstSector, int sectors);
+
+
+/*------------------------------------------------------------------------
+  Recupera o contador do bloco indicado
+Entra:
+  blockNumber -> bloco de dados
+Retorna
+  Sucesso: referências além da primeira (ZERO se o bloco tem um único dono)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int getRefcount(int blockNumber);
+
+
+/*------------------------------------------------------------------------
+  Acrescenta uma referência a cada bloco do vetor (INVALID_PTR é ignorado).
+  Cada setor da tabela tocado é escrito uma única vez. Se algum contador
+  não puder crescer, nenhum é alterado.
+Entra:
+  blockNumbers -> blocos de dados
+  count -> quantidade de blocos no vetor
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo (também sem tabela ou com um contador no máximo)
+------------------------------------------------------------------------*/
+int shareBlocks(int *blockNumbers, int count);
+
+
+/*------------------------------------------------------------------------
+  Retira uma referência de cada bloco do vetor que tem mais de um dono.
+  Esses blocos, que continuam com outro dono, são trocados por INVALID_PTR
+  no vetor; os que restam tinham um único dono e podem ser liberados.
+  Cada setor da tabela tocado é escrito uma única vez.
+Entra:
+  blockNumbers -> blocos de dados (INVALID_PTR é ignorado)
+  count -> quantidade de blocos no vetor
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int unshareBlocks(int *blockNumbers, int count);
+
+#endif
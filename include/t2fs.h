@@ -9,12 +9,24 @@
 
 #define INVALID_PTR  -1
 
+/** Funcionalidades opcionais (campo "features" do superbloco) */
+#define T2FS_FEATURE_DIR_INDEX  0x0001  /* Diretórios grandes indexados por hash dos nomes */
+#define T2FS_FEATURE_INLINE_DATA  0x0002  /* Conteúdo de arquivos pequenos guardado junto ao registro */
+#define T2FS_FEATURE_JOURNAL  0x0004  /* Journal de metadados no final do disco */
+#define T2FS_FEATURE_REFLINK  0x0008  /* Blocos compartilhados entre clones, com contadores de referência */
+#define T2FS_FEATURE_COMPRESSION  0x0010  /* Arquivos com dados comprimidos (set_compression2) */
+#define T2FS_FEATURE_CHECKSUM  0x0020  /* Somas CRC32C dos setores de dados, conferidas na leitura */
+#define T2FS_FEATURE_LARGE_FILE  0x0040  /* Arquivos com 4 GiB ou mais (tamanho de 64 bits no registro) */
+#define T2FS_FEATURE_DIR_USAGE  0x0080  /* Ocupação acumulada de cada diretório, consultada com du2 */
+
 typedef int FILE2;
 typedef int DIR2;
+typedef struct t2fs_context T2FS_CONTEXT;  /* Disco montado por t2fs_mount */
 
 typedef unsigned char BYTE;
 typedef unsigned short int WORD;
 typedef unsigned int DWORD;
+typedef unsigned long long QWORD;
 
 #pragma pack(push, 1)
 
@@ -28,6 +40,20 @@ struct t2fs_superbloco {
     WORD    inodeAreaSize;  /* Quantidade de setores usados para armazenar os i-nodes do sistema.                 */
     WORD    blockSize;    /* Quantidade de setores que formam um bloco l�gico.                                  */
     DWORD   diskSize;    /* Quantidade total de setores na parti��o T2FS. Inclui o superbloco, �reas de bitmap, �rea de i-node e blocos de dados */
+    DWORD   features;    /* Funcionalidades opcionais habilitadas na formatação (T2FS_FEATURE_*). Zero no formato original. */
+    DWORD   orphanBlock; /* Bloco com a lista de i-nodes órfãos, ainda não liberados. Zero se não há lista.   */
+    DWORD   journalStart; /* Primeiro setor do journal de metadados (T2FS_FEATURE_JOURNAL).                */
+    DWORD   journalSize;  /* Quantidade de setores do journal. Zero se não há journal.                      */
+    DWORD   refcountStart; /* Primeiro setor da tabela de contadores de referência (T2FS_FEATURE_REFLINK). */
+    DWORD   refcountSize;  /* Quantidade de setores da tabela. Zero se não há tabela.                      */
+    DWORD   checksumStart; /* Primeiro setor da tabela de somas dos setores de dados (T2FS_FEATURE_CHECKSUM). */
+    DWORD   checksumSize;  /* Quantidade de setores da tabela de somas. Zero se não há tabela.              */
+    DWORD   stripeSectors; /* Setores de cada faixa num disco distribuído em várias imagens (RAID-0).     */
+    DWORD   stripeWidth;   /* Quantidade de imagens do disco. Zero ou 1 para uma imagem só.               */
+    DWORD   freeBlocks;    /* Blocos de dados livres, gravado por sync2 e t2fs_umount e recontado na inicialização. */
+    DWORD   freeInodes;    /* i-nodes livres, idem.                                                        */
+    DWORD   usageStart;    /* Primeiro setor da tabela de ocupação dos diretórios (T2FS_FEATURE_DIR_USAGE). */
+    DWORD   usageSize;     /* Quantidade de setores da tabela de ocupação. Zero se não há tabela.          */
 };
 
 /** Registro de diret�rio (entrada de diret�rio) */
@@ -35,8 +61,10 @@ struct t2fs_record {
     BYTE    TypeVal;        /* Tipo da entrada. Indica se o registro � inv�lido (0x00), arquivo (0x01) ou diret�rio (0x02) */
     char    name[32];       /* Nome do arquivo. : string com caracteres ASCII (0x21 at� 0x7A), case sensitive.             */
     DWORD   blocksFileSize; /* Tamanho do arquivo, expresso em n�mero de blocos de dados */
-    DWORD   bytesFileSize;  /* Tamanho do arquivo. Expresso em n�mero de bytes.          */
+    QWORD   bytesFileSize;  /* Tamanho do arquivo. Expresso em n�mero de bytes.          */
+                            /* No disco, os 32 bits altos ficam depois de "compression" (T2FS_FEATURE_LARGE_FILE) */
     int     inodeNumber;    /* N�mero do i-node (se inv�lido, recebe INVALID_PTR)        */
+    BYTE    compression;    /* Compressão dos dados (COMPRESSION_*). Sempre ZERO sem T2FS_FEATURE_COMPRESSION */
 };
 
 /** i-node */
@@ -51,7 +79,7 @@ struct t2fs_inode {
 typedef struct {
     char    name[MAX_FILE_NAME_SIZE+1]; /* Nome do arquivo cuja entrada foi lida do disco      */
     BYTE    fileType;                   /* Tipo do arquivo: regular (0x01) ou diret�rio (0x02) */
-    DWORD   fileSize;                   /* Numero de bytes do arquivo                          */
+    QWORD   fileSize;                   /* Numero de bytes do arquivo                          */
 } DIRENT2;
 
 #pragma pack(pop)
@@ -141,6 +169,8 @@ Entra:  handle -> identificador do arquivo a ser lido
 Sa�da:  Se a opera��o foi realizada com sucesso, a fun��o retorna o n�mero de bytes lidos.
   Se o valor retornado for menor do que "size", ent�o o contador de posi��o atingiu o final do arquivo.
   Em caso de erro, ser� retornado um valor negativo.
+  Em discos com T2FS_FEATURE_CHECKSUM, um setor que não confere com a sua soma interrompe
+  a leitura: os bytes anteriores a ele são retornados e a leitura seguinte retorna erro.
 -----------------------------------------------------------------------------*/
 int read2(FILE2 handle, char *buffer, int size);
 
@@ -166,6 +196,8 @@ int write2(FILE2 handle, char *buffer, int size);
 Fun��o:  Fun��o usada para truncar um arquivo.
   Remove do arquivo todos os bytes a partir da posi��o atual do contador de posi��o (current pointer)
   Todos os bytes desde a posi��o indicada pelo current pointer at� o final do arquivo s�o removidos do arquivo.
+  Se o current pointer estiver além do final do arquivo, o arquivo é estendido até ele,
+    sem alocar blocos: o trecho acrescentado é um buraco, lido como zeros.
 
 Entra:  handle -> identificador do arquivo a ser truncado
 
@@ -181,6 +213,9 @@ Fun��o:  Reposiciona o contador de posi��es (current pointer) do arquivo
   O par�metro "offset" corresponde ao deslocamento, em bytes, contados a partir do in�cio do arquivo.
   Se o valor de "offset" for "-1", o current_pointer dever� ser posicionado no byte seguinte ao final do arquivo,
     Isso � �til para permitir que novos dados sejam adicionados no final de um arquivo j� existente.
+  Posições além do final do arquivo também são aceitas: escrever nelas cria um buraco (hole),
+    trecho sem blocos alocados que é lido como zeros.
+  Posições e tamanhos têm 64 bits. Sem T2FS_FEATURE_LARGE_FILE, os arquivos não passam de 4 GiB - 1 byte.
 
 Entra:  handle -> identificador do arquivo a ser escrito
   offset -> deslocamento, em bytes, onde posicionar o "current pointer".
@@ -188,7 +223,7 @@ Entra:  handle -> identificador do arquivo a ser escrito
 Sa�da:  Se a opera��o foi realizada com sucesso, a fun��o retorna "0" (zero).
   Em caso de erro, ser� retornado um valor diferente de zero.
 -----------------------------------------------------------------------------*/
-int seek2(FILE2 handle, DWORD offset);
+int seek2(FILE2 handle, QWORD offset);
 
 
 /*-----------------------------------------------------------------------------
@@ -272,4 +307,378 @@ Sa�da:  Se a opera��o foi realizada com sucesso, a fun��o retorna "0"
 -----------------------------------------------------------------------------*/
 int closedir2(DIR2 handle);
 
+
+/*-----------------------------------------------------------------------------
+Função:  Realiza a leitura de várias entradas do diretório identificado por "handle".
+  Lê até "n" entradas válidas a partir do ponteiro de entradas (current entry) e as coloca em "dentries".
+  Os blocos do diretório (diretos, de indireção simples e dupla) são decodificados inteiros,
+    de modo que cada bloco é lido do disco uma única vez.
+  O ponteiro de entradas é compartilhado com readdir2.
+
+Entra:  handle -> identificador do diretório cujas entradas deseja-se ler.
+  dentries -> vetor com espaço para "n" entradas.
+  n -> número máximo de entradas a serem lidas.
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna o número de entradas lidas.
+  O valor "0" (zero) indica o término das entradas válidas do diretório.
+  Em caso de erro, será retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int readdir_batch2(DIR2 handle, DIRENT2 *dentries, int n);
+
+
+/** Entrada de diretório lida com readdirplus2: registro completo e, opcionalmente, seu i-node */
+#define READDIRPLUS_INODE 0x01
+typedef struct {
+    struct t2fs_record record;  /* Registro da entrada, como gravado no diretório               */
+    struct t2fs_inode  inode;   /* i-node da entrada; válido apenas com a flag READDIRPLUS_INODE */
+} DIRENTPLUS2;
+
+/*-----------------------------------------------------------------------------
+Função:  Realiza a leitura de várias entradas do diretório identificado por "handle", com seus metadados.
+  Funciona como readdir_batch2, mas coloca em "entries" o registro completo de cada entrada
+    (tipo, nome, tamanho em bytes e em blocos, número do i-node).
+  Se "flags" contém READDIRPLUS_INODE, também decodifica o i-node de cada entrada.
+    Os i-nodes de todas as entradas lidas são buscados juntos, lendo cada setor da área de i-nodes uma única vez.
+  O ponteiro de entradas é compartilhado com readdir2 e readdir_batch2.
+
+Entra:  handle -> identificador do diretório cujas entradas deseja-se ler.
+  entries -> vetor com espaço para "n" entradas.
+  n -> número máximo de entradas a serem lidas.
+  flags -> READDIRPLUS_INODE para incluir os i-nodes, ou zero.
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna o número de entradas lidas.
+  O valor "0" (zero) indica o término das entradas válidas do diretório.
+  Em caso de erro, será retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int readdirplus2(DIR2 handle, DIRENTPLUS2 *entries, int n, int flags);
+
+
+/** Modos de remoção de arquivos e diretórios (set_delete_mode2) */
+#define DELETE_SYNC      0  /* delete2 e rmdir2 liberam os blocos antes de retornar            */
+#define DELETE_DEFERRED  1  /* os blocos são liberados depois, por uma thread em segundo plano */
+
+/*-----------------------------------------------------------------------------
+Função:  Escolhe como delete2 e rmdir2 liberam os blocos do que é removido.
+  Com DELETE_DEFERRED, o registro é retirado do diretório imediatamente e o i-node
+    é posto na lista de órfãos, gravada no disco. Uma thread em segundo plano
+    libera os blocos e retira o i-node da lista. Órfãos que restarem de uma
+    execução interrompida são liberados na inicialização.
+  Se a lista estiver cheia, a remoção é feita de forma síncrona.
+  Ao voltar para DELETE_SYNC, a função espera que todos os órfãos sejam liberados.
+
+Entra:  mode -> DELETE_SYNC ou DELETE_DEFERRED.
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int set_delete_mode2(int mode);
+
+/** Consultas de seek_data2 */
+#define SEEK_DATA2  0  /* Início do próximo trecho com dados                           */
+#define SEEK_HOLE2  1  /* Início do próximo buraco; o final do arquivo conta como buraco */
+
+/*-----------------------------------------------------------------------------
+Função:  Procura, a partir de "offset", o próximo trecho com dados (SEEK_DATA2) ou o próximo
+    buraco (SEEK_HOLE2) do arquivo identificado por "handle", e posiciona o current pointer nele.
+  A busca é feita em blocos inteiros: um bloco alocado é dado, mesmo que contenha zeros.
+    Em arquivos comprimidos, a busca é feita em unidades de compressão inteiras.
+  Trechos inteiros sem blocos de indireção são saltados sem leitura do disco.
+
+Entra:  handle -> identificador do arquivo
+  offset -> posição, em bytes, onde começar a busca
+  whence -> SEEK_DATA2 ou SEEK_HOLE2
+  position -> recebe a posição encontrada
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Se "offset" está no final do arquivo ou além dele, ou se não há mais dados depois dele (SEEK_DATA2),
+    ou em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int seek_data2(FILE2 handle, QWORD offset, int whence, QWORD *position);
+
+/*-----------------------------------------------------------------------------
+Função:  Reserva e mapeia, numa única operação, todos os blocos de dados do trecho de
+    "length" bytes a partir de "offset" do arquivo identificado por "handle".
+  Os blocos são tomados em faixas contínuas do bitmap de dados, e cada bloco de indireção
+    é escrito uma única vez. Escritas sequenciais posteriores não precisam alocar nada.
+  O tamanho do arquivo e o current pointer não mudam. Blocos reservados além do final do
+    arquivo não são zerados; são zerados apenas buracos que já faziam parte do arquivo.
+  Arquivos comprimidos não aceitam reserva, pois o espaço depende dos dados.
+
+Entra:  handle -> identificador do arquivo
+  offset -> início do trecho, em bytes
+  length -> tamanho do trecho, em bytes
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro (por exemplo, disco cheio), será retornado um valor diferente de zero;
+    os blocos já reservados continuam no arquivo.
+-----------------------------------------------------------------------------*/
+int fallocate2(FILE2 handle, QWORD offset, QWORD length);
+
+/*-----------------------------------------------------------------------------
+Função:  Grava no disco todas as operações já terminadas.
+  Em discos formatados com journal (T2FS_FEATURE_JOURNAL), as alterações de metadados
+    ficam em memória e são gravadas em lote a cada poucos segundos, quando o lote fica
+    grande e no fim do programa. sync2 força essa gravação e espera que termine.
+  Uma escrita ou reserva grande (write2, fallocate2) é dividida em partes; quando o lote
+    chega à metade do journal, ele é gravado entre duas partes, com o arquivo coerente.
+    Após uma queda, o arquivo fica com as partes já gravadas.
+  Sem journal, toda operação já chega ao disco antes de retornar.
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int sync2(void);
+
+/*-----------------------------------------------------------------------------
+Função:  Cria o arquivo "filename" como cópia do arquivo regular "source", sem copiar dados.
+  O novo arquivo recebe um i-node próprio com os mesmos ponteiros do original; os blocos
+    de dados e de indireção passam a ser compartilhados, e o custo não depende do tamanho
+    do arquivo. Uma escrita em qualquer um dos dois copia antes os blocos compartilhados
+    que alterar (copy-on-write), e o outro arquivo não vê a mudança.
+  Exige disco formatado com T2FS_FEATURE_REFLINK, exceto para arquivos sem blocos.
+  Se "source" estiver aberto, são clonados o conteúdo e o tamanho atuais.
+
+Entra:  source -> caminho absoluto do arquivo a ser clonado
+  filename -> caminho absoluto do novo arquivo, que não pode existir
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int clone2(char *source, char *filename);
+
+/** Modos de compressão de arquivos (set_compression2) */
+#define COMPRESSION_NONE  0  /* Blocos gravados como estão                        */
+#define COMPRESSION_LZ    1  /* Dados comprimidos com um compressor da família LZ */
+
+/*-----------------------------------------------------------------------------
+Função:  Escolhe como os dados do arquivo identificado por "handle" são gravados.
+  Com COMPRESSION_LZ, o arquivo é dividido em unidades de 4 blocos, comprimidas uma a uma.
+    Uma unidade cujo código cabe em menos blocos ocupa só os primeiros, e os demais ficam
+    sem alocação; as outras são gravadas sem compressão, e unidades só com zeros viram
+    buracos. read2 lê apenas os setores do código e descomprime direto no buffer quando
+    ele cobre a unidade inteira. Escritas parciais relêem e recomprimem a unidade.
+  O modo só pode ser trocado com o arquivo vazio; ele é guardado no registro do arquivo
+    e herdado pelos clones. Exige disco formatado com T2FS_FEATURE_COMPRESSION.
+
+Entra:  handle -> identificador do arquivo
+  mode -> COMPRESSION_NONE ou COMPRESSION_LZ
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int set_compression2(FILE2 handle, int mode);
+
+/** i-node em uso lido com scan_inodes2 */
+typedef struct {
+    DWORD              inodeNumber;  /* Número do i-node              */
+    struct t2fs_inode  inode;        /* i-node, como gravado no disco */
+} INODESCAN2;
+
+/*-----------------------------------------------------------------------------
+Função:  Percorre a área de i-nodes em ordem, devolvendo os i-nodes em uso (bit ligado no bitmap de i-nodes).
+  Cada setor da área é lido uma única vez por chamada e seus 16 i-nodes são decodificados juntos;
+    setores sem nenhum i-node em uso não são lidos, e os seguidos que têm algum são lidos num só
+    pedido, de até 64 setores.
+  "next" guarda a posição da varredura: deve valer ZERO na primeira chamada e é atualizado a cada uma.
+
+Entra:  next -> número do primeiro i-node a examinar; recebe o número do seguinte ao último examinado.
+  entries -> vetor com espaço para "n" entradas.
+  n -> número máximo de i-nodes a devolver.
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna o número de i-nodes colocados em "entries".
+  O valor "0" (zero) indica o término da área de i-nodes.
+  Em caso de erro, será retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int scan_inodes2(DWORD *next, INODESCAN2 *entries, int n);
+
+/** Ocupação do disco lida com statfs2 */
+typedef struct {
+    DWORD  blockSize;    /* Tamanho do bloco, em bytes                          */
+    DWORD  blocks;       /* Blocos da área de dados                             */
+    DWORD  freeBlocks;   /* Blocos livres                                       */
+    DWORD  inodes;       /* i-nodes da área de i-nodes                          */
+    DWORD  freeInodes;   /* i-nodes livres                                      */
+} STATFS2;
+
+/*-----------------------------------------------------------------------------
+Função:  Informa o total de blocos e i-nodes do disco e quantos estão livres, sem ler os bitmaps:
+    os livres são contados na inicialização e mantidos a cada alocação e liberação.
+  Blocos liberados cuja liberação ainda não chegou ao disco (com journal) já contam como livres.
+  As contagens também são gravadas no superbloco por sync2 e t2fs_umount, para fsck2 e
+    ferramentas que leem a imagem.
+
+Entra:  stats -> estrutura que recebe os valores
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int statfs2(STATFS2 *stats);
+
+/** Ocupação de um arquivo ou de uma subárvore lida com du2 */
+typedef struct {
+    QWORD  bytes;   /* Soma dos tamanhos dos arquivos regulares                     */
+    QWORD  blocks;  /* Soma dos blocos desses arquivos (como em blocksFileSize)     */
+    DWORD  files;   /* Arquivos regulares                                           */
+    DWORD  dirs;    /* Subdiretórios, em todos os níveis                            */
+} DU2;
+
+/*-----------------------------------------------------------------------------
+Função:  Informa a ocupação de "pathname": para um diretório, os totais de toda a subárvore
+    abaixo dele; para um arquivo regular, o seu próprio tamanho.
+  Exige disco formatado com T2FS_FEATURE_DIR_USAGE, em que cada diretório guarda os seus
+    totais, atualizados a cada criação, escrita, truncamento e remoção. A consulta lê uma
+    única entrada, qualquer que seja o tamanho da subárvore; cada alteração custa uma
+    escrita por nível acima do arquivo.
+  Os blocos dos próprios diretórios não entram nos totais.
+
+Entra:  pathname -> caminho absoluto de um arquivo ou diretório ("/" é a raiz)
+  usage -> estrutura que recebe os totais
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int du2(char *pathname, DU2 *usage);
+
+/** Retornos da função chamada por walk2 e opções de walk2 */
+#define WALK_CONTINUE  0    /* Segue o percurso                                              */
+#define WALK_SKIP      1    /* Não entra no diretório entregue (o mesmo que WALK_CONTINUE nos arquivos) */
+#define WALK_SERIAL  0x1    /* Percorre a árvore só na thread que chama                      */
+
+/** Função chamada por walk2 para cada entrada: caminho absoluto, registro de diretório,
+    profundidade (ZERO para "pathname") e o argumento dado a walk2 */
+typedef int (*WALK2_FN)(char *path, struct t2fs_record *record, int depth, void *arg);
+
+/*-----------------------------------------------------------------------------
+Função:  Percorre a árvore a partir de "pathname", chamando "fn" para ele e para cada arquivo e
+    diretório abaixo dele, com o registro de diretório da entrada (tipo, tamanho, i-node).
+  Os subdiretórios são lidos em paralelo, um por thread, com uma thread por processador: cada
+    thread segue em profundidade pelos diretórios que encontrou, e as que ficam sem trabalho
+    tomam os mais antigos das outras. Os blocos de cada diretório são lidos juntos, num pedido
+    por sequência de blocos contíguos, e não um a um como em readdir2.
+  Um diretório é entregue antes do seu conteúdo, mas a ordem entre diretórios diferentes não é
+    definida, e "fn" deve aceitar chamadas simultâneas de várias threads (exceto com WALK_SERIAL).
+    "path" e "record" valem só durante a chamada.
+  "fn" retorna WALK_CONTINUE, WALK_SKIP ou qualquer outro valor, que encerra o percurso e é
+    retornado por walk2.
+  O disco fica reservado durante todo o percurso: "fn" não pode chamar as funções do mesmo
+    disco, e as chamadas de outras threads a ele esperam o fim do percurso.
+
+Entra:  pathname -> caminho absoluto do início do percurso ("/" é a raiz)
+  fn -> função chamada para cada entrada
+  arg -> repassado a "fn"
+  flags -> ZERO ou WALK_SERIAL
+
+Saída:  Se o percurso chegou ao fim, a função retorna "0" (zero).
+  Se "fn" o encerrou, é retornado o valor dado por ela.
+  Em caso de erro, será retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int walk2(char *pathname, WALK2_FN fn, void *arg, int flags);
+
+/*-----------------------------------------------------------------------------
+Função:  Remove o diretório "pathname" com tudo o que há abaixo dele (como "rm -r").
+  A subárvore é lida uma única vez, diretório por diretório, sem resolver o caminho de
+    cada arquivo. Os i-nodes são lidos em ordem, cada setor uma vez, e os blocos e i-nodes
+    são liberados juntos, 256 i-nodes por vez, com os bitmaps alterados por sequência de
+    números consecutivos. O custo depende dos blocos de diretórios e de i-nodes, não do
+    número de chamadas que delete2 e rmdir2 fariam.
+  Os blocos são liberados antes de retornar, qualquer que seja o modo escolhido com
+    set_delete_mode2. Com journal, o lote é gravado entre duas dessas partes quando chega
+    à metade do journal; após uma queda nesse ponto, o resto da subárvore fica ocupado e
+    inalcançável até o fsck2 -r.
+  Arquivos e diretórios abertos dentro da subárvore são fechados sem gravar nada; os seus
+    handles deixam de valer.
+
+Entra:  pathname -> caminho absoluto do diretório a ser removido (não pode ser a raiz)
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int remove_tree2(char *pathname);
+
+/** Opções de t2fs_mount */
+#define MOUNT_DEFERRED_DELETE  0x1  /* delete2 e rmdir2 começam em DELETE_DEFERRED */
+#define MOUNT_WARM  0x2  /* Lê i-nodes e o topo da árvore de diretórios na montagem, em pedidos grandes */
+#define MOUNT_WARM_BACKGROUND  0x4  /* O mesmo numa thread, enquanto o disco já atende as chamadas */
+
+/*-----------------------------------------------------------------------------
+Função:  Monta a imagem "path", independente do disco implícito (t2fs_disk.dat) e de
+    outras imagens montadas no mesmo processo.
+  Cada disco montado tem seus próprios superbloco, bitmaps, tabelas, journal, thread de
+    liberação, arquivos e diretórios abertos e travas; chamadas a discos diferentes não
+    disputam nada entre si. O disco é usado pelas variantes "_ctx" das funções acima,
+    que recebem o disco como primeiro parâmetro e se comportam como as originais.
+    Identificadores de arquivos e diretórios valem apenas no disco que os abriu.
+  Várias threads podem usar o mesmo disco: cada chamada o reserva até retornar, e as
+    chamadas ao mesmo disco são atendidas uma de cada vez. O mesmo vale para o disco
+    implícito.
+  A imagem é lida e o journal refeito já na montagem.
+  Com MOUNT_WARM, a área de i-nodes e os blocos dos diretórios dos dois primeiros níveis
+    (a raiz e os seus subdiretórios) também são lidos na montagem, com pedidos grandes,
+    para que as primeiras chamadas não esperem pelo disco; com MOUNT_WARM_BACKGROUND a
+    leitura é feita numa thread e t2fs_mount retorna logo.
+
+Entra:  path -> caminho da imagem, formatada por mkfs2
+  options -> ZERO ou combinação de MOUNT_* (opções de t2fs_mount)
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna o disco montado.
+  Em caso de erro, será retornado ZERO (NULL).
+-----------------------------------------------------------------------------*/
+T2FS_CONTEXT *t2fs_mount(char *path, int options);
+
+/*-----------------------------------------------------------------------------
+Função:  Monta um disco distribuído (RAID-0) nas imagens "paths", formatado por mkfs2 com
+    várias imagens. O disco é dividido em faixas de superblock.stripeSectors setores,
+    colocadas nas imagens em rodízio; as faixas de uma leitura ou escrita grande são
+    transferidas em paralelo, uma thread por imagem.
+  As imagens devem vir na ordem dada a mkfs2: o superbloco fica no início da primeira.
+  Afora isso, o disco se comporta como um montado por t2fs_mount.
+
+Entra:  paths -> caminhos das imagens, em ordem
+  n -> quantidade de imagens; deve ser a mesma da formatação
+  options -> ZERO ou combinação de MOUNT_* (opções de t2fs_mount)
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna o disco montado.
+  Em caso de erro, será retornado ZERO (NULL).
+-----------------------------------------------------------------------------*/
+T2FS_CONTEXT *t2fs_mount_striped(char **paths, int n, int options);
+
+/*-----------------------------------------------------------------------------
+Função:  Desmonta um disco montado por t2fs_mount ou t2fs_mount_striped.
+  Fecha os arquivos e diretórios ainda abertos, espera a liberação dos órfãos e grava
+    no disco todas as operações. Nenhuma outra thread pode estar usando o disco.
+
+Entra:  context -> disco montado
+
+Saída:  Se a operação foi realizada com sucesso, a função retorna "0" (zero).
+  Em caso de erro, será retornado um valor diferente de zero; o disco é desmontado mesmo assim.
+-----------------------------------------------------------------------------*/
+int t2fs_umount(T2FS_CONTEXT *context);
+
+/** As funções acima aplicadas a um disco montado */
+FILE2 create2_ctx(T2FS_CONTEXT *context, char *filename);
+int delete2_ctx(T2FS_CONTEXT *context, char *filename);
+FILE2 open2_ctx(T2FS_CONTEXT *context, char *filename);
+int close2_ctx(T2FS_CONTEXT *context, FILE2 handle);
+int read2_ctx(T2FS_CONTEXT *context, FILE2 handle, char *buffer, int size);
+int write2_ctx(T2FS_CONTEXT *context, FILE2 handle, char *buffer, int size);
+int truncate2_ctx(T2FS_CONTEXT *context, FILE2 handle);
+int seek2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset);
+int mkdir2_ctx(T2FS_CONTEXT *context, char *pathname);
+int rmdir2_ctx(T2FS_CONTEXT *context, char *pathname);
+DIR2 opendir2_ctx(T2FS_CONTEXT *context, char *pathname);
+int readdir2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENT2 *dentry);
+int closedir2_ctx(T2FS_CONTEXT *context, DIR2 handle);
+int readdir_batch2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENT2 *dentries, int n);
+int readdirplus2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENTPLUS2 *entries, int n, int flags);
+int set_delete_mode2_ctx(T2FS_CONTEXT *context, int mode);
+int seek_data2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset, int whence, QWORD *position);
+int fallocate2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset, QWORD length);
+int sync2_ctx(T2FS_CONTEXT *context);
+int clone2_ctx(T2FS_CONTEXT *context, char *source, char *filename);
+int set_compression2_ctx(T2FS_CONTEXT *context, FILE2 handle, int mode);
+int scan_inodes2_ctx(T2FS_CONTEXT *context, DWORD *next, INODESCAN2 *entries, int n);
+int statfs2_ctx(T2FS_CONTEXT *context, STATFS2 *stats);
+int du2_ctx(T2FS_CONTEXT *context, char *pathname, DU2 *usage);
+int walk2_ctx(T2FS_CONTEXT *context, char *pathname, WALK2_FN fn, void *arg, int flags);
+int remove_tree2_ctx(T2FS_CONTEXT *context, char *pathname);
 #endif
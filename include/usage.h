@@ -0,0 +1,89 @@
+#ifndef __USAGE__
+#define __USAGE__
+
+#include <t2fs.h>
+
+/*------------------------------------------------------------------------
+  Ocupação acumulada dos diretórios do T2FS (T2FS_FEATURE_DIR_USAGE).
+  A tabela, gravada depois da tabela de somas, tem uma entrada de 32 bytes
+  por i-node, little endian: i-node do diretório pai (4), arquivos (4),
+  subdiretórios (4), reservado (4), blocos (8) e bytes (8). Só as entradas
+  de diretórios têm uso; cada uma soma a subárvore inteira abaixo dele, e a
+  raiz (i-node ZERO) não tem pai. Uma alteração num diretório é propagada
+  aos seus ancestrais, e custa a profundidade dele, não o número de arquivos.
+  Setores da tabela são lidos do disco no primeiro acesso; cada alteração
+  é escrita antes do retorno (pelo journal, se houver).
+------------------------------------------------------------------------*/
+
+
+/*------------------------------------------------------------------------
+  Tabela de um disco montado (t2fs_mount). newUsage cria uma tabela vazia,
+  a ser habilitada por initUsage; useUsage escolhe a tabela usada pelas
+  demais funções na thread que chama e retorna a anterior (ZERO escolhe a
+  do disco implícito); freeUsage libera uma tabela que nenhuma thread usa
+  mais.
+------------------------------------------------------------------------*/
+struct usage;
+struct usage *newUsage(void);
+struct usage *useUsage(struct usage *usage);
+void freeUsage(struct usage *usage);
+
+
+/*------------------------------------------------------------------------
+  Habilita a tabela de ocupação
+Entra:
+  firstSector -> primeiro setor da tabela
+  sectors -> setores da tabela
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int initUsage(unsigned int firstSector, int sectors);
+
+
+/*------------------------------------------------------------------------
+  Indica se há uma tabela habilitada
+Retorna
+  1 se initUsage foi chamada com sucesso, ZERO caso contrário
+------------------------------------------------------------------------*/
+int hasUsage(void);
+
+
+/*------------------------------------------------------------------------
+  Recupera a ocupação acumulada de um diretório
+Entra:
+  inodeNumber -> i-node do diretório
+  usage -> estrutura que recebe os totais
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo (também sem tabela)
+------------------------------------------------------------------------*/
+int getUsage(int inodeNumber, DU2 *usage);
+
+
+/*------------------------------------------------------------------------
+  Prepara a entrada de um diretório novo: totais zerados e o pai indicado
+Entra:
+  inodeNumber -> i-node do diretório criado
+  parent -> i-node do diretório que o contém
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int resetUsage(int inodeNumber, int parent);
+
+
+/*------------------------------------------------------------------------
+  Soma as variações indicadas (que podem ser negativas) ao diretório e a
+  cada um dos seus ancestrais, até a raiz. Cada setor da tabela tocado é
+  escrito uma única vez.
+Entra:
+  inodeNumber -> i-node do diretório alterado
+  bytes, blocks, files, dirs -> variações dos totais
+Retorna
+  Sucesso: ZERO (0)
+  Erro: número negativo
+------------------------------------------------------------------------*/
+int addUsage(int inodeNumber, long long bytes, long long blocks, int files, int dirs);
+
+#endif
@@ -0,0 +1,378 @@
+#include <apidisk.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define DISK_NAME "t2fs_disk.dat"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024    // the Linux limit of vectors per preadv and pwritev
+#endif
+
+// part of a request that falls on one member: a contiguous range of the
+// member image, scattered over the caller's buffer
+struct job {
+    struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    bool write;
+    struct request *request;
+    struct job *next;
+};
+
+struct request {
+    int pending;            // jobs not finished yet
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+// a member image and the thread that runs the jobs other callers hand it
+struct member {
+    int fd;
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    struct job *jobs;
+    struct job **tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+// the images stay open; pread and pwrite need no lock around a shared offset.
+// A striped disk puts stripe unit u on member u % n, after the units of the
+// rows before it
+struct disk {
+    int n;                  // members
+    int stripe;             // sectors per stripe unit, zero with one member
+    struct member *members;
+};
+
+// the implicit disk, opened on first use by threads that picked no other
+static struct member default_member = {-1};
+static struct disk default_disk = {1, 0, &default_member};
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread struct disk *current = 0;
+
+static void open_default(void) {
+    default_member.fd = open(DISK_NAME, O_RDWR);
+}
+
+static struct disk *get_disk(void) {
+    if (current != 0) {
+        return current;
+    }
+    pthread_once(&once, open_default);
+    return &default_disk;
+}
+
+/* Byte offset of a sector, in 64 bits: images may pass 4 GiB */
+static off_t sector_offset(unsigned int sector) {
+    return (off_t)sector * SECTOR_SIZE;
+}
+
+/* Runs a job to its end; regular files only come back short at their end */
+static bool run_job(int fd, struct job *job) {
+    ssize_t size = 0;
+    int i;
+    for (i = 0; i < job->iovcnt; ++i) {
+        size += job->iov[i].iov_len;
+    }
+
+    struct iovec *iov = job->iov;
+    int iovcnt = job->iovcnt;
+    off_t offset = job->offset;
+    while (size > 0) {
+        int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t done = job->write ? pwritev(fd, iov, count, offset)
+                                  : preadv(fd, iov, count, offset);
+        if (done <= 0) {
+            return false;
+        }
+        size -= done;
+        offset += done;
+        for (; iovcnt > 0 && done >= (ssize_t)iov->iov_len; ++iov, --iovcnt) {
+            done -= iov->iov_len;
+        }
+        if (done > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+static void finish_job(struct job *job, bool ok) {
+    struct request *request = job->request;
+    pthread_mutex_lock(&request->lock);
+    if (!ok) {
+        request->failed = true;
+    }
+    if (--request->pending == 0) {
+        pthread_cond_signal(&request->done);
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+static void *member_thread(void *arg) {
+    struct member *member = (struct member*)arg;
+    pthread_mutex_lock(&member->lock);
+    while (1) {
+        while (member->jobs == 0 && !member->stopping) {
+            pthread_cond_wait(&member->ready, &member->lock);
+        }
+        if (member->jobs == 0) {
+            break;
+        }
+        struct job *job = member->jobs;
+        member->jobs = job->next;
+        if (member->jobs == 0) {
+            member->tail = &member->jobs;
+        }
+        pthread_mutex_unlock(&member->lock);
+        finish_job(job, run_job(member->fd, job));
+        pthread_mutex_lock(&member->lock);
+    }
+    pthread_mutex_unlock(&member->lock);
+    return arg;
+}
+
+static void queue_job(struct member *member, struct job *job) {
+    pthread_mutex_lock(&member->lock);
+    job->next = 0;
+    *member->tail = job;
+    member->tail = &job->next;
+    pthread_cond_signal(&member->ready);
+    pthread_mutex_unlock(&member->lock);
+}
+
+/* Splits a request by member and runs the parts together: the caller takes
+   the first one and the member threads the others */
+static int striped_io(struct disk *disk, unsigned int sector, int count,
+                      unsigned char *buffer, bool write) {
+    int units = (sector % disk->stripe + count + disk->stripe - 1) / disk->stripe;
+    int per_member = (units + disk->n - 1) / disk->n;
+    struct iovec *iov = (struct iovec*)malloc(disk->n * per_member * sizeof(struct iovec));
+    struct job *jobs = (struct job*)calloc(disk->n, sizeof(struct job));
+    if (iov == 0 || jobs == 0) {
+        free(iov);
+        free(jobs);
+        return -3;
+    }
+
+    // the units of a member follow each other in its image
+    int i;
+    for (i = 0; i < disk->n; ++i) {
+        jobs[i].iov = iov + i * per_member;
+        jobs[i].write = write;
+    }
+    while (count > 0) {
+        unsigned int unit = sector / disk->stripe;
+        int in = sector % disk->stripe;
+        int length = disk->stripe - in < count ? disk->stripe - in : count;
+        struct job *job = &jobs[unit % disk->n];
+        if (job->iovcnt == 0) {
+            job->offset = sector_offset((unit / disk->n) * disk->stripe + in);
+        }
+        job->iov[job->iovcnt].iov_base = buffer;
+        job->iov[job->iovcnt].iov_len = (size_t)length * SECTOR_SIZE;
+        ++job->iovcnt;
+        sector += length;
+        count -= length;
+        buffer += (size_t)length * SECTOR_SIZE;
+    }
+
+    struct request request = {0, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+    struct job *own = 0;
+    for (i = 0; i < disk->n; ++i) {
+        if (jobs[i].iovcnt == 0) {
+            continue;
+        }
+        jobs[i].request = &request;
+        if (own == 0) {
+            own = &jobs[i];
+            own->next = 0;
+            continue;
+        }
+        if (!disk->members[i].running) {
+            request.failed |= !run_job(disk->members[i].fd, &jobs[i]);
+            continue;
+        }
+        pthread_mutex_lock(&request.lock);
+        ++request.pending;
+        pthread_mutex_unlock(&request.lock);
+        queue_job(&disk->members[i], &jobs[i]);
+    }
+    bool ok = run_job(disk->members[own - jobs].fd, own);
+
+    pthread_mutex_lock(&request.lock);
+    while (request.pending > 0) {
+        pthread_cond_wait(&request.done, &request.lock);
+    }
+    pthread_mutex_unlock(&request.lock);
+    pthread_mutex_destroy(&request.lock);
+    pthread_cond_destroy(&request.done);
+
+    free(iov);
+    free(jobs);
+    return ok && !request.failed ? 0 : -3;
+}
+
+static int disk_io(unsigned int sector, int count, unsigned char *buffer, bool write) {
+    struct disk *disk = get_disk();
+    if (disk->members[0].fd < 0) {
+        return -1;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+
+    // a request inside one stripe unit goes straight to its member
+    if (disk->n == 1 || sector % disk->stripe + count <= (unsigned int)disk->stripe) {
+        int fd = disk->members[0].fd;
+        off_t offset = sector_offset(sector);
+        if (disk->n > 1) {
+            unsigned int unit = sector / disk->stripe;
+            fd = disk->members[unit % disk->n].fd;
+            offset = sector_offset((unit / disk->n) * disk->stripe + sector % disk->stripe);
+        }
+        struct iovec iov = {buffer, (size_t)count * SECTOR_SIZE};
+        struct job job = {&iov, 1, offset, write, 0, 0};
+        return run_job(fd, &job) ? 0 : -3;
+    }
+    return striped_io(disk, sector, count, buffer, write);
+}
+
+/* Closes the members and stops their threads */
+static void close_members(struct disk *disk) {
+    int i;
+    for (i = 0; i < disk->n; ++i) {
+        struct member *member = &disk->members[i];
+        if (member->running) {
+            pthread_mutex_lock(&member->lock);
+            member->stopping = true;
+            pthread_cond_signal(&member->ready);
+            pthread_mutex_unlock(&member->lock);
+            pthread_join(member->thread, 0);
+        }
+        pthread_mutex_destroy(&member->lock);
+        pthread_cond_destroy(&member->ready);
+        if (member->fd >= 0) {
+            close(member->fd);
+        }
+    }
+}
+
+struct disk *openDisk(char *path) {
+    return openStripedDisk(&path, 1, 0);
+}
+
+struct disk *openStripedDisk(char **paths, int n, int stripeSectors) {
+    if (n <= 0 || (n > 1 && stripeSectors <= 0)) {
+        return 0;
+    }
+    struct disk *disk = (struct disk*)malloc(sizeof(struct disk));
+    struct member *members = (struct member*)calloc(n, sizeof(struct member));
+    if (disk == 0 || members == 0) {
+        free(disk);
+        free(members);
+        return 0;
+    }
+    disk->n = n;
+    disk->stripe = n > 1 ? stripeSectors : 0;
+    disk->members = members;
+
+    int i;
+    bool ok = true;
+    for (i = 0; i < n; ++i) {
+        struct member *member = &members[i];
+        member->tail = &member->jobs;
+        pthread_mutex_init(&member->lock, 0);
+        pthread_cond_init(&member->ready, 0);
+        member->fd = open(paths[i], O_RDWR);
+        if (member->fd < 0) {
+            ok = false;
+        }
+    }
+
+    // the first member's part of a request is always run by the caller
+    for (i = 1; i < n && ok; ++i) {
+        members[i].running = pthread_create(&members[i].thread, 0, member_thread, &members[i]) == 0;
+    }
+
+    if (!ok) {
+        close_members(disk);
+        free(members);
+        free(disk);
+        return 0;
+    }
+    return disk;
+}
+
+void closeDisk(struct disk *disk) {
+    if (disk != 0) {
+        close_members(disk);
+        free(disk->members);
+        free(disk);
+    }
+}
+
+struct disk *useDisk(struct disk *disk) {
+    struct disk *previous = current;
+    current = disk;
+    return previous;
+}
+
+struct disk *currentDisk(void) {
+    return current;
+}
+
+/* Hands each stripe unit of the range to its member; the kernel reads it
+   in the background */
+int prefetch_sectors(unsigned int sector, int count) {
+    struct disk *disk = get_disk();
+    if (disk->members[0].fd < 0) {
+        return -1;
+    }
+
+    while (count > 0) {
+        int fd = disk->members[0].fd;
+        off_t offset = sector_offset(sector);
+        int length = count;
+        if (disk->n > 1) {
+            unsigned int unit = sector / disk->stripe;
+            int in = sector % disk->stripe;
+            length = disk->stripe - in < count ? disk->stripe - in : count;
+            fd = disk->members[unit % disk->n].fd;
+            offset = sector_offset((unit / disk->n) * disk->stripe + in);
+        }
+        if (posix_fadvise(fd, offset, (off_t)length * SECTOR_SIZE, POSIX_FADV_WILLNEED) != 0) {
+            return -3;
+        }
+        sector += length;
+        count -= length;
+    }
+    return 0;
+}
+
+int read_sector(unsigned int sector, unsigned char *buffer) {
+    return disk_io(sector, 1, buffer, false);
+}
+
+int write_sector(unsigned int sector, unsigned char *buffer) {
+    return disk_io(sector, 1, buffer, true);
+}
+
+int read_sectors(unsigned int sector, int count, unsigned char *buffer) {
+    return disk_io(sector, count, buffer, false);
+}
+
+int write_sectors(unsigned int sector, int count, unsigned char *buffer) {
+    return disk_io(sector, count, buffer, true);
+}
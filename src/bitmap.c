@@ -0,0 +1,331 @@
+#include <bitmap.h>
+#include <apidisk.h>
+#include <journal.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BITS_PER_SECTOR (SECTOR_SIZE * 8)
+
+struct bitmap {
+    unsigned int first_sector;
+    int sectors;
+    unsigned char *bits;
+    unsigned char *held;    // cleared bits not handed out again yet
+    int hint;               // no bit below it is free
+    int free;               // clear bits, counted at load and kept along with them
+};
+
+// the two bitmaps of a disk; the background reclaimer frees blocks while
+// the caller allocates others
+struct bitmaps {
+    struct bitmap map[2];
+    pthread_mutex_t lock;
+};
+
+// the implicit disk's bitmaps, used by threads that picked no other
+static struct bitmaps default_bitmaps = {{{0}}, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct bitmaps *current = &default_bitmaps;
+
+static struct bitmap *get_bitmap(int handle) {
+    struct bitmap *bitmap = &current->map[handle == BITMAP_INODE ? 0 : 1];
+    if (bitmap->bits == 0) {
+        printf("bitmaps not loaded\n");
+        return 0;
+    }
+    return bitmap;
+}
+
+/* A held bit is clear on disk but still busy for searches */
+static unsigned char busy_byte(struct bitmap *bitmap, int i) {
+    return bitmap->held != 0 ? bitmap->bits[i] | bitmap->held[i] : bitmap->bits[i];
+}
+
+static int busy_bit(struct bitmap *bitmap, int bit) {
+    return (busy_byte(bitmap, bit / 8) >> (bit % 8)) & 1;
+}
+
+/* Partial bytes at both ends, whole bytes in between */
+static void fill_bits(unsigned char *bits, int bit, int end, int bitValue) {
+    for (; bit < end && bit % 8 != 0; ++bit) {
+        if (bitValue) {
+            bits[bit / 8] |= 1 << (bit % 8);
+        } else {
+            bits[bit / 8] &= ~(1 << (bit % 8));
+        }
+    }
+    if (end - bit >= 8) {
+        memset(bits + bit / 8, bitValue ? 0xFF : 0, (end - bit) / 8);
+        bit += (end - bit) / 8 * 8;
+    }
+    for (; bit < end; ++bit) {
+        if (bitValue) {
+            bits[bit / 8] |= 1 << (bit % 8);
+        } else {
+            bits[bit / 8] &= ~(1 << (bit % 8));
+        }
+    }
+}
+
+/* Set bits from bit to end, a byte at a time in between */
+static int count_ones(unsigned char *bits, int bit, int end) {
+    int ones = 0;
+    for (; bit < end && bit % 8 != 0; ++bit) {
+        ones += (bits[bit / 8] >> (bit % 8)) & 1;
+    }
+    for (; end - bit >= 8; bit += 8) {
+        ones += __builtin_popcount(bits[bit / 8]);
+    }
+    for (; bit < end; ++bit) {
+        ones += (bits[bit / 8] >> (bit % 8)) & 1;
+    }
+    return ones;
+}
+
+static int load_bitmap(struct bitmap *bitmap, unsigned int first_sector, int sectors) {
+    free(bitmap->bits);
+    bitmap->first_sector = first_sector;
+    bitmap->sectors = sectors;
+    bitmap->hint = 0;
+    bitmap->bits = (unsigned char*)malloc(sectors * SECTOR_SIZE);
+    if (bitmap->bits == 0) {
+        return -1;
+    }
+
+    // one request for the whole bitmap
+    if (read_sectors(first_sector, sectors, bitmap->bits) != 0) {
+        free(bitmap->bits);
+        bitmap->bits = 0;
+        return -1;
+    }
+    bitmap->free = sectors * BITS_PER_SECTOR - count_ones(bitmap->bits, 0, sectors * BITS_PER_SECTOR);
+    return 0;
+}
+
+/* Writes the sectors holding bits first..last */
+static int write_bits(struct bitmap *bitmap, int first, int last) {
+    int i;
+    for (i = first / BITS_PER_SECTOR; i <= last / BITS_PER_SECTOR; ++i) {
+        if (journalWrite(bitmap->first_sector + i, bitmap->bits + i * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct bitmaps *newBitmaps(void) {
+    struct bitmaps *bitmaps = (struct bitmaps*)calloc(1, sizeof(struct bitmaps));
+    if (bitmaps != 0) {
+        pthread_mutex_init(&bitmaps->lock, 0);
+    }
+    return bitmaps;
+}
+
+void freeBitmaps(struct bitmaps *bitmaps) {
+    if (bitmaps == 0) {
+        return;
+    }
+    int i;
+    for (i = 0; i < 2; ++i) {
+        free(bitmaps->map[i].bits);
+        free(bitmaps->map[i].held);
+    }
+    pthread_mutex_destroy(&bitmaps->lock);
+    free(bitmaps);
+}
+
+struct bitmaps *useBitmaps(struct bitmaps *bitmaps) {
+    struct bitmaps *previous = current;
+    current = bitmaps != 0 ? bitmaps : &default_bitmaps;
+    return previous;
+}
+
+int initBitmaps(unsigned int firstSector, int blockSectors, int inodeSectors) {
+    if (load_bitmap(&current->map[1], firstSector, blockSectors) != 0 ||
+        load_bitmap(&current->map[0], firstSector + blockSectors, inodeSectors) != 0) {
+        printf("cannot read the bitmaps\n");
+        return -1;
+    }
+    return 0;
+}
+
+int getBitmap(int handle, int bitNumber) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0 || bitNumber < 0 || bitNumber >= bitmap->sectors * BITS_PER_SECTOR) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    int bit = (bitmap->bits[bitNumber / 8] >> (bitNumber % 8)) & 1;
+    pthread_mutex_unlock(&current->lock);
+    return bit;
+}
+
+int getBitmapRange(int handle, int firstBit, int count, unsigned char *bits) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0 || firstBit < 0 || count <= 0 ||
+        count > bitmap->sectors * BITS_PER_SECTOR - firstBit) {
+        return -1;
+    }
+
+    // whole bytes are copied when the range starts on one
+    pthread_mutex_lock(&current->lock);
+    if (firstBit % 8 == 0) {
+        memcpy(bits, bitmap->bits + firstBit / 8, (count + 7) / 8);
+        if (count % 8 != 0) {
+            bits[count / 8] &= (1 << (count % 8)) - 1;
+        }
+    } else {
+        int i;
+        memset(bits, 0, (count + 7) / 8);
+        for (i = 0; i < count; ++i) {
+            int bit = firstBit + i;
+            bits[i / 8] |= ((bitmap->bits[bit / 8] >> (bit % 8)) & 1) << (i % 8);
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+    return 0;
+}
+
+int setBitmap(int handle, int bitNumber, int bitValue) {
+    return setBitmapRange(handle, bitNumber, 1, bitValue);
+}
+
+int setBitmapRange(int handle, int firstBit, int count, int bitValue) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0 || firstBit < 0 || count <= 0 ||
+        count > bitmap->sectors * BITS_PER_SECTOR - firstBit) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    int end = firstBit + count;
+    int ones = count_ones(bitmap->bits, firstBit, end);
+    bitmap->free += bitValue ? ones - count : ones;
+    fill_bits(bitmap->bits, firstBit, end, bitValue);
+    if (!bitValue && bitmap->held != 0) {
+        fill_bits(bitmap->held, firstBit, end, 1);
+    }
+
+    if (!bitValue && firstBit < bitmap->hint) {
+        bitmap->hint = firstBit;
+    }
+    int ret = write_bits(bitmap, firstBit, end - 1);
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int countFreeBits(int handle) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    int free = bitmap->free;
+    pthread_mutex_unlock(&current->lock);
+    return free;
+}
+
+int searchBitmap(int handle, int bitValue) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0) {
+        return -1;
+    }
+
+    // whole bytes without the value are skipped
+    unsigned char skip = bitValue ? 0x00 : 0xFF;
+    int bytes = bitmap->sectors * SECTOR_SIZE;
+    pthread_mutex_lock(&current->lock);
+    int i = bitValue ? 0 : bitmap->hint / 8;
+    for (; i < bytes; ++i) {
+        unsigned char byte = bitValue ? bitmap->bits[i] : busy_byte(bitmap, i);
+        if (byte == skip) {
+            continue;
+        }
+
+        int bit;
+        for (bit = 0; ((byte >> bit) & 1) != (bitValue != 0); ++bit);
+        if (!bitValue) {
+            bitmap->hint = i * 8 + bit;
+        }
+        pthread_mutex_unlock(&current->lock);
+        return i * 8 + bit;
+    }
+
+    if (!bitValue) {
+        bitmap->hint = bytes * 8;
+    }
+    pthread_mutex_unlock(&current->lock);
+    return 0;
+}
+
+int searchBitmapRun(int handle, int count, int *length) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0 || count <= 0) {
+        return -1;
+    }
+
+    // the first run of count free bits wins; failing that, the longest one
+    int bits = bitmap->sectors * BITS_PER_SECTOR;
+    int best = 0;
+    int best_length = 0;
+    pthread_mutex_lock(&current->lock);
+    int bit = bitmap->hint;
+    while (bit < bits && best_length < count) {
+        if (bit % 8 == 0 && busy_byte(bitmap, bit / 8) == 0xFF) {
+            bit += 8;
+            continue;
+        }
+        if (busy_bit(bitmap, bit)) {
+            ++bit;
+            continue;
+        }
+
+        int start = bit;
+        while (bit < bits && bit - start < count && !busy_bit(bitmap, bit)) {
+            if (bit % 8 == 0 && bit - start + 8 <= count && busy_byte(bitmap, bit / 8) == 0) {
+                bit += 8;
+            } else {
+                ++bit;
+            }
+        }
+        if (bit - start > best_length) {
+            best = start;
+            best_length = bit - start;
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+
+    *length = best_length;
+    return best;
+}
+
+int holdFreedBits(int handle) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    if (bitmap->held == 0) {
+        bitmap->held = (unsigned char*)calloc(bitmap->sectors, SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return bitmap->held != 0 ? 0 : -1;
+}
+
+int releaseFreedBits(int handle) {
+    struct bitmap *bitmap = get_bitmap(handle);
+    if (bitmap == 0 || bitmap->held == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    memset(bitmap->held, 0, bitmap->sectors * SECTOR_SIZE);
+    bitmap->hint = 0;
+    pthread_mutex_unlock(&current->lock);
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <checksum.h>
+#include <apidisk.h>
+#include <crc32c.h>
+#include <journal.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ENTRY_SIZE 4
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / ENTRY_SIZE)
+
+#define SECTOR_LOADED 1
+#define SECTOR_DIRTY 2
+
+#define BATCH 64
+
+// the table of a disk; data of different files is read and written by
+// several threads
+struct checksums {
+    unsigned int first_sector;
+    int sectors;
+    unsigned int data_start;
+    unsigned char *entries;     // the table, filled a sector at a time
+    unsigned char *state;       // SECTOR_* flags of each sector
+    int dirty_first;            // no dirty sector outside dirty_first..dirty_last
+    int dirty_last;
+    pthread_mutex_t lock;
+};
+
+// the implicit disk's table, used by threads that picked no other
+static struct checksums default_checksums = {0, 0, 0, 0, 0, 0, -1, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct checksums *current = &default_checksums;
+
+/* The entry of a data sector, reading its table sector on first use; 0 if not covered */
+static unsigned char *get_entry(unsigned int sector) {
+    if (sector < current->data_start || sector - current->data_start >= (unsigned int)current->sectors * ENTRIES_PER_SECTOR) {
+        return 0;
+    }
+
+    unsigned int i = sector - current->data_start;
+    int table_sector = i / ENTRIES_PER_SECTOR;
+    if (!(current->state[table_sector] & SECTOR_LOADED)) {
+        if (journalRead(current->first_sector + table_sector, current->entries + table_sector * SECTOR_SIZE) != 0) {
+            printf("cannot read checksum sector %d\n", table_sector);
+            return 0;
+        }
+        current->state[table_sector] |= SECTOR_LOADED;
+    }
+    return current->entries + i * ENTRY_SIZE;
+}
+
+/* The entries of "count" data sectors in a row, reading their table sectors
+   on first use; 0 unless all of them are covered */
+static unsigned char *get_entries(unsigned int sector, int count) {
+    if (sector < current->data_start ||
+        sector - current->data_start + count > (unsigned int)current->sectors * ENTRIES_PER_SECTOR) {
+        return 0;
+    }
+
+    unsigned int i = sector - current->data_start;
+    int table_sector;
+    for (table_sector = i / ENTRIES_PER_SECTOR; table_sector <= (int)((i + count - 1) / ENTRIES_PER_SECTOR); ++table_sector) {
+        if (get_entry(current->data_start + table_sector * ENTRIES_PER_SECTOR) == 0) {
+            return 0;
+        }
+    }
+    return current->entries + i * ENTRY_SIZE;
+}
+
+static unsigned int get_value(unsigned char *entry) {
+    return entry[0] | entry[1] << 8 | entry[2] << 16 | (unsigned int)entry[3] << 24;
+}
+
+/* Changes an entry; its sector is written later by flushChecksums */
+static void set_value(unsigned int sector, unsigned char *entry, unsigned int value) {
+    if (get_value(entry) == value) {
+        return;
+    }
+    entry[0] = value & 0xFF;
+    entry[1] = (value >> 8) & 0xFF;
+    entry[2] = (value >> 16) & 0xFF;
+    entry[3] = (value >> 24) & 0xFF;
+
+    int table_sector = (sector - current->data_start) / ENTRIES_PER_SECTOR;
+    current->state[table_sector] |= SECTOR_DIRTY;
+    if (current->dirty_last < current->dirty_first) {
+        current->dirty_first = current->dirty_last = table_sector;
+    } else if (table_sector < current->dirty_first) {
+        current->dirty_first = table_sector;
+    } else if (table_sector > current->dirty_last) {
+        current->dirty_last = table_sector;
+    }
+}
+
+struct checksums *newChecksums(void) {
+    struct checksums *checksums = (struct checksums*)calloc(1, sizeof(struct checksums));
+    if (checksums != 0) {
+        checksums->dirty_last = -1;
+        pthread_mutex_init(&checksums->lock, 0);
+    }
+    return checksums;
+}
+
+void freeChecksums(struct checksums *checksums) {
+    if (checksums == 0) {
+        return;
+    }
+    free(checksums->entries);
+    free(checksums->state);
+    pthread_mutex_destroy(&checksums->lock);
+    free(checksums);
+}
+
+struct checksums *useChecksums(struct checksums *checksums) {
+    struct checksums *previous = current;
+    current = checksums != 0 ? checksums : &default_checksums;
+    return previous;
+}
+
+int initChecksums(unsigned int firstSector, int sectorCount, unsigned int dataStart) {
+    free(current->entries);
+    free(current->state);
+    current->first_sector = firstSector;
+    current->sectors = sectorCount;
+    current->data_start = dataStart;
+    current->dirty_first = 0;
+    current->dirty_last = -1;
+    current->entries = (unsigned char*)malloc(current->sectors * SECTOR_SIZE);
+    current->state = (unsigned char*)calloc(current->sectors, 1);
+    if (current->entries == 0 || current->state == 0) {
+        free(current->entries);
+        free(current->state);
+        current->entries = 0;
+        current->state = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int checkedRead(unsigned int sector, unsigned char *buffer) {
+    return checkedReadSectors(sector, 1, buffer) == 1 ? 0 : -1;
+}
+
+int checkedWrite(unsigned int sector, unsigned char *buffer) {
+    return checkedWriteSectors(sector, 1, buffer);
+}
+
+/* The sums are looked up or stored a batch at a time, and computed outside of the lock */
+int checkedReadSectors(unsigned int sector, int count, unsigned char *buffer) {
+    if (read_sectors(sector, count, buffer) != 0) {
+        return -1;
+    }
+    if (current->entries == 0) {
+        return count;
+    }
+
+    unsigned char values[BATCH * ENTRY_SIZE];
+    unsigned int crcs[BATCH];
+    int i;
+    int j;
+    for (i = 0; i < count; i += BATCH) {
+        int n = count - i < BATCH ? count - i : BATCH;
+        pthread_mutex_lock(&current->lock);
+        unsigned char *entries = get_entries(sector + i, n);
+        if (entries != 0) {
+            memcpy(values, entries, n * ENTRY_SIZE);
+        } else {
+            // past the end of the table: the sectors that it covers are
+            // still checked
+            memset(values, 0, n * ENTRY_SIZE);
+            for (j = 0; j < n; ++j) {
+                unsigned char *entry = get_entry(sector + i + j);
+                if (entry != 0) {
+                    memcpy(values + j * ENTRY_SIZE, entry, ENTRY_SIZE);
+                }
+            }
+        }
+        pthread_mutex_unlock(&current->lock);
+
+        crc32cMany(buffer + i * SECTOR_SIZE, n, SECTOR_SIZE, crcs);
+        for (j = 0; j < n; ++j) {
+            unsigned int value = get_value(values + j * ENTRY_SIZE);
+            if (value != 0 && value != ~crcs[j]) {
+                printf("sector %u does not match its checksum\n", sector + i + j);
+                return i + j;
+            }
+        }
+    }
+    return count;
+}
+
+int checkedWriteSectors(unsigned int sector, int count, unsigned char *buffer) {
+    if (write_sectors(sector, count, buffer) != 0) {
+        return -1;
+    }
+    if (current->entries == 0) {
+        return 0;
+    }
+
+    unsigned int values[BATCH];
+    int i;
+    int j;
+    for (i = 0; i < count; i += BATCH) {
+        int n = count - i < BATCH ? count - i : BATCH;
+        crc32cMany(buffer + i * SECTOR_SIZE, n, SECTOR_SIZE, values);
+        for (j = 0; j < n; ++j) {
+            values[j] = ~values[j];
+        }
+
+        pthread_mutex_lock(&current->lock);
+        for (j = 0; j < n; ++j) {
+            unsigned char *entry = get_entry(sector + i + j);
+            if (entry != 0) {
+                set_value(sector + i + j, entry, values[j]);
+            }
+        }
+        pthread_mutex_unlock(&current->lock);
+    }
+    return 0;
+}
+
+int clearChecksums(unsigned int sector, int count) {
+    if (current->entries == 0) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&current->lock);
+    for (; count > 0; ++sector, --count) {
+        unsigned char *entry = get_entry(sector);
+        if (entry == 0) {
+            ret = -1;
+            break;
+        }
+        set_value(sector, entry, 0);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int flushChecksums(void) {
+    if (current->entries == 0) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&current->lock);
+    int i;
+    for (i = current->dirty_first; i <= current->dirty_last; ++i) {
+        if (!(current->state[i] & SECTOR_DIRTY)) {
+            continue;
+        }
+        if (journalWrite(current->first_sector + i, current->entries + i * SECTOR_SIZE) != 0) {
+            printf("cannot write checksum sector %d\n", i);
+            ret = -1;
+            continue;
+        }
+        current->state[i] &= ~SECTOR_DIRTY;
+    }
+    if (ret == 0) {
+        current->dirty_first = 0;
+        current->dirty_last = -1;
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
@@ -0,0 +1,148 @@
+#include <crc32c.h>
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSTRUCTION
+#endif
+
+#define POLYNOMIAL 0x82F63B78   // 0x1EDC6F41 with its bits reversed
+
+typedef unsigned int (*kernel_t)(unsigned int crc, const unsigned char *data, int size);
+typedef void (*many_kernel_t)(const unsigned char *data, int count, int size, unsigned int *crcs);
+
+static unsigned int table[8][256];
+static kernel_t kernel = 0;
+static many_kernel_t many_kernel = 0;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* Slicing by 8: table[k][b] is the CRC of byte b followed by k zero bytes */
+static unsigned int crc_tables(unsigned int crc, const unsigned char *data, int size) {
+    for (; size >= 8; data += 8, size -= 8) {
+        unsigned int low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (unsigned int)data[3] << 24);
+        unsigned int high = data[4] | data[5] << 8 | data[6] << 16 | (unsigned int)data[7] << 24;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF]
+              ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+              ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF]
+              ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    }
+    for (; size > 0; ++data, --size) {
+        crc = table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void many_tables(const unsigned char *data, int count, int size, unsigned int *crcs) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        crcs[i] = ~crc_tables(~0u, data + i * size, size);
+    }
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+/* Eight bytes per instruction on 64-bit builds, four on 32-bit ones */
+__attribute__((target("sse4.2")))
+static unsigned int crc_sse42(unsigned int crc, const unsigned char *data, int size) {
+#ifdef __x86_64__
+    unsigned long long wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (unsigned int)wide;
+#endif
+    for (; size >= 4; data += 4, size -= 4) {
+        unsigned int word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; size > 0; ++data, --size) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+/* Three buffers at a time: each crc32 waits three cycles for the previous
+   one of its buffer, but one can start every cycle, so three independent
+   sums keep the unit busy */
+__attribute__((target("sse4.2")))
+static void many_sse42(const unsigned char *data, int count, int size, unsigned int *crcs) {
+    int i = 0;
+#ifdef __x86_64__
+    for (; i + 3 <= count; i += 3) {
+        const unsigned char *a = data + i * size;
+        const unsigned char *b = a + size;
+        const unsigned char *c = b + size;
+        unsigned long long x = ~0u;
+        unsigned long long y = ~0u;
+        unsigned long long z = ~0u;
+        int k;
+        for (k = 0; k + 8 <= size; k += 8) {
+            unsigned long long word;
+            memcpy(&word, a + k, 8);
+            x = _mm_crc32_u64(x, word);
+            memcpy(&word, b + k, 8);
+            y = _mm_crc32_u64(y, word);
+            memcpy(&word, c + k, 8);
+            z = _mm_crc32_u64(z, word);
+        }
+        crcs[i] = ~crc_sse42((unsigned int)x, a + k, size - k);
+        crcs[i + 1] = ~crc_sse42((unsigned int)y, b + k, size - k);
+        crcs[i + 2] = ~crc_sse42((unsigned int)z, c + k, size - k);
+    }
+#endif
+    for (; i < count; ++i) {
+        crcs[i] = ~crc_sse42(~0u, data + i * size, size);
+    }
+}
+#endif
+
+static void init_crc32c(void) {
+    int i;
+    int k;
+    for (i = 0; i < 256; ++i) {
+        unsigned int crc = i;
+        for (k = 0; k < 8; ++k) {
+            crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i) {
+        for (k = 1; k < 8; ++k) {
+            table[k][i] = table[0][table[k - 1][i] & 0xFF] ^ (table[k - 1][i] >> 8);
+        }
+    }
+
+    kernel = crc_tables;
+    many_kernel = many_tables;
+#ifdef HAVE_CRC32_INSTRUCTION
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernel = crc_sse42;
+        many_kernel = many_sse42;
+    }
+#endif
+}
+
+unsigned int crc32c(unsigned int crc, const unsigned char *data, int size) {
+    pthread_once(&once, init_crc32c);
+    return ~kernel(~crc, data, size);
+}
+
+void crc32cMany(const unsigned char *data, int count, int size, unsigned int *crcs) {
+    pthread_once(&once, init_crc32c);
+    many_kernel(data, count, size, crcs);
+}
+
+unsigned int crc32cPortable(unsigned int crc, const unsigned char *data, int size) {
+    pthread_once(&once, init_crc32c);
+    return ~crc_tables(~crc, data, size);
+}
+
+int crc32cHardware(void) {
+    pthread_once(&once, init_crc32c);
+    return kernel != crc_tables;
+}
@@ -0,0 +1,562 @@
+#include <journal.h>
+#include <apidisk.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+// region: header | descriptors | logged sectors | commit record. The header
+// keeps the sequence number of the last commit copied to its place; only
+// the commit right after it is ever replayed
+#define HEADER_MAGIC "T2JH"
+#define DESCRIPTOR_MAGIC "T2JD"
+#define COMMIT_MAGIC "T2JC"
+#define TAGS_PER_SECTOR ((SECTOR_SIZE - 12) / 4)
+
+#define COMMIT_INTERVAL 5   // seconds between background commits
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+struct logged {
+    unsigned int sector;
+    unsigned char data[SECTOR_SIZE];
+};
+
+// the journal of a disk
+struct journal {
+    bool enabled;
+    struct disk *disk;              // where the committer writes
+    unsigned int first_sector;
+    int region;                     // sectors in the journal
+    unsigned int sequence;          // last commit checkpointed
+    void (*on_checkpoint)(void *arg);
+    void *checkpoint_arg;
+
+    struct logged *logged;          // running commit
+    int n_logged;
+    int logged_size;
+    int *slots;                     // sector number hash: index in logged plus one
+    int n_slots;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int handles;                    // threads inside an operation
+    bool commit_wanted;
+    bool committing;
+    unsigned int commits;
+    bool committer_running;
+    bool stopping;                  // freeJournal waits for the committer to leave
+    pthread_t committer;
+    struct journal *next;           // in the list committed at exit
+};
+
+// the implicit disk's journal, used by threads that picked no other
+static struct journal default_journal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER
+};
+static __thread struct journal *current = &default_journal;
+
+// enabled journals, all committed at exit
+static struct journal *journals = 0;
+static pthread_mutex_t journals_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static __thread int depth = 0;      // nested journalStart calls of this thread
+
+static unsigned int get32(unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned int checksum(unsigned int sum, unsigned char *data) {
+    int i;
+    for (i = 0; i < SECTOR_SIZE; ++i) {
+        sum = (sum ^ data[i]) * FNV_PRIME;
+    }
+    return sum;
+}
+
+static int slot_of(unsigned int sector) {
+    return (sector * 2654435761u) & (current->n_slots - 1);
+}
+
+static int find_logged(unsigned int sector) {
+    if (current->n_slots == 0) {
+        return -1;
+    }
+
+    int i;
+    for (i = slot_of(sector); current->slots[i] != 0; i = (i + 1) & (current->n_slots - 1)) {
+        if (current->logged[current->slots[i] - 1].sector == sector) {
+            return current->slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+static void index_logged(int n) {
+    int i;
+    for (i = slot_of(current->logged[n].sector); current->slots[i] != 0; i = (i + 1) & (current->n_slots - 1));
+    current->slots[i] = n + 1;
+}
+
+/* A sector written twice in the same commit is logged once, with its last contents */
+static int log_sector(unsigned int sector, unsigned char *buffer) {
+    int n = find_logged(sector);
+    if (n >= 0) {
+        memcpy(current->logged[n].data, buffer, SECTOR_SIZE);
+        return 0;
+    }
+
+    if (current->n_logged == current->logged_size) {
+        int size = current->logged_size > 0 ? current->logged_size * 2 : 64;
+        struct logged *grown = (struct logged*)realloc(current->logged, size * sizeof(struct logged));
+        if (grown == 0) {
+            return -1;
+        }
+        current->logged = grown;
+        current->logged_size = size;
+    }
+    if (2 * (current->n_logged + 1) > current->n_slots) {
+        int size = current->n_slots > 0 ? current->n_slots * 2 : 128;
+        int *grown = (int*)calloc(size, sizeof(int));
+        if (grown == 0) {
+            return -1;
+        }
+        free(current->slots);
+        current->slots = grown;
+        current->n_slots = size;
+        for (n = 0; n < current->n_logged; ++n) {
+            index_logged(n);
+        }
+    }
+
+    current->logged[current->n_logged].sector = sector;
+    memcpy(current->logged[current->n_logged].data, buffer, SECTOR_SIZE);
+    index_logged(current->n_logged);
+    ++current->n_logged;
+    return 0;
+}
+
+static int compare_logged(const void *a, const void *b) {
+    unsigned int x = ((const struct logged*)a)->sector;
+    unsigned int y = ((const struct logged*)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+static int write_header(unsigned int seq) {
+    unsigned char sector[SECTOR_SIZE] = {0};
+    memcpy(sector, HEADER_MAGIC, 4);
+    put32(sector + 4, seq);
+    return write_sector(current->first_sector, sector);
+}
+
+/* Writes the running commit to the journal and then every sector to its
+   place, in sector order. Long operations restart at journalFull, so only
+   a single step logging more than half the region can outgrow it; such a
+   commit goes straight to its place, without crash protection, and says so */
+static int write_commit(void) {
+    qsort(current->logged, current->n_logged, sizeof(struct logged), compare_logged);
+
+    unsigned char sector[SECTOR_SIZE];
+    unsigned int seq = current->sequence + 1;
+    int descriptors = (current->n_logged + TAGS_PER_SECTOR - 1) / TAGS_PER_SECTOR;
+    int ret = 0;
+    int i;
+    int j;
+
+    if (2 + descriptors + current->n_logged <= current->region) {
+        unsigned int next = current->first_sector + 1;
+        unsigned int sum = FNV_BASIS;
+        for (i = 0; i < descriptors && ret == 0; ++i) {
+            memset(sector, 0, SECTOR_SIZE);
+            memcpy(sector, DESCRIPTOR_MAGIC, 4);
+            put32(sector + 4, seq);
+            put32(sector + 8, current->n_logged);
+            for (j = 0; j < TAGS_PER_SECTOR && i * TAGS_PER_SECTOR + j < current->n_logged; ++j) {
+                put32(sector + 12 + j * 4, current->logged[i * TAGS_PER_SECTOR + j].sector);
+            }
+            ret = write_sector(next++, sector);
+        }
+        for (i = 0; i < current->n_logged && ret == 0; ++i) {
+            sum = checksum(sum, current->logged[i].data);
+            ret = write_sector(next++, current->logged[i].data);
+        }
+        if (ret == 0) {
+            memset(sector, 0, SECTOR_SIZE);
+            memcpy(sector, COMMIT_MAGIC, 4);
+            put32(sector + 4, seq);
+            put32(sector + 8, current->n_logged);
+            put32(sector + 12, sum);
+            ret = write_sector(next, sector);
+        }
+        if (ret != 0) {
+            printf("cannot write the journal\n");
+        }
+    } else {
+        printf("journal: commit of %d sectors does not fit in %d, written in place unprotected\n",
+               current->n_logged, current->region);
+    }
+
+    for (i = 0; i < current->n_logged; ++i) {
+        if (write_sector(current->logged[i].sector, current->logged[i].data) != 0) {
+            printf("cannot write sector %u\n", current->logged[i].sector);
+            ret = -1;
+        }
+    }
+    if (write_header(seq) != 0) {
+        ret = -1;
+    }
+
+    current->sequence = seq;
+    current->n_logged = 0;
+    memset(current->slots, 0, current->n_slots * sizeof(int));
+    return ret;
+}
+
+/* Called with the lock held. New operations wait until the commit is
+   checkpointed, so the callback runs with none in progress */
+static int commit_locked(void) {
+    current->committing = true;
+    while (current->handles > 0) {
+        pthread_cond_wait(&current->changed, &current->lock);
+    }
+
+    int ret = 0;
+    if (current->n_logged > 0) {
+        ret = write_commit();
+        if (current->on_checkpoint != 0) {
+            pthread_mutex_unlock(&current->lock);
+            current->on_checkpoint(current->checkpoint_arg);
+            pthread_mutex_lock(&current->lock);
+        }
+    }
+
+    current->committing = false;
+    current->commit_wanted = false;
+    ++current->commits;
+    pthread_cond_broadcast(&current->changed);
+    return ret;
+}
+
+/* Background thread: commits every COMMIT_INTERVAL seconds or when asked,
+   until freeJournal stops it */
+static void *commit_thread(void *arg) {
+    current = (struct journal*)arg;
+    useDisk(current->disk);
+    pthread_mutex_lock(&current->lock);
+    while (!current->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMMIT_INTERVAL;
+        while (!current->commit_wanted && !current->stopping &&
+               pthread_cond_timedwait(&current->changed, &current->lock, &deadline) != ETIMEDOUT);
+        commit_locked();
+    }
+    current->committer_running = false;
+    pthread_cond_broadcast(&current->changed);
+    pthread_mutex_unlock(&current->lock);
+    return 0;
+}
+
+/* Called with the lock held */
+static bool start_committer(void) {
+    if (!current->committer_running && pthread_create(&current->committer, 0, commit_thread, current) == 0) {
+        pthread_detach(current->committer);
+        current->committer_running = true;
+    }
+    return current->committer_running;
+}
+
+static void commit_at_exit(void) {
+    pthread_mutex_lock(&journals_lock);
+    struct journal *journal;
+    for (journal = journals; journal != 0; journal = journal->next) {
+        struct journal *previous = useJournal(journal);
+        struct disk *disk = useDisk(journal->disk);
+        journalCommit();
+        useDisk(disk);
+        useJournal(previous);
+    }
+    pthread_mutex_unlock(&journals_lock);
+}
+
+static void register_exit(void) {
+    atexit(commit_at_exit);
+}
+
+/* Copies a complete commit left in the journal to its place; a commit
+   without its record was cut short and is ignored */
+static int replay(void) {
+    unsigned char sector[SECTOR_SIZE];
+    unsigned char data[SECTOR_SIZE];
+    unsigned int seq = current->sequence + 1;
+    if (read_sector(current->first_sector + 1, sector) != 0) {
+        return -1;
+    }
+
+    int n = get32(sector + 8);
+    if (memcmp(sector, DESCRIPTOR_MAGIC, 4) != 0 || get32(sector + 4) != seq || n <= 0) {
+        return 0;
+    }
+    int descriptors = (n + TAGS_PER_SECTOR - 1) / TAGS_PER_SECTOR;
+    if (2 + descriptors + n > current->region) {
+        return 0;
+    }
+
+    unsigned int first_data = current->first_sector + 1 + descriptors;
+    unsigned int sum = FNV_BASIS;
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (read_sector(first_data + i, data) != 0) {
+            return -1;
+        }
+        sum = checksum(sum, data);
+    }
+    if (read_sector(first_data + n, sector) != 0) {
+        return -1;
+    }
+    if (memcmp(sector, COMMIT_MAGIC, 4) != 0 || get32(sector + 4) != seq ||
+        (int)get32(sector + 8) != n || get32(sector + 12) != sum) {
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (i % TAGS_PER_SECTOR == 0 &&
+            read_sector(current->first_sector + 1 + i / TAGS_PER_SECTOR, sector) != 0) {
+            return -1;
+        }
+        if (read_sector(first_data + i, data) != 0 ||
+            write_sector(get32(sector + 12 + (i % TAGS_PER_SECTOR) * 4), data) != 0) {
+            return -1;
+        }
+    }
+    if (write_header(seq) != 0) {
+        return -1;
+    }
+    current->sequence = seq;
+    printf("journal: replayed commit %u, %d sectors\n", seq, n);
+    return 0;
+}
+
+struct journal *newJournal(void) {
+    struct journal *journal = (struct journal*)calloc(1, sizeof(struct journal));
+    if (journal != 0) {
+        pthread_mutex_init(&journal->lock, 0);
+        pthread_cond_init(&journal->changed, 0);
+    }
+    return journal;
+}
+
+void freeJournal(struct journal *journal) {
+    if (journal == 0) {
+        return;
+    }
+
+    if (journal->enabled) {
+        struct journal *previous = useJournal(journal);
+        struct disk *disk = useDisk(journal->disk);
+        journalCommit();
+        pthread_mutex_lock(&journal->lock);
+        journal->stopping = true;
+        pthread_cond_broadcast(&journal->changed);
+        while (journal->committer_running) {
+            pthread_cond_wait(&journal->changed, &journal->lock);
+        }
+        pthread_mutex_unlock(&journal->lock);
+        useDisk(disk);
+        useJournal(previous);
+
+        pthread_mutex_lock(&journals_lock);
+        struct journal **link;
+        for (link = &journals; *link != 0 && *link != journal; link = &(*link)->next);
+        if (*link != 0) {
+            *link = journal->next;
+        }
+        pthread_mutex_unlock(&journals_lock);
+    }
+
+    free(journal->logged);
+    free(journal->slots);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->changed);
+    free(journal);
+}
+
+struct journal *useJournal(struct journal *journal) {
+    struct journal *previous = current;
+    current = journal != 0 ? journal : &default_journal;
+    return previous;
+}
+
+int initJournal(unsigned int firstSector, int sectors, void (*checkpointed)(void *arg), void *arg) {
+    unsigned char sector[SECTOR_SIZE];
+    current->disk = currentDisk();
+    current->first_sector = firstSector;
+    current->region = sectors;
+    current->on_checkpoint = checkpointed;
+    current->checkpoint_arg = arg;
+    if (current->region < 3 || read_sector(current->first_sector, sector) != 0 ||
+        memcmp(sector, HEADER_MAGIC, 4) != 0) {
+        printf("invalid journal\n");
+        return -1;
+    }
+
+    current->sequence = get32(sector + 4);
+    if (replay() != 0) {
+        printf("cannot replay the journal\n");
+        return -1;
+    }
+
+    current->enabled = true;
+    pthread_once(&exit_once, register_exit);
+    pthread_mutex_lock(&journals_lock);
+    current->next = journals;
+    journals = current;
+    pthread_mutex_unlock(&journals_lock);
+    return 0;
+}
+
+int journalRead(unsigned int sector, unsigned char *buffer) {
+    if (current->enabled) {
+        pthread_mutex_lock(&current->lock);
+        int n = find_logged(sector);
+        if (n >= 0) {
+            memcpy(buffer, current->logged[n].data, SECTOR_SIZE);
+            pthread_mutex_unlock(&current->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&current->lock);
+    }
+    return read_sector(sector, buffer);
+}
+
+/* The logged sectors are copied from memory first, and only the runs
+   between them are read from the disk: a checkpoint that puts them in place
+   meanwhile does not touch the others */
+int journalReadSectors(unsigned int sector, int count, unsigned char *buffer) {
+    if (!current->enabled) {
+        return read_sectors(sector, count, buffer);
+    }
+
+    bool *logged = (bool*)calloc(count, sizeof(bool));
+    if (logged == 0) {
+        return -1;
+    }
+    int i;
+    pthread_mutex_lock(&current->lock);
+    for (i = 0; i < count && current->n_logged > 0; ++i) {
+        int n = find_logged(sector + i);
+        if (n >= 0) {
+            memcpy(buffer + i * SECTOR_SIZE, current->logged[n].data, SECTOR_SIZE);
+            logged[i] = true;
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+
+    int ret = 0;
+    int j;
+    for (i = 0; i < count && ret == 0; i = j) {
+        if (logged[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < count && !logged[j]; ++j);
+        ret = read_sectors(sector + i, j - i, buffer + i * SECTOR_SIZE);
+    }
+    free(logged);
+    return ret;
+}
+
+int journalWrite(unsigned int sector, unsigned char *buffer) {
+    if (!current->enabled) {
+        return write_sector(sector, buffer);
+    }
+
+    pthread_mutex_lock(&current->lock);
+    int ret = log_sector(sector, buffer);
+
+    // half of the region is left for the operations still running
+    if (current->n_logged >= current->region / 2 && !current->commit_wanted && start_committer()) {
+        current->commit_wanted = true;
+        pthread_cond_broadcast(&current->changed);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int journalFull(void) {
+    if (!current->enabled) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    int full = current->n_logged >= current->region / 2;
+    pthread_mutex_unlock(&current->lock);
+    return full;
+}
+
+void journalStart(void) {
+    if (depth++ > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    while (current->commit_wanted || current->committing) {
+        pthread_cond_wait(&current->changed, &current->lock);
+    }
+    ++current->handles;
+    pthread_mutex_unlock(&current->lock);
+}
+
+void journalStop(void) {
+    if (--depth > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    if (--current->handles == 0) {
+        pthread_cond_broadcast(&current->changed);
+    }
+    if (current->enabled && current->n_logged > 0) {
+        start_committer();
+    }
+    pthread_mutex_unlock(&current->lock);
+}
+
+int journalCommit(void) {
+    if (!current->enabled) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&current->lock);
+    if (current->n_logged > 0 || current->committing) {
+        bool running = start_committer();
+        if (depth > 0) {
+            // inside an operation the commit can only follow its end
+            current->commit_wanted = running;
+        } else if (running) {
+            unsigned int target = current->commits + 1;
+            current->commit_wanted = true;
+            pthread_cond_broadcast(&current->changed);
+            while (current->commits < target) {
+                pthread_cond_wait(&current->changed, &current->lock);
+            }
+        } else {
+            ret = commit_locked();
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
@@ -0,0 +1,156 @@
+#include <lz.h>
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+#define RUN_MASK 15
+
+// misses in a row before the search starts skipping bytes
+#define SKIP_SHIFT 5
+
+static unsigned int hash4(const unsigned char *p) {
+    unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes the part of a length that does not fit in its nibble */
+static int put_length(unsigned char *out, int o, int max, int n) {
+    for (; n >= 255; n -= 255) {
+        if (o == max) {
+            return -1;
+        }
+        out[o++] = 255;
+    }
+    if (o == max) {
+        return -1;
+    }
+    out[o++] = n;
+    return o;
+}
+
+static int get_length(const unsigned char *in, int *i, int size, int n) {
+    unsigned char b;
+    do {
+        if (*i == size) {
+            return -1;
+        }
+        b = in[(*i)++];
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+/* Appends literals in[from..to) and, if length > 0, a copy from "offset"
+   bytes back. Returns the new end of the code, or -1 if it does not fit */
+static int put_sequence(const unsigned char *in, int from, int to, int offset, int length,
+                        unsigned char *out, int o, int max) {
+    int literals = to - from;
+    int match = length > 0 ? length - MIN_MATCH : 0;
+    if (o == max) {
+        return -1;
+    }
+    out[o++] = (literals < RUN_MASK ? literals : RUN_MASK) << 4
+               | (match < RUN_MASK ? match : RUN_MASK);
+    if (literals >= RUN_MASK && (o = put_length(out, o, max, literals - RUN_MASK)) < 0) {
+        return -1;
+    }
+    if (literals > max - o) {
+        return -1;
+    }
+    memcpy(out + o, in + from, literals);
+    o += literals;
+
+    if (length == 0) {
+        return o;
+    }
+    if (max - o < 2) {
+        return -1;
+    }
+    out[o++] = offset & 0xFF;
+    out[o++] = offset >> 8;
+    if (match >= RUN_MASK) {
+        o = put_length(out, o, max, match - RUN_MASK);
+    }
+    return o;
+}
+
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int max) {
+    int table[1 << HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    int anchor = 0;
+    int misses = 0;
+    int o = 0;
+    int i = 0;
+    while (i + MIN_MATCH <= size) {
+        unsigned int h = hash4(in + i);
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > MAX_OFFSET || memcmp(in + ref, in + i, MIN_MATCH) != 0) {
+            i += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+
+        int length = MIN_MATCH;
+        while (i + length < size && in[ref + length] == in[i + length]) {
+            ++length;
+        }
+        o = put_sequence(in, anchor, i, i - ref, length, out, o, max);
+        if (o < 0) {
+            return -1;
+        }
+        i += length;
+        anchor = i;
+        misses = 0;
+    }
+
+    return put_sequence(in, anchor, size, 0, 0, out, o, max);
+}
+
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int max) {
+    int i = 0;
+    int o = 0;
+    while (i < size) {
+        int token = in[i++];
+        int literals = token >> 4;
+        if (literals == RUN_MASK && (literals = get_length(in, &i, size, literals)) < 0) {
+            return -1;
+        }
+        if (literals > size - i || literals > max - o) {
+            return -1;
+        }
+        memcpy(out + o, in + i, literals);
+        i += literals;
+        o += literals;
+        if (i == size) {
+            break;
+        }
+
+        if (size - i < 2) {
+            return -1;
+        }
+        int offset = in[i] | in[i + 1] << 8;
+        i += 2;
+        int length = token & RUN_MASK;
+        if (length == RUN_MASK && (length = get_length(in, &i, size, length)) < 0) {
+            return -1;
+        }
+        length += MIN_MATCH;
+        if (offset == 0 || offset > o || length > max - o) {
+            return -1;
+        }
+
+        // the copy may overlap what it writes, repeating a short pattern
+        if (offset >= length) {
+            memcpy(out + o, out + o - offset, length);
+            o += length;
+        } else {
+            for (; length > 0; --length, ++o) {
+                out[o] = out[o - offset];
+            }
+        }
+    }
+    return o;
+}
@@ -0,0 +1,192 @@
+#include <refcount.h>
+#include <t2fs.h>
+#include <apidisk.h>
+#include <journal.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define COUNT_SIZE 2
+#define COUNTS_PER_SECTOR (SECTOR_SIZE / COUNT_SIZE)
+#define MAX_REFCOUNT 0xFFFF
+
+#define SECTOR_LOADED 1
+#define SECTOR_DIRTY 2
+
+// the table of a disk; the background reclaimer drops references while
+// the caller adds others
+struct refcounts {
+    unsigned int first_sector;
+    int sectors;
+    unsigned char *counts;      // the table, filled a sector at a time
+    unsigned char *state;       // SECTOR_* flags of each sector
+    pthread_mutex_t lock;
+};
+
+// the implicit disk's table, used by threads that picked no other
+static struct refcounts default_refcounts = {0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct refcounts *current = &default_refcounts;
+
+/* The counter of a block, reading its sector on first use; 0 if out of range */
+static unsigned char *get_count(int block_number) {
+    if (current->counts == 0 || block_number < 0 || block_number >= current->sectors * COUNTS_PER_SECTOR) {
+        return 0;
+    }
+
+    int sector = block_number / COUNTS_PER_SECTOR;
+    if (!(current->state[sector] & SECTOR_LOADED)) {
+        if (journalRead(current->first_sector + sector, current->counts + sector * SECTOR_SIZE) != 0) {
+            printf("cannot read refcount sector %d\n", sector);
+            return 0;
+        }
+        current->state[sector] |= SECTOR_LOADED;
+    }
+    return current->counts + block_number * COUNT_SIZE;
+}
+
+static int get_value(unsigned char *count) {
+    return count[0] | count[1] << 8;
+}
+
+/* Changes a counter; its sector is written later by write_sector_of */
+static void add_value(int block_number, int delta) {
+    unsigned char *count = current->counts + block_number * COUNT_SIZE;
+    int value = get_value(count) + delta;
+    count[0] = value & 0xFF;
+    count[1] = (value >> 8) & 0xFF;
+    current->state[block_number / COUNTS_PER_SECTOR] |= SECTOR_DIRTY;
+}
+
+/* Writes the sector holding a block's counter, if it is still dirty */
+static int write_sector_of(int block_number) {
+    int sector = block_number / COUNTS_PER_SECTOR;
+    if (!(current->state[sector] & SECTOR_DIRTY)) {
+        return 0;
+    }
+    current->state[sector] &= ~SECTOR_DIRTY;
+    return journalWrite(current->first_sector + sector, current->counts + sector * SECTOR_SIZE);
+}
+
+struct refcounts *newRefcounts(void) {
+    struct refcounts *refcounts = (struct refcounts*)calloc(1, sizeof(struct refcounts));
+    if (refcounts != 0) {
+        pthread_mutex_init(&refcounts->lock, 0);
+    }
+    return refcounts;
+}
+
+void freeRefcounts(struct refcounts *refcounts) {
+    if (refcounts == 0) {
+        return;
+    }
+    free(refcounts->counts);
+    free(refcounts->state);
+    pthread_mutex_destroy(&refcounts->lock);
+    free(refcounts);
+}
+
+struct refcounts *useRefcounts(struct refcounts *refcounts) {
+    struct refcounts *previous = current;
+    current = refcounts != 0 ? refcounts : &default_refcounts;
+    return previous;
+}
+
+int initRefcounts(unsigned int firstSector, int sectorCount) {
+    free(current->counts);
+    free(current->state);
+    current->first_sector = firstSector;
+    current->sectors = sectorCount;
+    current->counts = (unsigned char*)malloc(current->sectors * SECTOR_SIZE);
+    current->state = (unsigned char*)calloc(current->sectors, 1);
+    if (current->counts == 0 || current->state == 0) {
+        free(current->counts);
+        free(current->state);
+        current->counts = 0;
+        current->state = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int getRefcount(int blockNumber) {
+    if (current->counts == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    unsigned char *count = get_count(blockNumber);
+    int ret = count != 0 ? get_value(count) : -1;
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int shareBlocks(int *blockNumbers, int count) {
+    pthread_mutex_lock(&current->lock);
+
+    // every counter is checked before any of them changes
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (blockNumbers[i] == INVALID_PTR) {
+            continue;
+        }
+        unsigned char *value = get_count(blockNumbers[i]);
+        if (value == 0 || get_value(value) == MAX_REFCOUNT) {
+            printf("cannot share block %d\n", blockNumbers[i]);
+            pthread_mutex_unlock(&current->lock);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (blockNumbers[i] != INVALID_PTR) {
+            add_value(blockNumbers[i], 1);
+        }
+    }
+
+    int ret = 0;
+    for (i = 0; i < count; ++i) {
+        if (blockNumbers[i] != INVALID_PTR && write_sector_of(blockNumbers[i]) != 0) {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int unshareBlocks(int *blockNumbers, int count) {
+    if (current->counts == 0) {
+        return 0;
+    }
+
+    // a block that loses a reference is marked as -2 - number until its
+    // sector is written, then it leaves the vector
+    pthread_mutex_lock(&current->lock);
+    int ret = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (blockNumbers[i] == INVALID_PTR) {
+            continue;
+        }
+        unsigned char *value = get_count(blockNumbers[i]);
+        if (value == 0) {
+            // kept rather than freed while someone may still use it
+            blockNumbers[i] = INVALID_PTR;
+            ret = -1;
+        } else if (get_value(value) > 0) {
+            add_value(blockNumbers[i], -1);
+            blockNumbers[i] = -2 - blockNumbers[i];
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (blockNumbers[i] < INVALID_PTR) {
+            if (write_sector_of(-2 - blockNumbers[i]) != 0) {
+                ret = -1;
+            }
+            blockNumbers[i] = INVALID_PTR;
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
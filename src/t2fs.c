@@ -1,100 +1,740 @@
 #include <t2fs.h>
 #include <apidisk.h>
-#include <bitmap2.h>
+#include <bitmap.h>
+#include <journal.h>
+#include <refcount.h>
+#include <lz.h>
+#include <checksum.h>
+#include <usage.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define MAX_OPEN_FILES 20
 #define RECORD_SIZE 64
+#define INODE_SIZE 16
+#define PTR_SIZE 4
+
+#define RECORDS_PER_SECTOR (SECTOR_SIZE / RECORD_SIZE)
+#define INODES_PER_SECTOR (SECTOR_SIZE / INODE_SIZE)
+#define PTRS_PER_SECTOR (SECTOR_SIZE / PTR_SIZE)
+
+// hashed directory index: nodes are directory blocks whose slots all look
+// invalid to a linear scan; slot 0 is the header, the others hold entries
+#define HTREE_MAGIC "HTRE"
+#define HTREE_PER_SLOT 7
+#define HTREE_ENTRY_SIZE 8
+#define HTREE_MAX_LEVELS 3
+
+// inline data: a small regular file keeps its contents in the slots that
+// follow its record; they look invalid to a linear scan and carry a mark
+#define INLINE_MARK 0xFE
+#define INLINE_SLOT_BYTES (RECORD_SIZE - 2)
+#define INLINE_MAX 1024
+
+// compressed files: data is coded a unit of UNIT_BLOCKS blocks at a time. A
+// unit whose code saves a block keeps it in the first blocks, after its
+// length, and leaves the last one unmapped; a unit with its last block
+// mapped is stored as is, and one without its first block is a hole
+#define UNIT_BLOCKS 4
+#define UNIT_HEADER 4
+#define UNIT_HOLE 0
+#define UNIT_RAW 1
+#define UNIT_CODED 2
+
+// sectors gathered by write_data before they go to disk, unless a block is bigger
+#define RUN_SECTORS 1024
+
+// long writes and preallocations stop every PART_SECTORS data sectors, and
+// remove_tree2 every PART_INODES i-nodes, to let a commit that grew to half
+// the journal go to disk before they go on
+#define PART_SECTORS 4096
+#define PART_INODES 256
+
+// the warm-up at mount reads the i-node area this many sectors at a time, and
+// the directories of the first levels of the tree, the root being level 1
+#define WARM_SECTORS 1024
+#define WARM_LEVELS 2
+
+// walk2 runs a walker per processor, up to WALK_THREADS, and reads the
+// blocks of a directory up to WALK_SECTORS at a time
+#define WALK_THREADS 64
+#define WALK_SECTORS 1024
+#define SCAN_SECTORS 64        // i-node sectors read together by scan_inodes2
 
 typedef struct t2fs_superbloco superblock_t;
 typedef struct t2fs_record record_t;
 typedef struct t2fs_inode inode_t;
 
-static bool t2fs_init = false;
+typedef struct {
+    int *blocks;
+    int n;
+    int size;
+} block_list_t;
 
-static superblock_t *superblock = 0;
-static record_t *root = 0;
-
-static int inode_area = 0;
-static int block_area = 0;
-
-static struct files {
+typedef struct {
+    record_t *file;
+    int next;               // next block of the reserved run
+    int left;               // blocks of the run not handed out yet
+    int end;                // first file block past the preallocated range
+    int inside;             // file blocks below it are read, so they get zeros
+    unsigned char *zeros;
+} prealloc_t;
+
+// whole sectors that follow each other on disk, moved in one request so a
+// striped disk works on them in parallel
+typedef struct {
+    unsigned int sector;
+    int count;
+    int done;               // bytes of the transfer before the run
+    unsigned char *data;
+} run_t;
+
+// a directory found by walk2, waiting to be read
+typedef struct {
+    char *path;
+    int inode_number;
+    int depth;
+} walk_dir_t;
+
+// the directories a walker found: it takes the newest one, depth first, and
+// idle walkers steal the oldest, the tops of the biggest subtrees left
+typedef struct {
+    walk_dir_t *dirs;
+    int first;
+    int n;
+    int size;
+    pthread_mutex_t lock;
+} walk_queue_t;
+
+typedef struct {
+    T2FS_CONTEXT *context;
+    WALK2_FN fn;
+    void *arg;
+    walk_queue_t *queues;
+    int n_queues;
+    int queued;             // directories in all the queues
+    int pending;            // the same, plus the ones being read
+    int stop;               // nonzero ends the walk, and is what walk2 returns; under lock
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+} walk_t;
+
+typedef struct {
+    walk_t *walk;
+    int w;                  // the walker's queue
+    pthread_t thread;
+    bool running;
+} walker_t;
+
+struct files {
     record_t *dir;
     record_t *file;
-    unsigned int p;
-} files[MAX_OPEN_FILES] = {{0}};
+    QWORD p;
+    unsigned char *data; // contents of an inline file, inline_max bytes
+    unsigned char *unit; // last unit of a compressed file decoded by read2
+    int unit_number;     // which one it is, -1 if none
+};
 
-static struct dirs {
+struct dirs {
     record_t *dir;
-    int p;
-} dirs[MAX_OPEN_FILES] = {{0}};
+    int p;              // next record, counted from the start of the directory
+    int block;          // directory block held in buffer, -1 if none
+    unsigned char *buffer;
+};
+
+// everything known about one image: the implicit t2fs_disk.dat or one
+// opened by t2fs_mount, each with the state of the modules it uses
+struct t2fs_context {
+    bool t2fs_init;
+
+    superblock_t *superblock;
+    record_t *root;
+
+    int inode_area;
+    int block_area;
+
+    // fan-outs derived from superblock->blockSize at initialize()
+    int block_bytes;
+    int records_per_block;
+    int ptrs_per_block;
+    int ptrs_shift;         // log2(ptrs_per_block) when it is a power of two
+    int htree_capacity;
+    int inline_max;         // zero unless the image was formatted with inline_data
+    int unit_bytes;         // file bytes coded together in a compressed file
+    QWORD max_file_bytes;
+    int data_blocks;        // blocks between block_area and the tables or journal past it
+
+    // deferred deletion: unlinked i-nodes wait in the orphan block, mirrored
+    // in orphans[], until the reclaimer thread frees them
+    int delete_mode;
+    int *orphans;
+    int n_orphans;
+    bool reclaimer_running;
+    bool unmounting;        // the reclaimer leaves once the list is empty
+    pthread_t reclaimer;
+    bool warming;           // a MOUNT_WARM_BACKGROUND thread was started
+    pthread_t warmer;
+    pthread_mutex_t orphan_lock;
+    pthread_cond_t orphan_added;
+    pthread_cond_t orphans_freed;
+
+    // held by every public call: threads sharing the disk run their
+    // operations one at a time. The reclaimer, the warm-up thread and the
+    // journal's committer never take it
+    pthread_mutex_t op_lock;
+
+    struct files files[MAX_OPEN_FILES];
+    struct dirs dirs[MAX_OPEN_FILES];
+
+    int members;            // images of the disk; zero in the implicit context, which has one
+
+    // zero in the implicit context: the modules' own defaults
+    struct disk *disk;
+    struct journal *journal;
+    struct bitmaps *bitmaps;
+    struct refcounts *refcounts;
+    struct checksums *checksums;
+    struct usage *usage;
+};
+
+// the implicit context, used by the calls without one
+static T2FS_CONTEXT default_context = {
+    .ptrs_shift = -1,
+    .delete_mode = DELETE_SYNC,
+    .orphan_lock = PTHREAD_MUTEX_INITIALIZER,
+    .orphan_added = PTHREAD_COND_INITIALIZER,
+    .orphans_freed = PTHREAD_COND_INITIALIZER,
+    .op_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// the context of the calling thread; the *_ctx calls switch it for their duration
+static __thread T2FS_CONTEXT *fs = &default_context;
 
 int initialize();
+T2FS_CONTEXT *use_context(T2FS_CONTEXT *context);
+void free_context(T2FS_CONTEXT *context);
+T2FS_CONTEXT *mount_disk(struct disk *disk, int members, char *name, int options);
+int warm_up(void);
+void *warm(void *arg);
 int get_superblock(superblock_t *sb);
 
+void decode_inode(unsigned char *buffer, inode_t *inode);
+void decode_inodes(unsigned char *buffer, inode_t *inodes, int n);
 int get_inode(int inode_number, inode_t *inode);
 int set_inode(int inode_number, inode_t *inode);
 int free_inode(int inode_number);
-
+int release_inode(int inode_number);
+int replay_orphans();
+int add_orphan(int inode_number);
+void *reclaim(void *arg);
+void list_add(block_list_t *list, int block_number);
+int drop_block(int block_number, block_list_t *list);
+int drop_ind(int block_number, int levels, block_list_t *list, bool count);
+int drop_entries(int block_number, int from, int levels, block_list_t *list, bool count);
+int compare_block_numbers(const void *a, const void *b);
+int free_blocks(block_list_t *list);
+int clear_runs(int bitmap, block_list_t *list);
+int free_inodes(block_list_t *inodes);
+void drop_handles(block_list_t *inodes);
+
+void decode_record(unsigned char *buffer, record_t *file);
+void encode_record(unsigned char *buffer, record_t *file);
 int get_record(int block_number, int record_number, record_t *file);
 int set_record(int block_number, int record_number, record_t *file);
 
 int get_ind(int block_number, int ind_number);
 int set_ind(int block_number, int ind_number, int ind_block);
 
-int load_file(char *filename, record_t *dir, record_t *file);
-int load_dir(char *filename, record_t *file);
-int load_block(char *filename, int block_number, record_t *file);
-int load_single_ind(char *filename, int block_number, record_t *file);
-int load_double_ind(char *filename, int block_number, record_t *file);
-
-int save_file(record_t *file, record_t *dir);
-int save_block(record_t *file, int block_number);
-int save_single_ind(record_t *file, int block_number);
-int save_double_ind(record_t *file, int block_number);
-
-int get_n_block (inode_t *inode, int n, int block_number);
-int read_from_sector( int sector_number, char *buffer, int n);
-int read_from_block( int block_number, char *buffer, int n);
+int load_file(char *filename, record_t *dir, record_t *file, unsigned char *data);
+int load_dir(char *filename, record_t *file, unsigned char *data);
+int find_record(inode_t *inode, char *filename, record_t *file, int *block_number, int *record_number, unsigned char *data);
+int scan_block(unsigned char *buffer, char *filename, record_t *file);
+
+int save_file(record_t *file, record_t *dir, unsigned char *data);
+int account_usage(record_t *dir, record_t *old, record_t *file);
+int update_record(int block_number, int record_number, record_t *file, unsigned char *data);
+int insert_record(record_t *dir, inode_t *inode, record_t *file, unsigned char *data);
+int save_block(record_t *file, unsigned char *data, int block_number);
+int save_single_ind(record_t *file, unsigned char *data, int block_number);
+int save_double_ind(record_t *file, unsigned char *data, int block_number);
+int append_dir_block(inode_t *inode, int block_number);
+
+bool is_inline(record_t *file);
+int inline_slots(record_t *file);
+int slot_run(unsigned char *buffer, int record_number);
+bool slots_free(unsigned char *buffer, int first, int n);
+int find_slots(unsigned char *buffer, int n);
+void put_record(unsigned char *buffer, int record_number, record_t *file, unsigned char *data);
+void get_inline(unsigned char *buffer, int record_number, record_t *file, unsigned char *data);
+int clear_slots(unsigned char *buffer, int record_number);
+int compact_block(unsigned char *buffer);
+int write_slots(int block_number, unsigned char *buffer, int first, int n);
+int place_record(int block_number, unsigned char *buffer, record_t *file, unsigned char *data);
+int spill_inline(record_t *file, unsigned char *data);
+
+unsigned int get_dword(unsigned char *buffer);
+void set_dword(unsigned char *buffer, unsigned int value);
+
+unsigned int name_hash(char *name);
+bool is_htree_node(unsigned char *node);
+unsigned char *htree_entry(unsigned char *node, int i);
+void htree_init_node(unsigned char *node, int levels);
+void htree_insert_entry(unsigned char *node, int i, unsigned int hash, int block_number);
+int htree_search(unsigned char *node, unsigned int hash);
+int htree_walk(inode_t *inode, unsigned int hash, int *path, int *index, unsigned char *buffer);
+int htree_add(inode_t *inode, int *path, int *index, int level, unsigned int hash, int block_number);
+int htree_insert(inode_t *inode, record_t *file, unsigned char *data);
+int htree_convert(inode_t *inode);
+
+void split_ind(int n, int *high, int *low);
+int get_n_block (inode_t *inode, int n, int *block_number);
+int read_block(int block_number, unsigned char *buffer);
+int write_block(int block_number, unsigned char *buffer);
+int next_record(DIR2 handle, inode_t *inode, record_t *file);
+int compare_inode_numbers(const void *a, const void *b);
+int alloc_data_block();
+int alloc_block(bool ind);
+bool is_shared(inode_t *inode, int n, int block_number);
+int own_block(int *block_number, int levels);
+int map_block(inode_t *inode, int n, int *block_number, bool *fresh, int *copy);
+int read_run(run_t *run);
+int write_run(run_t *run);
+int read_data(inode_t *inode, QWORD offset, char *buffer, int size);
+int write_data(record_t *file, inode_t *inode, QWORD offset, char *buffer, int size);
+int unit_state(inode_t *inode, int u, int *first);
+int decode_unit(inode_t *inode, int u, int first, unsigned char *code, unsigned char *out);
+int load_unit(record_t *file, inode_t *inode, int u, unsigned char *code, unsigned char *out);
+int read_units(FILE2 handle, inode_t *inode, QWORD offset, char *buffer, int size);
+int write_units(record_t *file, inode_t *inode, QWORD offset, char *buffer, int size);
+int store_unit(record_t *file, inode_t *inode, int u, unsigned char *data, unsigned char *code);
+int map_unit(record_t *file, inode_t *inode, int u, int used, int *blocks);
+int unmap_block(inode_t *inode, int n, block_list_t *list);
 
 int read2 (FILE2 handle, char *buffer, int size);
 int write2 (FILE2 handle, char *buffer, int size);
 int truncate2 (FILE2 handle);
-int seek2 (FILE2 handle, unsigned int offset);
+int unmap_blocks(inode_t *inode, int keep, block_list_t *list);
+int clear_tail(record_t *file, inode_t *inode, QWORD size);
+int seek2 (FILE2 handle, QWORD offset);
+int find_block(inode_t *inode, int n, int end, bool mapped);
+int seek_data2(FILE2 handle, QWORD offset, int whence, QWORD *position);
+int clear_range(record_t *file, inode_t *inode, QWORD from, QWORD to);
+int fallocate2(FILE2 handle, QWORD offset, QWORD length);
+int prealloc_blocks(prealloc_t *pa, inode_t *inode, int n);
+int prealloc_take(prealloc_t *pa, int n);
+int prealloc_ind(prealloc_t *pa, int block_number, int from, int to, int n, unsigned char *buffer);
 
 int search_free_inode();
+int save_free_counts(void);
+
+void walk_push(walk_t *walk, int w, walk_dir_t *dir);
+bool walk_take(walk_t *walk, int w, walk_dir_t *dir);
+void walk_stop(walk_t *walk, int ret);
+bool walk_stopped(walk_t *walk);
+void walk_prefetch(walk_dir_t *dir);
+int walk_dir(walk_t *walk, int w, walk_dir_t *dir, unsigned char *buffer);
+int read_dir_blocks(inode_t *inode, int first, int count, unsigned char *buffer);
+int list_entries(int inode_number, block_list_t *inodes, block_list_t *dirs);
+void walk_run(walk_t *walk, int w);
+void *walk_thread(void *arg);
+
+// public calls that write run as one journal operation each, under the
+// disk's op_lock
+FILE2 create_file(char *filename);
+int delete_file(char *filename);
+int close_file(FILE2 handle);
+int write_file(FILE2 handle, char *buffer, int size);
+int part_blocks();
+int truncate_file(FILE2 handle);
+int fallocate_file(FILE2 handle, QWORD offset, QWORD length);
+int make_dir(char *pathname);
+int remove_dir(char *pathname);
+int remove_tree(char *pathname);
+int clone_file(char *source, char *filename);
+int set_compression(FILE2 handle, int mode);
+void release_blocks(void *context);
+
+// the other public calls, each run by its wrapper under the disk's op_lock
+FILE2 open_file(char *filename);
+int read_file(FILE2 handle, char *buffer, int size);
+int seek_file(FILE2 handle, QWORD offset);
+int seek_data(FILE2 handle, QWORD offset, int whence, QWORD *position);
+DIR2 open_dir(char *pathname);
+int read_dir(DIR2 handle, DIRENT2 *dentry);
+int close_dir(DIR2 handle);
+int read_dir_batch(DIR2 handle, DIRENT2 *dentries, int n);
+int read_dir_plus(DIR2 handle, DIRENTPLUS2 *entries, int n, int flags);
+int set_delete_mode(int mode);
+int sync_disk(void);
+int scan_inodes(DWORD *next, INODESCAN2 *entries, int n);
+int stat_disk(STATFS2 *stats);
+int dir_usage(char *pathname, DU2 *usage);
+int walk_tree(char *pathname, WALK2_FN fn, void *arg, int flags);
 
 int initialize() {
-    superblock = (superblock_t*)malloc(sizeof(superblock_t));
-    if (get_superblock(superblock) != 0) {
-        free(superblock);
+    fs->superblock = (superblock_t*)malloc(sizeof(superblock_t));
+    if (get_superblock(fs->superblock) != 0) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    // a striped disk read through one of its images would find garbage past
+    // the first stripe
+    int members = fs->members > 0 ? fs->members : 1;
+    if (fs->superblock->stripeWidth > 1 && fs->superblock->stripeWidth != (DWORD)members) {
+        printf("the disk is striped over %u images\n", fs->superblock->stripeWidth);
+        free(fs->superblock);
+        return -1;
+    }
+
+    // a commit cut short by a crash is replayed before anything else is
+    // read; it may hold the superblock itself
+    if ((fs->superblock->features & T2FS_FEATURE_JOURNAL) &&
+        (initJournal(fs->superblock->journalStart, fs->superblock->journalSize, release_blocks, fs) != 0 ||
+         get_superblock(fs->superblock) != 0)) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    fs->inode_area = fs->superblock->superblockSize
+                 + fs->superblock->freeInodeBitmapSize
+                 + fs->superblock->freeBlocksBitmapSize;
+    fs->block_area = fs->inode_area + fs->superblock->inodeAreaSize;
+
+    unsigned int data_end = fs->superblock->diskSize;
+    if (fs->superblock->journalSize > 0 && fs->superblock->journalStart < data_end) {
+        data_end = fs->superblock->journalStart;
+    }
+    if (fs->superblock->refcountSize > 0 && fs->superblock->refcountStart < data_end) {
+        data_end = fs->superblock->refcountStart;
+    }
+    if (fs->superblock->checksumSize > 0 && fs->superblock->checksumStart < data_end) {
+        data_end = fs->superblock->checksumStart;
+    }
+    if (fs->superblock->usageSize > 0 && fs->superblock->usageStart < data_end) {
+        data_end = fs->superblock->usageStart;
+    }
+    fs->data_blocks = (data_end - fs->block_area) / fs->superblock->blockSize;
+
+    if (initBitmaps(fs->superblock->superblockSize,
+                    fs->superblock->freeBlocksBitmapSize,
+                    fs->superblock->freeInodeBitmapSize) != 0) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    if ((fs->superblock->features & T2FS_FEATURE_REFLINK) &&
+        initRefcounts(fs->superblock->refcountStart, fs->superblock->refcountSize) != 0) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    if ((fs->superblock->features & T2FS_FEATURE_CHECKSUM) &&
+        initChecksums(fs->superblock->checksumStart, fs->superblock->checksumSize, fs->block_area) != 0) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    if ((fs->superblock->features & T2FS_FEATURE_DIR_USAGE) &&
+        initUsage(fs->superblock->usageStart, fs->superblock->usageSize) != 0) {
+        free(fs->superblock);
+        return -1;
+    }
+
+    // a block freed by a commit not yet on disk still belongs to its old
+    // owner after a crash, so it is not reused before the checkpoint
+    if ((fs->superblock->features & T2FS_FEATURE_JOURNAL) &&
+        holdFreedBits(BITMAP_DADOS) != 0) {
+        free(fs->superblock);
         return -1;
     }
 
-    inode_area = superblock->superblockSize
-                 + superblock->freeInodeBitmapSize
-                 + superblock->freeBlocksBitmapSize;
-    block_area = inode_area + superblock->inodeAreaSize;
+    fs->block_bytes = fs->superblock->blockSize * SECTOR_SIZE;
+    fs->records_per_block = fs->block_bytes / RECORD_SIZE;
+    fs->ptrs_per_block = fs->block_bytes / PTR_SIZE;
+    fs->ptrs_shift = -1;
+    if ((fs->ptrs_per_block & (fs->ptrs_per_block - 1)) == 0) {
+        for (fs->ptrs_shift = 0; (1 << fs->ptrs_shift) < fs->ptrs_per_block; ++fs->ptrs_shift);
+    }
+    fs->htree_capacity = (fs->records_per_block - 1) * HTREE_PER_SLOT;
+    fs->unit_bytes = UNIT_BLOCKS * fs->block_bytes;
+
+    // file blocks are counted in an int, and without large_file the record
+    // only has room for 32-bit sizes
+    QWORD max_blocks = 2 + fs->ptrs_per_block + (QWORD)fs->ptrs_per_block * fs->ptrs_per_block;
+    if (max_blocks > INT_MAX) {
+        max_blocks = INT_MAX;
+    }
+    fs->max_file_bytes = max_blocks * fs->block_bytes;
+    if (!(fs->superblock->features & T2FS_FEATURE_LARGE_FILE) && fs->max_file_bytes > 0xFFFFFFFF) {
+        fs->max_file_bytes = 0xFFFFFFFF;
+    }
+
+    // an inline record may take at most half of a directory block, so a
+    // block split always leaves room for it
+    fs->inline_max = 0;
+    if (fs->superblock->features & T2FS_FEATURE_INLINE_DATA) {
+        fs->inline_max = (fs->records_per_block / 2 - 1) * INLINE_SLOT_BYTES;
+        if (fs->inline_max > INLINE_MAX) {
+            fs->inline_max = INLINE_MAX;
+        }
+    }
+
+    journalStart();
+    if (replay_orphans() != 0) {
+        printf("cannot read the orphan list\n");
+    }
+    journalStop();
+
+    fs->root = (record_t*)malloc(sizeof(record_t));
+    fs->root->TypeVal = TYPEVAL_DIRETORIO;
+    strncpy(fs->root->name, "/\0", 2);
+    fs->root->blocksFileSize = 1;
+    fs->root->bytesFileSize = fs->block_bytes;
+    fs->root->inodeNumber = 0;
+    fs->root->compression = COMPRESSION_NONE;
+
+    fs->t2fs_init = true;
+
+    return 0;
+}
+
+/* Makes a context the calling thread's, along with its modules' state */
+T2FS_CONTEXT *use_context(T2FS_CONTEXT *context) {
+    T2FS_CONTEXT *previous = fs;
+    fs = context;
+    useDisk(context->disk);
+    useJournal(context->journal);
+    useBitmaps(context->bitmaps);
+    useRefcounts(context->refcounts);
+    useChecksums(context->checksums);
+    useUsage(context->usage);
+    return previous;
+}
+
+/* Frees a mounted context nobody uses any more; its journal is committed first */
+void free_context(T2FS_CONTEXT *context) {
+    freeJournal(context->journal);
+    freeUsage(context->usage);
+    freeChecksums(context->checksums);
+    freeRefcounts(context->refcounts);
+    freeBitmaps(context->bitmaps);
+    closeDisk(context->disk);
+    if (context->t2fs_init) {
+        free(context->superblock);
+        free(context->root);
+    }
+    free(context->orphans);
+    pthread_mutex_destroy(&context->orphan_lock);
+    pthread_cond_destroy(&context->orphan_added);
+    pthread_cond_destroy(&context->orphans_freed);
+    pthread_mutex_destroy(&context->op_lock);
+    free(context);
+}
+
+/* Mounts an opened disk of "members" images; the disk is closed on errors */
+T2FS_CONTEXT *mount_disk(struct disk *disk, int members, char *name, int options) {
+    if (options & ~(MOUNT_DEFERRED_DELETE | MOUNT_WARM | MOUNT_WARM_BACKGROUND)) {
+        printf("invalid mount options %x\n", options);
+        closeDisk(disk);
+        return 0;
+    }
+
+    T2FS_CONTEXT *context = (T2FS_CONTEXT*)calloc(1, sizeof(T2FS_CONTEXT));
+    if (context == 0) {
+        closeDisk(disk);
+        return 0;
+    }
+    context->ptrs_shift = -1;
+    context->delete_mode = options & MOUNT_DEFERRED_DELETE ? DELETE_DEFERRED : DELETE_SYNC;
+    pthread_mutex_init(&context->orphan_lock, 0);
+    pthread_cond_init(&context->orphan_added, 0);
+    pthread_cond_init(&context->orphans_freed, 0);
+    pthread_mutex_init(&context->op_lock, 0);
+    context->members = members;
+    context->disk = disk;
+    context->journal = newJournal();
+    context->bitmaps = newBitmaps();
+    context->refcounts = newRefcounts();
+    context->checksums = newChecksums();
+    context->usage = newUsage();
+    if (context->disk == 0 || context->journal == 0 || context->bitmaps == 0 ||
+        context->refcounts == 0 || context->checksums == 0 || context->usage == 0) {
+        printf("cannot mount %s\n", name);
+        free_context(context);
+        return 0;
+    }
+
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = initialize();
+    if (ret == 0 && (options & MOUNT_WARM_BACKGROUND)) {
+        context->warming = pthread_create(&context->warmer, 0, warm, context) == 0;
+    } else if (ret == 0 && (options & MOUNT_WARM)) {
+        warm_up();
+    }
+    use_context(previous);
+    if (ret != 0) {
+        printf("cannot mount %s\n", name);
+        free_context(context);
+        return 0;
+    }
+    return context;
+}
+
+/* Reads the i-node area and the directory blocks of the top levels of the
+   tree with one request per WARM_SECTORS sectors or per block, so the first
+   calls after a mount find them in the page cache. The bitmaps are already
+   in memory. Blocks are read around the journal: a stale one only warms the
+   wrong sectors */
+int warm_up(void) {
+    int sectors = WARM_SECTORS > fs->superblock->blockSize ? WARM_SECTORS : fs->superblock->blockSize;
+    unsigned char *buffer = (unsigned char*)malloc(sectors * SECTOR_SIZE);
+    if (buffer == 0) {
+        return -1;
+    }
 
-    root = (record_t*)malloc(sizeof(record_t));
-    root->TypeVal = TYPEVAL_DIRETORIO;
-    strncpy(root->name, "/\0", 2);
-    root->blocksFileSize = 1;
-    root->bytesFileSize = superblock->blockSize*SECTOR_SIZE;
-    root->inodeNumber = 0;
+    int first;
+    for (first = 0; first < fs->superblock->inodeAreaSize; first += WARM_SECTORS) {
+        int count = fs->superblock->inodeAreaSize - first;
+        if (count > WARM_SECTORS) {
+            count = WARM_SECTORS;
+        }
+        if (read_sectors(fs->inode_area + first, count, buffer) != 0) {
+            free(buffer);
+            return -1;
+        }
+    }
 
-    t2fs_init = true;
+    // breadth first: dirs[begin..end) is the level being read, and the
+    // subdirectories found in it are appended past end
+    int n_inodes = fs->superblock->inodeAreaSize * INODES_PER_SECTOR;
+    int *dirs = (int*)malloc(sizeof(int));
+    int size = 1;
+    int n = 1;
+    int begin = 0;
+    int level;
+    dirs[0] = 0;
+    for (level = 1; level <= WARM_LEVELS && begin < n; ++level) {
+        int end = n;
+        for (; begin < end; ++begin) {
+            inode_t inode;
+            if (get_inode(dirs[begin], &inode) != 0) {
+                continue;
+            }
+            int b;
+            int block_number;
+            for (b = 0; get_n_block(&inode, b, &block_number) == 0 && block_number != INVALID_PTR; ++b) {
+                unsigned int sector = fs->block_area + block_number * fs->superblock->blockSize;
+                if (read_sectors(sector, fs->superblock->blockSize, buffer) != 0 || level == WARM_LEVELS) {
+                    continue;
+                }
+                int i;
+                for (i = 0; i < fs->records_per_block; ++i) {
+                    record_t file;
+                    decode_record(buffer + i * RECORD_SIZE, &file);
+                    if (file.TypeVal != TYPEVAL_DIRETORIO ||
+                        file.inodeNumber <= 0 || file.inodeNumber >= n_inodes) {
+                        continue;
+                    }
+                    if (n == size) {
+                        size *= 2;
+                        dirs = (int*)realloc(dirs, size * sizeof(int));
+                    }
+                    dirs[n++] = file.inodeNumber;
+                }
+            }
+        }
+    }
 
+    free(dirs);
+    free(buffer);
     return 0;
 }
 
+void *warm(void *arg) {
+    use_context((T2FS_CONTEXT*)arg);
+    warm_up();
+    return arg;
+}
+
+T2FS_CONTEXT *t2fs_mount(char *path, int options) {
+    return mount_disk(openDisk(path), 1, path, options);
+}
+
+T2FS_CONTEXT *t2fs_mount_striped(char **paths, int n, int options) {
+    if (n <= 0) {
+        return 0;
+    }
+
+    // the superblock is in the first stripe, at the start of the first image
+    unsigned char sector[SECTOR_SIZE];
+    struct disk *first = openDisk(paths[0]);
+    struct disk *previous = useDisk(first);
+    int ret = first != 0 ? read_sector(0, sector) : -1;
+    useDisk(previous);
+    closeDisk(first);
+    if (ret != 0) {
+        printf("cannot mount %s\n", paths[0]);
+        return 0;
+    }
+
+    unsigned int stripe = get_dword(sector + 52);
+    unsigned int width = get_dword(sector + 56);
+    if ((width > 1 ? width : 1) != (unsigned int)n) {
+        printf("the disk is striped over %u images, not %d\n", width > 1 ? width : 1, n);
+        return 0;
+    }
+    return mount_disk(openStripedDisk(paths, n, stripe), n, paths[0], options);
+}
+
+int t2fs_umount(T2FS_CONTEXT *context) {
+    if (context == 0 || context == &default_context) {
+        return -1;
+    }
+
+    if (context->warming) {
+        pthread_join(context->warmer, 0);
+    }
+
+    // open files keep their sizes in memory until closed
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = 0;
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->files[i].file != 0 && close2(i) != 0) {
+            ret = -1;
+        }
+        if (fs->dirs[i].dir != 0) {
+            closedir2(i);
+        }
+    }
+
+    // the reclaimer frees the orphans left and leaves
+    pthread_mutex_lock(&fs->orphan_lock);
+    fs->unmounting = true;
+    pthread_cond_broadcast(&fs->orphan_added);
+    while (fs->reclaimer_running) {
+        pthread_cond_wait(&fs->orphans_freed, &fs->orphan_lock);
+    }
+    pthread_mutex_unlock(&fs->orphan_lock);
+    if (save_free_counts() != 0) {
+        ret = -1;
+    }
+    use_context(previous);
+
+    free_context(context);
+    return ret;
+}
+
 int get_superblock(superblock_t* sb) {
     unsigned char sector[SECTOR_SIZE];
-    if (read_sector(0, sector) != 0) {
+    if (journalRead(0, sector) != 0) {
         return -1;
     }
 
@@ -133,51 +773,153 @@ int get_superblock(superblock_t* sb) {
                    | sector[offset + 1] << 8
                    | sector[offset + 2] << 16
                    | sector[offset + 3] << 24;
+    offset += 4;
 
-    return 0;
-}
+    //optional features, zero on images from older formatters
+    sb->features = sector[offset]
+                   | sector[offset + 1] << 8
+                   | sector[offset + 2] << 16
+                   | sector[offset + 3] << 24;
+    offset += 4;
 
-int get_inode(int inode_number, inode_t *inode) {
-    unsigned char sector[SECTOR_SIZE];
-    if (read_sector(inode_area + inode_number / 16, sector) != 0) {
-        return -1;
-    }
+    //orphan list, zero until something is deleted in the background
+    sb->orphanBlock = sector[offset]
+                      | sector[offset + 1] << 8
+                      | sector[offset + 2] << 16
+                      | sector[offset + 3] << 24;
+    offset += 4;
+
+    //metadata journal, zero without T2FS_FEATURE_JOURNAL
+    sb->journalStart = sector[offset]
+                       | sector[offset + 1] << 8
+                       | sector[offset + 2] << 16
+                       | sector[offset + 3] << 24;
+    offset += 4;
+    sb->journalSize = sector[offset]
+                      | sector[offset + 1] << 8
+                      | sector[offset + 2] << 16
+                      | sector[offset + 3] << 24;
+    offset += 4;
+
+    //reference counts of shared blocks, zero without T2FS_FEATURE_REFLINK
+    sb->refcountStart = sector[offset]
+                        | sector[offset + 1] << 8
+                        | sector[offset + 2] << 16
+                        | sector[offset + 3] << 24;
+    offset += 4;
+    sb->refcountSize = sector[offset]
+                       | sector[offset + 1] << 8
+                       | sector[offset + 2] << 16
+                       | sector[offset + 3] << 24;
+    offset += 4;
 
-    int offset = (inode_number % 16) * sizeof(inode_t);
-    inode->dataPtr[0] = sector[offset]
+    //sums of the data sectors, zero without T2FS_FEATURE_CHECKSUM
+    sb->checksumStart = sector[offset]
                         | sector[offset + 1] << 8
                         | sector[offset + 2] << 16
                         | sector[offset + 3] << 24;
     offset += 4;
+    sb->checksumSize = sector[offset]
+                       | sector[offset + 1] << 8
+                       | sector[offset + 2] << 16
+                       | sector[offset + 3] << 24;
+    offset += 4;
 
-    inode->dataPtr[1] = sector[offset]
+    //stripes of a disk spread over several images, zero on a single image
+    sb->stripeSectors = sector[offset]
                         | sector[offset + 1] << 8
                         | sector[offset + 2] << 16
                         | sector[offset + 3] << 24;
     offset += 4;
+    sb->stripeWidth = sector[offset]
+                      | sector[offset + 1] << 8
+                      | sector[offset + 2] << 16
+                      | sector[offset + 3] << 24;
+    offset += 4;
+
+    //free counts as of the last sync2; the bitmaps are counted again anyway
+    sb->freeBlocks = sector[offset]
+                     | sector[offset + 1] << 8
+                     | sector[offset + 2] << 16
+                     | sector[offset + 3] << 24;
+    offset += 4;
+    sb->freeInodes = sector[offset]
+                     | sector[offset + 1] << 8
+                     | sector[offset + 2] << 16
+                     | sector[offset + 3] << 24;
+    offset += 4;
 
-    inode->singleIndPtr = sector[offset]
-                          | sector[offset + 1] << 8
-                          | sector[offset + 2] << 16
-                          | sector[offset + 3] << 24;
+    //totals of each directory's subtree, zero without T2FS_FEATURE_DIR_USAGE
+    sb->usageStart = sector[offset]
+                     | sector[offset + 1] << 8
+                     | sector[offset + 2] << 16
+                     | sector[offset + 3] << 24;
     offset += 4;
+    sb->usageSize = sector[offset]
+                    | sector[offset + 1] << 8
+                    | sector[offset + 2] << 16
+                    | sector[offset + 3] << 24;
 
-    inode->doubleIndPtr = sector[offset]
-                          | sector[offset + 1] << 8
-                          | sector[offset + 2] << 16
-                          | sector[offset + 3] << 24;
+    return 0;
+}
+
+int get_inode(int inode_number, inode_t *inode) {
+    unsigned char sector[SECTOR_SIZE];
+    if (journalRead(fs->inode_area + inode_number / INODES_PER_SECTOR, sector) != 0) {
+        return -1;
+    }
 
+    decode_inode(sector + (inode_number % INODES_PER_SECTOR) * sizeof(inode_t), inode);
     return 0;
 }
 
+void decode_inode(unsigned char *buffer, inode_t *inode) {
+    int offset = 0;
+    inode->dataPtr[0] = buffer[offset]
+                        | buffer[offset + 1] << 8
+                        | buffer[offset + 2] << 16
+                        | buffer[offset + 3] << 24;
+    offset += 4;
+
+    inode->dataPtr[1] = buffer[offset]
+                        | buffer[offset + 1] << 8
+                        | buffer[offset + 2] << 16
+                        | buffer[offset + 3] << 24;
+    offset += 4;
+
+    inode->singleIndPtr = buffer[offset]
+                          | buffer[offset + 1] << 8
+                          | buffer[offset + 2] << 16
+                          | buffer[offset + 3] << 24;
+    offset += 4;
+
+    inode->doubleIndPtr = buffer[offset]
+                          | buffer[offset + 1] << 8
+                          | buffer[offset + 2] << 16
+                          | buffer[offset + 3] << 24;
+}
+
+/* Decodes n consecutive i-nodes. On disk they have the layout of the
+   packed struct, little endian, so a little-endian host just copies them */
+void decode_inodes(unsigned char *buffer, inode_t *inodes, int n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(inodes, buffer, n * INODE_SIZE);
+#else
+    int i;
+    for (i = 0; i < n; ++i) {
+        decode_inode(buffer + i * INODE_SIZE, &inodes[i]);
+    }
+#endif
+}
+
 int set_inode(int inode_number, inode_t *inode) {
     unsigned char sector[SECTOR_SIZE];
-    int sector_number = inode_area + inode_number / 16;
-    if (read_sector(sector_number, sector) != 0) {
+    int sector_number = fs->inode_area + inode_number / INODES_PER_SECTOR;
+    if (journalRead(sector_number, sector) != 0) {
         return -1;
     }
 
-    int offset = (inode_number % 16) * sizeof(inode_t);
+    int offset = (inode_number % INODES_PER_SECTOR) * sizeof(inode_t);
     sector[offset++] = inode->dataPtr[0] & 0xFF;
     sector[offset++] = (inode->dataPtr[0] >> 8) & 0xFF;
     sector[offset++] = (inode->dataPtr[0] >> 16) & 0xFF;
@@ -198,196 +940,591 @@ int set_inode(int inode_number, inode_t *inode) {
     sector[offset++] = (inode->doubleIndPtr >> 16) & 0xFF;
     sector[offset++] = (inode->doubleIndPtr >> 24) & 0xFF;
 
-    if (write_sector(sector_number, sector) != 0) {
+    if (journalWrite(sector_number, sector) != 0) {
         return -1;
     }
 
     return 0;
 }
 
+/* Frees an i-node and every block it maps. Each indirection block is read
+   once; the freed numbers are sorted and cleared in the bitmap as runs.
+   Blocks shared with a clone only lose a reference */
 int free_inode(int inode_number) {
     inode_t inode;
     if (get_inode(inode_number, &inode) != 0) {
         return -1;
     }
-    setBitmap2(BITMAP_INODE, inode_number, 0);
 
-    if (inode.dataPtr[0] == INVALID_PTR) {
-        return 0;
-    }
-    setBitmap2(BITMAP_DADOS, inode.dataPtr[0], 0);
-
-    if (inode.dataPtr[1] == INVALID_PTR) {
-        return 0;
+    block_list_t list = {0};
+    int ret = 0;
+    if (drop_block(inode.dataPtr[0], &list) != 0 ||
+        drop_block(inode.dataPtr[1], &list) != 0 ||
+        drop_ind(inode.singleIndPtr, 1, &list, false) < 0 ||
+        drop_ind(inode.doubleIndPtr, 2, &list, false) < 0) {
+        ret = -1;
     }
-    setBitmap2(BITMAP_DADOS, inode.dataPtr[1], 0);
 
-    if (inode.singleIndPtr == INVALID_PTR) {
-        return 0;
+    if (free_blocks(&list) != 0) {
+        ret = -1;
     }
-    setBitmap2(BITMAP_DADOS, inode.singleIndPtr, 0);
+    free(list.blocks);
 
-    int i;
-    int j;
-    int s_ind;
-    int d_ind;
-    for (i = 0; i < 1024; ++i) {
-        s_ind = get_ind(inode.singleIndPtr, i);
-        if (s_ind == INVALID_PTR) {
-            return 0;
-        }
-        setBitmap2(BITMAP_DADOS, s_ind, 0);
+    if (setBitmap(BITMAP_INODE, inode_number, 0) != 0) {
+        ret = -1;
     }
+    return ret;
+}
 
-    if (inode.doubleIndPtr == INVALID_PTR) {
-        return 0;
+void list_add(block_list_t *list, int block_number) {
+    if (block_number == INVALID_PTR) {
+        return;
     }
-    setBitmap2(BITMAP_DADOS, inode.doubleIndPtr, 0);
-
-    for (i = 0; i < 1024; ++i) {
-        d_ind = get_ind(inode.doubleIndPtr, i);
-        if (d_ind == INVALID_PTR) {
-            return 0;
-        }
-        setBitmap2(BITMAP_DADOS, d_ind, 0);
-        for (j = 0; j < 1024; ++j) {
-            s_ind = get_ind(d_ind, j);
-            if (s_ind == INVALID_PTR) {
-                return 0;
-            }
-            setBitmap2(BITMAP_DADOS, s_ind, 0);
-        }
+    if (list->n == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->blocks = (int*)realloc(list->blocks, list->size * sizeof(int));
     }
+    list->blocks[list->n++] = block_number;
+}
 
-    return 0;
+/* Drops a reference to a data block: it is listed to be freed unless a
+   clone still has it */
+int drop_block(int block_number, block_list_t *list) {
+    int ret = unshareBlocks(&block_number, 1);
+    list_add(list, block_number);
+    return ret;
 }
 
-int get_record(int block_number, int record_number, record_t* file) {
-    unsigned char sector[SECTOR_SIZE];
-    unsigned int sector_number = block_area
-                                 + block_number * superblock->blockSize
-                                 + record_number / 4;
-    if (read_sector(sector_number, sector) != 0) {
-        return -1;
+/* Drops a reference to an indirection block mapping "levels" deep. A block
+   with no other owner is listed with everything it maps; a shared one only
+   loses the reference, and is read just when "count" asks for the number
+   of data blocks under it. Returns that number, or -1 */
+int drop_ind(int block_number, int levels, block_list_t *list, bool count) {
+    if (block_number == INVALID_PTR) {
+        return 0;
     }
 
-    int offset = (record_number % 4) * RECORD_SIZE;
-    file->TypeVal = sector[offset];
-    offset += 1;
-
-    if (file->TypeVal == TYPEVAL_INVALIDO) {
+    int owned = block_number;
+    if (unshareBlocks(&owned, 1) != 0) {
         return -1;
     }
+    if (owned == INVALID_PTR) {
+        return count ? drop_entries(block_number, 0, levels, 0, true) : 0;
+    }
+    list_add(list, owned);
+    return drop_entries(block_number, 0, levels, list, count);
+}
 
-    memcpy(file->name, sector + offset, 32);
-    offset += 32;
+/* Drops the entries of an indirection block from "from" on, which map
+   "levels" deep, and counts the data blocks under them. A block kept in
+   part (from > 0) is written back with them cleared. Without a list the
+   entries are only counted: the block is shared and stays as it is */
+int drop_entries(int block_number, int from, int levels, block_list_t *list, bool count) {
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int *ptrs = (int*)malloc(2 * fs->ptrs_per_block * sizeof(int));
+    int *owned = ptrs + fs->ptrs_per_block;
+    int n = read_block(block_number, buffer);
 
-    file->blocksFileSize = sector[offset]
-                           | sector[offset + 1] << 8
-                           | sector[offset + 2] << 16
-                           | sector[offset + 3] << 24;
-    offset += 4;
+    int i;
+    for (i = 0; n == 0 && i < fs->ptrs_per_block; ++i) {
+        ptrs[i] = i < from ? INVALID_PTR : (int)get_dword(buffer + i * PTR_SIZE);
+        owned[i] = ptrs[i];
+    }
 
-    file->bytesFileSize = sector[offset]
-                          | sector[offset + 1] << 8
-                          | sector[offset + 2] << 16
-                          | sector[offset + 3] << 24;
-    offset += 4;
+    // one pass over the counters for the whole block
+    if (n == 0 && list != 0 && unshareBlocks(owned, fs->ptrs_per_block) != 0) {
+        n = -1;
+    }
 
-    file->inodeNumber = sector[offset]
-                        | sector[offset + 1] << 8
-                        | sector[offset + 2] << 16
-                        | sector[offset + 3] << 24;
+    bool dirty = false;
+    for (i = from; n >= 0 && i < fs->ptrs_per_block; ++i) {
+        if (ptrs[i] == INVALID_PTR) {
+            continue;
+        }
+        if (list != 0 && from > 0) {
+            set_dword(buffer + i * PTR_SIZE, INVALID_PTR);
+            dirty = true;
+        }
+        if (list != 0) {
+            list_add(list, owned[i]);
+        }
+        if (levels == 1) {
+            ++n;
+        } else if (owned[i] != INVALID_PTR || count) {
+            int under = drop_entries(ptrs[i], 0, levels - 1,
+                                     owned[i] != INVALID_PTR ? list : 0, count);
+            n = under < 0 ? -1 : n + under;
+        }
+    }
 
-    return 0;
+    if (dirty && n >= 0 && write_block(block_number, buffer) != 0) {
+        n = -1;
+    }
+    free(ptrs);
+    free(buffer);
+    return n;
 }
 
-int set_record(int block_number, int record_number, record_t *file) {
-    unsigned char sector[SECTOR_SIZE];
-    unsigned int sector_number = block_area
-                                 + block_number * superblock->blockSize
-                                 + record_number / 4;
-    if (read_sector(sector_number, sector) != 0) {
-        return -1;
-    }
+int compare_block_numbers(const void *a, const void *b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return x < y ? -1 : x > y;
+}
 
-    int offset = (record_number % 4) * RECORD_SIZE;
-    sector[offset++] = file->TypeVal;
+/* Clears the listed blocks in the bitmap */
+int free_blocks(block_list_t *list) {
+    return clear_runs(BITMAP_DADOS, list);
+}
 
-    memcpy(sector + offset, file->name, 32);
-    offset += 32;
+/* Clears the listed numbers in a bitmap, one call per run of consecutive numbers */
+int clear_runs(int bitmap, block_list_t *list) {
+    qsort(list->blocks, list->n, sizeof(int), compare_block_numbers);
 
-    sector[offset++] = file->blocksFileSize & 0xFF;
-    sector[offset++] = (file->blocksFileSize >> 8) & 0xFF;
-    sector[offset++] = (file->blocksFileSize >> 16) & 0xFF;
-    sector[offset++] = (file->blocksFileSize >> 24) & 0xFF;
+    int i = 0;
+    int j;
+    int ret = 0;
+    while (i < list->n) {
+        for (j = i + 1; j < list->n && list->blocks[j] <= list->blocks[j - 1] + 1; ++j);
+        if (setBitmapRange(bitmap, list->blocks[i],
+                           list->blocks[j - 1] - list->blocks[i] + 1, 0) != 0) {
+            ret = -1;
+        }
+        i = j;
+    }
+    return ret;
+}
 
-    sector[offset++] = file->bytesFileSize & 0xFF;
-    sector[offset++] = (file->bytesFileSize >> 8) & 0xFF;
-    sector[offset++] = (file->bytesFileSize >> 16) & 0xFF;
-    sector[offset++] = (file->bytesFileSize >> 24) & 0xFF;
+/* Frees unlinked i-nodes together, as free_inode does one: the i-nodes are
+   read in order, each sector once, and both bitmaps are cleared a run of
+   numbers at a time */
+int free_inodes(block_list_t *inodes) {
+    qsort(inodes->blocks, inodes->n, sizeof(int), compare_block_numbers);
 
-    sector[offset++] = file->inodeNumber & 0xFF;
-    sector[offset++] = (file->inodeNumber >> 8) & 0xFF;
-    sector[offset++] = (file->inodeNumber >> 16) & 0xFF;
-    sector[offset++] = (file->inodeNumber >> 24) & 0xFF;
+    block_list_t list = {0};
+    unsigned char sector[SECTOR_SIZE];
+    int sector_number = -1;
+    int ret = 0;
+    int i;
+    for (i = 0; i < inodes->n; ++i) {
+        int inode_number = inodes->blocks[i];
+        if (fs->inode_area + inode_number / INODES_PER_SECTOR != sector_number) {
+            sector_number = fs->inode_area + inode_number / INODES_PER_SECTOR;
+            if (journalRead(sector_number, sector) != 0) {
+                sector_number = -1;
+                ret = -1;
+                continue;
+            }
+        }
 
-    if (write_sector(sector_number, sector) != 0) {
-        return -1;
+        inode_t inode;
+        decode_inode(sector + (inode_number % INODES_PER_SECTOR) * INODE_SIZE, &inode);
+        if (drop_block(inode.dataPtr[0], &list) != 0 ||
+            drop_block(inode.dataPtr[1], &list) != 0 ||
+            drop_ind(inode.singleIndPtr, 1, &list, false) < 0 ||
+            drop_ind(inode.doubleIndPtr, 2, &list, false) < 0) {
+            ret = -1;
+        }
     }
 
-    return 0;
+    if (free_blocks(&list) != 0 || clear_runs(BITMAP_INODE, inodes) != 0) {
+        ret = -1;
+    }
+    free(list.blocks);
+    return ret;
 }
 
-int get_ind(int block_number, int ind_number) {
-    unsigned char sector[SECTOR_SIZE];
-    unsigned int sector_number = block_area
-                                 + block_number * superblock->blockSize
-                                 + ind_number / 64;
-    if (read_sector(sector_number, sector) != 0) {
-        return -1;
+/* Forgets the open files and directories among a sorted list of unlinked
+   i-nodes. Nothing is saved: their records are gone */
+void drop_handles(block_list_t *inodes) {
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        int inode_number;
+        if (fs->files[i].file != 0) {
+            inode_number = fs->files[i].file->inodeNumber;
+            if (bsearch(&inode_number, inodes->blocks, inodes->n, sizeof(int), compare_block_numbers) != 0) {
+                free(fs->files[i].data);
+                free(fs->files[i].unit);
+                free(fs->files[i].file);
+                free(fs->files[i].dir);
+                fs->files[i].file = 0;
+                fs->files[i].dir = 0;
+                fs->files[i].data = 0;
+                fs->files[i].unit = 0;
+            }
+        }
+        if (fs->dirs[i].dir != 0) {
+            inode_number = fs->dirs[i].dir->inodeNumber;
+            if (bsearch(&inode_number, inodes->blocks, inodes->n, sizeof(int), compare_block_numbers) != 0) {
+                close_dir(i);
+            }
+        }
     }
-
-    int offset = (ind_number % 64) * 4;
-    int ind = sector[offset]
-              | sector[offset + 1] << 8
-              | sector[offset + 2] << 16
-              | sector[offset + 3] << 24;
-
-    return ind;
 }
 
-int set_ind(int block_number, int ind_number, int ind_block) {
-    unsigned char sector[SECTOR_SIZE];
-    unsigned int sector_number = block_area
-                                 + block_number * superblock->blockSize
-                                 + ind_number / 64;
-    if (read_sector(sector_number, sector) != 0) {
-        return -1;
+/* Loads the orphan list and frees whatever a previous run left in it */
+int replay_orphans() {
+    if (fs->superblock->orphanBlock == 0 || (int)fs->superblock->orphanBlock == INVALID_PTR) {
+        return 0;
     }
 
-    int offset = (ind_number % 64) * 4;
-    sector[offset++] = ind_block & 0xFF;
-    sector[offset++] = (ind_block >> 8) & 0xFF;
-    sector[offset++] = (ind_block >> 16) & 0xFF;
-    sector[offset++] = (ind_block >> 24) & 0xFF;
-
-    if (write_sector(sector_number, sector) != 0) {
+    fs->orphans = (int*)malloc(fs->ptrs_per_block * sizeof(int));
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    if (read_block(fs->superblock->orphanBlock, buffer) != 0) {
+        free(buffer);
+        free(fs->orphans);
+        fs->orphans = 0;
         return -1;
     }
 
-    return 0;
-}
-
-int load_file(char *filename, record_t *dir, record_t *file) {
-    if (filename[0] != '/') {
-        printf("not an absolute path\n");
-        return -1;
+    block_list_t inodes = {0};
+    int i;
+    for (i = 0; i < fs->ptrs_per_block; ++i) {
+        fs->orphans[i] = INVALID_PTR;
+        list_add(&inodes, get_dword(buffer + i * PTR_SIZE));
     }
-    printf("load file %s\n", filename);
 
-    *file = *root;
-    char *buffer = (char*)malloc(sizeof(char) * strlen(filename) + 1);
+    int ret = 0;
+    if (inodes.n > 0) {
+        free_inodes(&inodes);
+        memset(buffer, 0xFF, fs->block_bytes);
+        ret = write_block(fs->superblock->orphanBlock, buffer);
+    }
+    free(inodes.blocks);
+    free(buffer);
+    return ret;
+}
+
+/* Records an unlinked i-node in the orphan list and wakes the reclaimer */
+int add_orphan(int inode_number) {
+    int ret = -1;
+    pthread_mutex_lock(&fs->orphan_lock);
+
+    if (fs->orphans == 0) {
+        int block_number = alloc_block(true);
+        unsigned char sector[SECTOR_SIZE];
+        if (block_number == INVALID_PTR) {
+            pthread_mutex_unlock(&fs->orphan_lock);
+            return -1;
+        }
+        if (journalRead(0, sector) != 0) {
+            setBitmap(BITMAP_DADOS, block_number, 0);
+            pthread_mutex_unlock(&fs->orphan_lock);
+            return -1;
+        }
+        set_dword(sector + 24, block_number);
+        if (journalWrite(0, sector) != 0) {
+            setBitmap(BITMAP_DADOS, block_number, 0);
+            pthread_mutex_unlock(&fs->orphan_lock);
+            return -1;
+        }
+        fs->superblock->orphanBlock = block_number;
+
+        fs->orphans = (int*)malloc(fs->ptrs_per_block * sizeof(int));
+        int i;
+        for (i = 0; i < fs->ptrs_per_block; ++i) {
+            fs->orphans[i] = INVALID_PTR;
+        }
+    }
+
+    if (!fs->reclaimer_running) {
+        if (pthread_create(&fs->reclaimer, 0, reclaim, fs) != 0) {
+            pthread_mutex_unlock(&fs->orphan_lock);
+            return -1;
+        }
+        pthread_detach(fs->reclaimer);
+        fs->reclaimer_running = true;
+    }
+
+    int i;
+    for (i = 0; i < fs->ptrs_per_block; ++i) {
+        if (fs->orphans[i] == INVALID_PTR) {
+            break;
+        }
+    }
+    if (i < fs->ptrs_per_block &&
+        set_ind(fs->superblock->orphanBlock, i, inode_number) == 0) {
+        fs->orphans[i] = inode_number;
+        ++fs->n_orphans;
+        ret = 0;
+        pthread_cond_signal(&fs->orphan_added);
+    }
+
+    pthread_mutex_unlock(&fs->orphan_lock);
+    return ret;
+}
+
+/* Background thread: frees orphans one at a time, oldest slot first, until
+   its context is unmounted */
+void *reclaim(void *arg) {
+    use_context((T2FS_CONTEXT*)arg);
+    pthread_mutex_lock(&fs->orphan_lock);
+    while (1) {
+        while (fs->n_orphans == 0 && !fs->unmounting) {
+            pthread_cond_broadcast(&fs->orphans_freed);
+            pthread_cond_wait(&fs->orphan_added, &fs->orphan_lock);
+        }
+        if (fs->n_orphans == 0) {
+            break;
+        }
+
+        int i;
+        for (i = 0; fs->orphans[i] == INVALID_PTR; ++i);
+        int inode_number = fs->orphans[i];
+        pthread_mutex_unlock(&fs->orphan_lock);
+
+        // the blocks and the list entry go away in the same commit
+        journalStart();
+        free_inode(inode_number);
+
+        pthread_mutex_lock(&fs->orphan_lock);
+        set_ind(fs->superblock->orphanBlock, i, INVALID_PTR);
+        fs->orphans[i] = INVALID_PTR;
+        --fs->n_orphans;
+        pthread_mutex_unlock(&fs->orphan_lock);
+        journalStop();
+        pthread_mutex_lock(&fs->orphan_lock);
+    }
+    fs->reclaimer_running = false;
+    pthread_cond_broadcast(&fs->orphans_freed);
+    pthread_mutex_unlock(&fs->orphan_lock);
+    return arg;
+}
+
+/* Journal checkpoint: blocks freed by the commit may be allocated again.
+   It runs in the committer thread, which only picked the context's journal */
+void release_blocks(void *context) {
+    struct bitmaps *previous = useBitmaps(((T2FS_CONTEXT*)context)->bitmaps);
+    releaseFreedBits(BITMAP_DADOS);
+    useBitmaps(previous);
+}
+
+/* Frees an unlinked i-node now or hands it to the reclaimer */
+int release_inode(int inode_number) {
+    if (fs->delete_mode == DELETE_DEFERRED && add_orphan(inode_number) == 0) {
+        return 0;
+    }
+    return free_inode(inode_number);
+}
+
+int set_delete_mode2(int mode) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = set_delete_mode(mode);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int set_delete_mode(int mode) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    if (mode != DELETE_SYNC && mode != DELETE_DEFERRED) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->orphan_lock);
+    fs->delete_mode = mode;
+    while (mode == DELETE_SYNC && fs->n_orphans > 0) {
+        pthread_cond_wait(&fs->orphans_freed, &fs->orphan_lock);
+    }
+    pthread_mutex_unlock(&fs->orphan_lock);
+    return 0;
+}
+
+int sync2(void) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = sync_disk();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int sync_disk(void) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    int ret = save_free_counts();
+    return journalCommit() == 0 ? ret : -1;
+}
+
+/* Writes the free counts to the superblock if they changed since the last
+   time. They are only advice for readers of the image: initialize counts
+   the bitmaps, so counts left stale by a crash do no harm */
+int save_free_counts(void) {
+    int blocks = countFreeBits(BITMAP_DADOS);
+    int inodes = countFreeBits(BITMAP_INODE);
+    if (blocks < 0 || inodes < 0) {
+        return -1;
+    }
+    if ((DWORD)blocks == fs->superblock->freeBlocks && (DWORD)inodes == fs->superblock->freeInodes) {
+        return 0;
+    }
+
+    // the orphan list also rewrites the superblock
+    unsigned char sector[SECTOR_SIZE];
+    journalStart();
+    pthread_mutex_lock(&fs->orphan_lock);
+    int ret = journalRead(0, sector);
+    if (ret == 0) {
+        set_dword(sector + 60, blocks);
+        set_dword(sector + 64, inodes);
+        ret = journalWrite(0, sector);
+    }
+    if (ret == 0) {
+        fs->superblock->freeBlocks = blocks;
+        fs->superblock->freeInodes = inodes;
+    }
+    pthread_mutex_unlock(&fs->orphan_lock);
+    journalStop();
+    return ret;
+}
+
+int get_record(int block_number, int record_number, record_t* file) {
+    unsigned char sector[SECTOR_SIZE];
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize
+                                 + record_number / RECORDS_PER_SECTOR;
+    if (journalRead(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    decode_record(sector + (record_number % RECORDS_PER_SECTOR) * RECORD_SIZE, file);
+    if (file->TypeVal == TYPEVAL_INVALIDO) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void decode_record(unsigned char *buffer, record_t *file) {
+    int offset = 0;
+    file->TypeVal = buffer[offset];
+    offset += 1;
+
+    memcpy(file->name, buffer + offset, 32);
+    offset += 32;
+
+    file->blocksFileSize = buffer[offset]
+                           | buffer[offset + 1] << 8
+                           | buffer[offset + 2] << 16
+                           | buffer[offset + 3] << 24;
+    offset += 4;
+
+    file->bytesFileSize = buffer[offset]
+                          | buffer[offset + 1] << 8
+                          | buffer[offset + 2] << 16
+                          | (unsigned int)buffer[offset + 3] << 24;
+    offset += 4;
+
+    file->inodeNumber = buffer[offset]
+                        | buffer[offset + 1] << 8
+                        | buffer[offset + 2] << 16
+                        | buffer[offset + 3] << 24;
+    offset += 4;
+
+    // older images may hold anything past the i-node number
+    file->compression = fs->superblock->features & T2FS_FEATURE_COMPRESSION ? buffer[offset] : COMPRESSION_NONE;
+    offset += 1;
+
+    //high half of the size
+    if (fs->superblock->features & T2FS_FEATURE_LARGE_FILE) {
+        file->bytesFileSize |= (QWORD)get_dword(buffer + offset) << 32;
+    }
+}
+
+int set_record(int block_number, int record_number, record_t *file) {
+    unsigned char sector[SECTOR_SIZE];
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize
+                                 + record_number / RECORDS_PER_SECTOR;
+    if (journalRead(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    encode_record(sector + (record_number % RECORDS_PER_SECTOR) * RECORD_SIZE, file);
+    if (journalWrite(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void encode_record(unsigned char *buffer, record_t *file) {
+    int offset = 0;
+    buffer[offset++] = file->TypeVal;
+
+    memcpy(buffer + offset, file->name, 32);
+    offset += 32;
+
+    buffer[offset++] = file->blocksFileSize & 0xFF;
+    buffer[offset++] = (file->blocksFileSize >> 8) & 0xFF;
+    buffer[offset++] = (file->blocksFileSize >> 16) & 0xFF;
+    buffer[offset++] = (file->blocksFileSize >> 24) & 0xFF;
+
+    buffer[offset++] = file->bytesFileSize & 0xFF;
+    buffer[offset++] = (file->bytesFileSize >> 8) & 0xFF;
+    buffer[offset++] = (file->bytesFileSize >> 16) & 0xFF;
+    buffer[offset++] = (file->bytesFileSize >> 24) & 0xFF;
+
+    buffer[offset++] = file->inodeNumber & 0xFF;
+    buffer[offset++] = (file->inodeNumber >> 8) & 0xFF;
+    buffer[offset++] = (file->inodeNumber >> 16) & 0xFF;
+    buffer[offset++] = (file->inodeNumber >> 24) & 0xFF;
+
+    buffer[offset++] = file->compression;
+
+    set_dword(buffer + offset, (unsigned int)(file->bytesFileSize >> 32));
+}
+
+int get_ind(int block_number, int ind_number) {
+    unsigned char sector[SECTOR_SIZE];
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize
+                                 + ind_number / PTRS_PER_SECTOR;
+    if (journalRead(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    int offset = (ind_number % PTRS_PER_SECTOR) * PTR_SIZE;
+    int ind = sector[offset]
+              | sector[offset + 1] << 8
+              | sector[offset + 2] << 16
+              | sector[offset + 3] << 24;
+
+    return ind;
+}
+
+int set_ind(int block_number, int ind_number, int ind_block) {
+    unsigned char sector[SECTOR_SIZE];
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize
+                                 + ind_number / PTRS_PER_SECTOR;
+    if (journalRead(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    int offset = (ind_number % PTRS_PER_SECTOR) * PTR_SIZE;
+    sector[offset++] = ind_block & 0xFF;
+    sector[offset++] = (ind_block >> 8) & 0xFF;
+    sector[offset++] = (ind_block >> 16) & 0xFF;
+    sector[offset++] = (ind_block >> 24) & 0xFF;
+
+    if (journalWrite(sector_number, sector) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int load_file(char *filename, record_t *dir, record_t *file, unsigned char *data) {
+    if (filename[0] != '/') {
+        printf("not an absolute path\n");
+        return -1;
+    }
+    printf("load file %s\n", filename);
+
+    *file = *fs->root;
+    char *buffer = (char*)malloc(sizeof(char) * strlen(filename) + 1);
     char *begin = filename + 1;
     char *end;
     do {
@@ -401,7 +1538,7 @@ int load_file(char *filename, record_t *dir, record_t *file) {
         buffer[end - begin] = 0;
 
         printf("search file %s\n", buffer);
-        if (load_dir(buffer, file) != 0) {
+        if (load_dir(buffer, file, data) != 0) {
             printf("file %s not found\n", buffer);
             free(buffer);
             return -1;
@@ -416,7 +1553,7 @@ int load_file(char *filename, record_t *dir, record_t *file) {
     return 0;
 }
 
-int load_dir(char *filename, record_t *file) {
+int load_dir(char *filename, record_t *file, unsigned char *data) {
     if (file->TypeVal != TYPEVAL_DIRETORIO) {
         return -1;
     }
@@ -427,159 +1564,273 @@ int load_dir(char *filename, record_t *file) {
         return -1;
     }
 
-    if (load_block(filename, inode.dataPtr[0], file) == 0) {
-        printf("file %s found on block %d\n", filename, inode.dataPtr[0]);
-        return 0;
+    int block_number;
+    int record_number;
+    return find_record(&inode, filename, file, &block_number, &record_number, data);
+}
+
+/* Looks a name up in a directory, returning the record and where it is.
+   Indexed directories go straight to the leaf the name hashes to; any
+   other directory, or an index that cannot be walked, is scanned block
+   by block. The contents of an inline file are copied to "data" from the
+   same block read. */
+int find_record(inode_t *inode, char *filename, record_t *file, int *block_number, int *record_number, unsigned char *data) {
+    if (inode->dataPtr[0] == INVALID_PTR) {
+        return -1;
     }
 
-    if (load_block(filename, inode.dataPtr[1], file) == 0) {
-        return 0;
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int path[HTREE_MAX_LEVELS + 2];
+    int index[HTREE_MAX_LEVELS + 1];
+    int n;
+
+    if (fs->superblock->features & T2FS_FEATURE_DIR_INDEX) {
+        n = htree_walk(inode, name_hash(filename), path, index, buffer);
+        if (n > 0 && read_block(path[n], buffer) == 0) {
+            *block_number = path[n];
+            *record_number = scan_block(buffer, filename, file);
+            if (*record_number >= 0 && data != 0) {
+                get_inline(buffer, *record_number, file, data);
+            }
+            free(buffer);
+            return *record_number < 0 ? -1 : 0;
+        }
     }
 
-    if (load_single_ind(filename, inode.singleIndPtr, file) == 0) {
-        return 0;
+    for (n = 0; get_n_block(inode, n, block_number) == 0; ++n) {
+        if (*block_number == INVALID_PTR || read_block(*block_number, buffer) != 0) {
+            break;
+        }
+        *record_number = scan_block(buffer, filename, file);
+        if (*record_number >= 0) {
+            if (data != 0) {
+                get_inline(buffer, *record_number, file, data);
+            }
+            free(buffer);
+            return 0;
+        }
     }
 
-    if (load_double_ind(filename, inode.doubleIndPtr, file) == 0) {
-        return 0;
+    free(buffer);
+    return -1;
+}
+
+int scan_block(unsigned char *buffer, char *filename, record_t *file) {
+    record_t record;
+    int i;
+    for (i = 0; i < fs->records_per_block; ++i) {
+        if (buffer[i * RECORD_SIZE] == TYPEVAL_INVALIDO) {
+            continue;
+        }
+        decode_record(buffer + i * RECORD_SIZE, &record);
+        if (strncmp(record.name, filename, 32) == 0) {
+            *file = record;
+            return i;
+        }
     }
 
     return -1;
 }
 
-int load_block(char *filename, int block_number, record_t *file) {
-    if (block_number == INVALID_PTR) {
+int save_file(record_t *file, record_t *dir, unsigned char *data) {
+    if (dir->TypeVal != TYPEVAL_DIRETORIO) {
+        return -1;
+    }
+    printf("save %s in %s\n", file->name, dir->name);
+    inode_t inode;
+    if (get_inode(dir->inodeNumber, &inode) != 0) {
         return -1;
     }
 
-    int i;
-    for (i = 0; i < 64; ++i) {
-        if (get_record(block_number, i, file) == 0) {
-            printf("compare %s %s\n", file->name, filename);
-            if (strcmp(file->name, filename) == 0) {
-                return 0;
-            }
+    // an existing record is rewritten in place, wherever it is
+    record_t record;
+    record_t *old = 0;
+    int block_number;
+    int record_number;
+    int ret;
+    if (find_record(&inode, file->name, &record, &block_number, &record_number, 0) == 0) {
+        old = &record;
+        ret = update_record(block_number, record_number, file, data);
+        if (ret < 0) {
+            return ret;
+        } else if (ret == 0) {
+            return account_usage(dir, old, file);
         }
+    } else if (file->TypeVal == TYPEVAL_INVALIDO) {
+        return -1;
     }
 
-    return -1;
+    ret = insert_record(dir, &inode, file, data);
+    if (ret != 0 && is_inline(file) && spill_inline(file, data) == 0) {
+        printf("no room for %s inline, moved to a data block\n", file->name);
+        ret = insert_record(dir, &inode, file, 0);
+    }
+    return ret == 0 ? account_usage(dir, old, file) : ret;
 }
 
-int load_single_ind(char *filename, int block_number, record_t *file) {
-    if (block_number == INVALID_PTR) {
-        return -1;
+/* Carries the change from the "old" record (0 if there was none) to the
+   saved one to the totals of the directory and of those above it. A
+   directory that goes away takes its whole subtree with it */
+int account_usage(record_t *dir, record_t *old, record_t *file) {
+    if (!(fs->superblock->features & T2FS_FEATURE_DIR_USAGE)) {
+        return 0;
     }
 
-    int i;
-    int ind;
-    for (i = 0; i < 1024; ++i) {
-        ind = get_ind(block_number, i);
-        if (ind == INVALID_PTR) {
+    long long bytes = 0;
+    long long blocks = 0;
+    int files = 0;
+    int dirs = 0;
+    if (old != 0 && old->TypeVal == TYPEVAL_REGULAR) {
+        bytes -= old->bytesFileSize;
+        blocks -= old->blocksFileSize;
+        --files;
+    } else if (old != 0 && old->TypeVal == TYPEVAL_DIRETORIO && file->TypeVal != TYPEVAL_DIRETORIO) {
+        DU2 subtree;
+        if (getUsage(old->inodeNumber, &subtree) != 0) {
             return -1;
         }
+        bytes -= subtree.bytes;
+        blocks -= subtree.blocks;
+        files -= subtree.files;
+        dirs -= subtree.dirs + 1;
+    }
 
-        if (load_block(filename, ind, file) == 0) {
-            return 0;
+    if (file->TypeVal == TYPEVAL_REGULAR) {
+        bytes += file->bytesFileSize;
+        blocks += file->blocksFileSize;
+        ++files;
+    } else if (file->TypeVal == TYPEVAL_DIRETORIO && (old == 0 || old->TypeVal != TYPEVAL_DIRETORIO)) {
+        if (resetUsage(file->inodeNumber, dir->inodeNumber) != 0) {
+            return -1;
         }
+        ++dirs;
     }
 
-    return -1;
+    return addUsage(dir->inodeNumber, bytes, blocks, files, dirs);
 }
 
-int load_double_ind(char *filename, int block_number, record_t *file) {
-    if (block_number == INVALID_PTR) {
+/* Rewrites a record where it is. When its inline contents grew past the
+   free slots behind it, the record moves within its block; if the block
+   has no room it is taken out and 1 is returned so it can be inserted
+   elsewhere */
+int update_record(int block_number, int record_number, record_t *file, unsigned char *data) {
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    if (read_block(block_number, buffer) != 0) {
+        free(buffer);
         return -1;
     }
 
-    int i;
-    int ind;
-    for (i = 0; i < 1024; ++i) {
-        ind = get_ind(block_number, i);
-        if (ind == INVALID_PTR) {
-            return -1;
+    int old = clear_slots(buffer, record_number);
+    int need = 1 + inline_slots(file);
+    int ret;
+    if (file->TypeVal == TYPEVAL_INVALIDO) {
+        ret = write_slots(block_number, buffer, record_number, old);
+    } else if (slots_free(buffer, record_number, need)) {
+        put_record(buffer, record_number, file, data);
+        ret = write_slots(block_number, buffer, record_number, need > old ? need : old);
+    } else {
+        // the slots it left must reach the disk too
+        ret = place_record(block_number, buffer, file, data);
+        if (ret == 0 && write_slots(block_number, buffer, record_number, old) != 0) {
+            ret = -1;
         }
-
-        if (load_single_ind(filename, ind, file) == 0) {
-            return 0;
+        if (ret == 1 && write_block(block_number, buffer) != 0) {
+            ret = -1;
         }
     }
 
-    return -1;
+    free(buffer);
+    return ret;
 }
 
-int save_file(record_t *file, record_t *dir) {
-    if (dir->TypeVal != TYPEVAL_DIRETORIO) {
-        return -1;
-    }
-    printf("save %s in %s\n", file->name, dir->name);
-    inode_t inode;
-    if (get_inode(dir->inodeNumber, &inode) != 0) {
-        return -1;
+/* Adds a new record to a directory, growing it or its index as needed */
+int insert_record(record_t *dir, inode_t *inode, record_t *file, unsigned char *data) {
+    int ret;
+    unsigned char sector[SECTOR_SIZE];
+    if ((fs->superblock->features & T2FS_FEATURE_DIR_INDEX) &&
+        inode->dataPtr[0] != INVALID_PTR &&
+        journalRead(fs->block_area + inode->dataPtr[0] * fs->superblock->blockSize, sector) == 0 &&
+        is_htree_node(sector)) {
+        ret = htree_insert(inode, file, data);
+        set_inode(dir->inodeNumber, inode);
+        return ret;
     }
+
     printf("save record in inode %d\n", dir->inodeNumber);
-    if (inode.dataPtr[0] == INVALID_PTR) {
-        inode.dataPtr[0] = searchBitmap2(BITMAP_DADOS, 0);
+    if (inode->dataPtr[0] == INVALID_PTR) {
+        inode->dataPtr[0] = alloc_block(false);
     }
-    if (save_block(file, inode.dataPtr[0]) != 0) {
+    if (save_block(file, data, inode->dataPtr[0]) != 0) {
+
+        // a directory outgrowing its first block becomes indexed
+        if ((fs->superblock->features & T2FS_FEATURE_DIR_INDEX) &&
+            inode->dataPtr[1] == INVALID_PTR) {
+            ret = htree_convert(inode);
+            if (ret == 0) {
+                ret = htree_insert(inode, file, data);
+            }
+            set_inode(dir->inodeNumber, inode);
+            return ret;
+        }
 
-        if (inode.dataPtr[0] == INVALID_PTR) {
-            inode.dataPtr[0] = searchBitmap2(BITMAP_DADOS, 0);
+        if (inode->dataPtr[1] == INVALID_PTR) {
+            inode->dataPtr[1] = alloc_block(false);
         }
-        if (save_block(file, inode.dataPtr[1]) != 0) {
+        if (save_block(file, data, inode->dataPtr[1]) != 0) {
 
-            if (inode.singleIndPtr == INVALID_PTR) {
-                inode.singleIndPtr = searchBitmap2(BITMAP_DADOS, 0);
+            if (inode->singleIndPtr == INVALID_PTR) {
+                inode->singleIndPtr = alloc_block(true);
             }
-            if (save_single_ind(file, inode.singleIndPtr) != 0) {
+            if (save_single_ind(file, data, inode->singleIndPtr) != 0) {
 
-                if (inode.doubleIndPtr == INVALID_PTR) {
-                    inode.doubleIndPtr = searchBitmap2(BITMAP_DADOS, 0);
+                if (inode->doubleIndPtr == INVALID_PTR) {
+                    inode->doubleIndPtr = alloc_block(true);
                 }
-                if (save_double_ind(file, inode.doubleIndPtr) != 0) {
+                if (save_double_ind(file, data, inode->doubleIndPtr) != 0) {
+                    set_inode(dir->inodeNumber, inode);
                     return -1;
                 }
             }
         }
     }
 
-    set_inode(dir->inodeNumber, &inode);
+    set_inode(dir->inodeNumber, inode);
 
     return 0;
 }
 
-int save_block(record_t *file, int block_number) {
+int save_block(record_t *file, unsigned char *data, int block_number) {
     if (block_number == INVALID_PTR) {
         return -1;
     }
 
-    int i;
-    record_t record;
-    for (i = 0; i < 64; ++i) {
-        if (get_record(block_number, i, &record) != 0 ||
-            strcmp(file->name, record.name) == 0) {
-            if (set_record(block_number, i, file) == 0) {
-                return 0;
-            }
-        }
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int ret = -1;
+    if (read_block(block_number, buffer) == 0) {
+        ret = place_record(block_number, buffer, file, data);
     }
 
-    return -1;
+    free(buffer);
+    return ret == 0 ? 0 : -1;
 }
 
-int save_single_ind(record_t *file, int block_number) {
+int save_single_ind(record_t *file, unsigned char *data, int block_number) {
     if (block_number == INVALID_PTR) {
         return -1;
     }
 
     int i;
     int ind;
-    for (i = 0; i < 1024; ++i) {
+    for (i = 0; i < fs->ptrs_per_block; ++i) {
         ind = get_ind(block_number, i);
         if (ind == INVALID_PTR) {
-            ind = searchBitmap2(BITMAP_DADOS, 0);
+            ind = alloc_block(false);
+            if (ind == INVALID_PTR) {
+                return -1;
+            }
             set_ind(block_number, i, ind);
         }
-        if (save_block(file, ind) == 0) {
+        if (save_block(file, data, ind) == 0) {
             return 0;
         }
     }
@@ -587,20 +1838,23 @@ int save_single_ind(record_t *file, int block_number) {
     return -1;
 }
 
-int save_double_ind(record_t *file, int block_number) {
+int save_double_ind(record_t *file, unsigned char *data, int block_number) {
     if (block_number == INVALID_PTR) {
         return -1;
     }
 
     int i;
     int ind;
-    for (i = 0; i < 1024; ++i) {
+    for (i = 0; i < fs->ptrs_per_block; ++i) {
         ind = get_ind(block_number, i);
         if (ind == INVALID_PTR) {
-            ind = searchBitmap2(BITMAP_DADOS, 0);
+            ind = alloc_block(true);
+            if (ind == INVALID_PTR) {
+                return -1;
+            }
             set_ind(block_number, i, ind);
         }
-        if (save_single_ind(file, ind) == 0) {
+        if (save_single_ind(file, data, ind) == 0) {
             return 0;
         }
     }
@@ -608,42 +1862,568 @@ int save_double_ind(record_t *file, int block_number) {
     return -1;
 }
 
-int identify2(char *name, int size) {
-    const char *names = "Leonardo Abreu Nahra: 242256\n" \
-                        "Pedro Frederico Kampmann: 242244\n";
-    strncpy(name, names, size);
-    return 0;
+/* A sparse file may have no blocks at all; only a small one is inline */
+bool is_inline(record_t *file) {
+    return fs->inline_max > 0 && file->TypeVal == TYPEVAL_REGULAR &&
+           file->blocksFileSize == 0 && file->bytesFileSize > 0 &&
+           file->bytesFileSize <= (unsigned int)fs->inline_max;
 }
 
-FILE2 create2(char *filename) {
-    if (!t2fs_init) {
-        initialize();
+int inline_slots(record_t *file) {
+    if (!is_inline(file)) {
+        return 0;
     }
+    return (file->bytesFileSize + INLINE_SLOT_BYTES - 1) / INLINE_SLOT_BYTES;
+}
 
-    if (filename[0] != '/') {
-        printf("not an absolute path\n");
-        return -1;
+/* Number of inline slots following a record */
+int slot_run(unsigned char *buffer, int record_number) {
+    int i = record_number + 1;
+    while (i < fs->records_per_block &&
+           buffer[i * RECORD_SIZE] == TYPEVAL_INVALIDO &&
+           buffer[i * RECORD_SIZE + 1] == INLINE_MARK) {
+        ++i;
     }
+    return i - record_number - 1;
+}
 
+bool slots_free(unsigned char *buffer, int first, int n) {
     int i;
-    for (i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (files[i].file == 0) {
-            break;
-        }
+    if (first + n > fs->records_per_block) {
+        return false;
     }
-    if (i == MAX_OPEN_FILES) {
-        return -1;
+    for (i = first; i < first + n; ++i) {
+        if (buffer[i * RECORD_SIZE] != TYPEVAL_INVALIDO ||
+            buffer[i * RECORD_SIZE + 1] == INLINE_MARK) {
+            return false;
+        }
     }
+    return true;
+}
 
-    int inode_number = searchBitmap2(BITMAP_INODE, 0);
-    if (inode_number < 0) {
-        return -1;
-    }
+/* First run of n free slots, -1 if there is none */
+int find_slots(unsigned char *buffer, int n) {
+    int i;
+    for (i = 0; i + n <= fs->records_per_block; ++i) {
+        if (slots_free(buffer, i, n)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Slot layout: [0] invalid type, [1] INLINE_MARK, [2..63] contents */
+void put_record(unsigned char *buffer, int record_number, record_t *file, unsigned char *data) {
+    encode_record(buffer + record_number * RECORD_SIZE, file);
+
+    int n = inline_slots(file);
+    int i;
+    int size;
+    for (i = 0; i < n; ++i) {
+        unsigned char *slot = buffer + (record_number + 1 + i) * RECORD_SIZE;
+        memset(slot, 0, RECORD_SIZE);
+        slot[1] = INLINE_MARK;
+        size = file->bytesFileSize - i * INLINE_SLOT_BYTES;
+        if (size > INLINE_SLOT_BYTES) {
+            size = INLINE_SLOT_BYTES;
+        }
+        if (data != 0) {
+            memcpy(slot + 2, data + i * INLINE_SLOT_BYTES, size);
+        }
+    }
+}
+
+void get_inline(unsigned char *buffer, int record_number, record_t *file, unsigned char *data) {
+    int n = inline_slots(file);
+    int run = slot_run(buffer, record_number);
+    int i;
+    int size;
+    for (i = 0; i < n; ++i) {
+        size = file->bytesFileSize - i * INLINE_SLOT_BYTES;
+        if (size > INLINE_SLOT_BYTES) {
+            size = INLINE_SLOT_BYTES;
+        }
+        if (i < run) {
+            memcpy(data + i * INLINE_SLOT_BYTES,
+                   buffer + (record_number + 1 + i) * RECORD_SIZE + 2, size);
+        } else {
+            memset(data + i * INLINE_SLOT_BYTES, 0, size);
+        }
+    }
+}
+
+/* Frees a record and its inline slots, returning how many slots it took */
+int clear_slots(unsigned char *buffer, int record_number) {
+    int n = 1 + slot_run(buffer, record_number);
+    memset(buffer + record_number * RECORD_SIZE, TYPEVAL_INVALIDO, n * RECORD_SIZE);
+    return n;
+}
+
+/* Packs the records and their inline slots at the start of the block,
+   returning the number of free slots left at its end */
+int compact_block(unsigned char *buffer) {
+    unsigned char *copy = (unsigned char*)malloc(fs->block_bytes);
+    memcpy(copy, buffer, fs->block_bytes);
+    memset(buffer, TYPEVAL_INVALIDO, fs->block_bytes);
+
+    int used = 0;
+    int i;
+    int n;
+    for (i = 0; i < fs->records_per_block; i += n) {
+        n = 1;
+        if (copy[i * RECORD_SIZE] != TYPEVAL_INVALIDO) {
+            n += slot_run(copy, i);
+            memcpy(buffer + used * RECORD_SIZE, copy + i * RECORD_SIZE, n * RECORD_SIZE);
+            used += n;
+        }
+    }
+
+    free(copy);
+    return fs->records_per_block - used;
+}
+
+/* Writes only the sectors holding slots first..first+n-1 */
+int write_slots(int block_number, unsigned char *buffer, int first, int n) {
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize;
+    int i;
+    for (i = first / RECORDS_PER_SECTOR; i <= (first + n - 1) / RECORDS_PER_SECTOR; ++i) {
+        if (journalWrite(sector_number + i, buffer + i * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Puts a record and its inline contents in the block held in buffer,
+   compacting it when the free slots are scattered. Returns 1 if the
+   block has no room */
+int place_record(int block_number, unsigned char *buffer, record_t *file, unsigned char *data) {
+    int need = 1 + inline_slots(file);
+    int i = find_slots(buffer, need);
+    if (i >= 0) {
+        put_record(buffer, i, file, data);
+        return write_slots(block_number, buffer, i, need);
+    }
+
+    if (compact_block(buffer) < need) {
+        return 1;
+    }
+    put_record(buffer, find_slots(buffer, need), file, data);
+    return write_block(block_number, buffer);
+}
+
+/* Moves the contents of an inline file to data blocks */
+int spill_inline(record_t *file, unsigned char *data) {
+    inode_t inode;
+    if (data == 0 || get_inode(file->inodeNumber, &inode) != 0) {
+        return -1;
+    }
+
+    int size = file->bytesFileSize;
+    if (write_data(file, &inode, 0, (char*)data, size) != size) {
+        set_inode(file->inodeNumber, &inode);
+        return -1;
+    }
+    return set_inode(file->inodeNumber, &inode);
+}
+
+/* Maps a new block at the end of a directory */
+int append_dir_block(inode_t *inode, int block_number) {
+    if (inode->dataPtr[0] == INVALID_PTR) {
+        inode->dataPtr[0] = block_number;
+        return 0;
+    }
+    if (inode->dataPtr[1] == INVALID_PTR) {
+        inode->dataPtr[1] = block_number;
+        return 0;
+    }
+
+    if (inode->singleIndPtr == INVALID_PTR) {
+        inode->singleIndPtr = alloc_block(true);
+        if (inode->singleIndPtr == INVALID_PTR) {
+            return -1;
+        }
+    }
+
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int i;
+    int ret = -1;
+    if (read_block(inode->singleIndPtr, buffer) == 0) {
+        for (i = 0; i < fs->ptrs_per_block; ++i) {
+            if ((int)get_dword(buffer + i * PTR_SIZE) == INVALID_PTR) {
+                ret = set_ind(inode->singleIndPtr, i, block_number);
+                free(buffer);
+                return ret;
+            }
+        }
+    }
+
+    if (inode->doubleIndPtr == INVALID_PTR) {
+        inode->doubleIndPtr = alloc_block(true);
+        if (inode->doubleIndPtr == INVALID_PTR) {
+            free(buffer);
+            return -1;
+        }
+    }
+
+    // only the last single indirection block of the double one can have room
+    if (read_block(inode->doubleIndPtr, buffer) == 0) {
+        for (i = 0; i < fs->ptrs_per_block; ++i) {
+            if ((int)get_dword(buffer + i * PTR_SIZE) == INVALID_PTR) {
+                break;
+            }
+        }
+
+        int ind;
+        int j;
+        if (i > 0) {
+            ind = get_dword(buffer + (i - 1) * PTR_SIZE);
+            if (read_block(ind, buffer) == 0) {
+                for (j = 0; j < fs->ptrs_per_block; ++j) {
+                    if ((int)get_dword(buffer + j * PTR_SIZE) == INVALID_PTR) {
+                        ret = set_ind(ind, j, block_number);
+                        free(buffer);
+                        return ret;
+                    }
+                }
+            }
+        }
+
+        if (i < fs->ptrs_per_block) {
+            ind = alloc_block(true);
+            if (ind != INVALID_PTR &&
+                set_ind(inode->doubleIndPtr, i, ind) == 0) {
+                ret = set_ind(ind, 0, block_number);
+            }
+        }
+    }
+
+    free(buffer);
+    return ret;
+}
+
+unsigned int get_dword(unsigned char *buffer) {
+    return buffer[0]
+           | buffer[1] << 8
+           | buffer[2] << 16
+           | (unsigned int)buffer[3] << 24;
+}
+
+void set_dword(unsigned char *buffer, unsigned int value) {
+    buffer[0] = value & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+    buffer[2] = (value >> 16) & 0xFF;
+    buffer[3] = (value >> 24) & 0xFF;
+}
+
+unsigned int name_hash(char *name) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    int i;
+    for (i = 0; i < 32 && name[i] != 0; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool is_htree_node(unsigned char *node) {
+    return node[0] == TYPEVAL_INVALIDO && node[1] == 0xFF &&
+           memcmp(node + 2, HTREE_MAGIC, 4) == 0;
+}
+
+/* Header: [0] invalid type, [1] 0xFF, [2..5] magic, [6] levels below, [8..11] count */
+unsigned char *htree_entry(unsigned char *node, int i) {
+    return node + (1 + i / HTREE_PER_SLOT) * RECORD_SIZE
+           + 4 + (i % HTREE_PER_SLOT) * HTREE_ENTRY_SIZE;
+}
+
+void htree_init_node(unsigned char *node, int levels) {
+    memset(node, 0, fs->block_bytes);
+    node[1] = 0xFF;
+    memcpy(node + 2, HTREE_MAGIC, 4);
+    node[6] = levels;
+}
+
+void htree_insert_entry(unsigned char *node, int i, unsigned int hash, int block_number) {
+    int count = get_dword(node + 8);
+    int j;
+    for (j = count; j > i; --j) {
+        memcpy(htree_entry(node, j), htree_entry(node, j - 1), HTREE_ENTRY_SIZE);
+    }
+    set_dword(htree_entry(node, i), hash);
+    set_dword(htree_entry(node, i) + 4, block_number);
+    set_dword(node + 8, count + 1);
+}
+
+/* Entry covering "hash": the last one whose hash is not greater. Entry 0 has hash 0 */
+int htree_search(unsigned char *node, unsigned int hash) {
+    int low = 0;
+    int high = get_dword(node + 8) - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (get_dword(htree_entry(node, mid)) <= hash) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/* Walks from the root (dataPtr[0]) to the leaf for "hash": path[0..n-1] are
+   index nodes, index[] the entries taken and path[n] the leaf. Returns n,
+   or -1 if the directory is not indexed */
+int htree_walk(inode_t *inode, unsigned int hash, int *path, int *index, unsigned char *buffer) {
+    int block_number = inode->dataPtr[0];
+    int level;
+    for (level = 0; level <= HTREE_MAX_LEVELS; ++level) {
+        if (read_block(block_number, buffer) != 0 || !is_htree_node(buffer) ||
+            get_dword(buffer + 8) == 0) {
+            return -1;
+        }
+
+        path[level] = block_number;
+        index[level] = htree_search(buffer, hash);
+        block_number = get_dword(htree_entry(buffer, index[level]) + 4);
+        if (buffer[6] == 0) {
+            path[level + 1] = block_number;
+            return level + 1;
+        }
+    }
+
+    return -1;
+}
+
+/* Adds (hash, block) after the entry taken at path[level], splitting full nodes upwards */
+int htree_add(inode_t *inode, int *path, int *index, int level, unsigned int hash, int block_number) {
+    unsigned char *node = (unsigned char*)malloc(fs->block_bytes);
+    if (read_block(path[level], node) != 0) {
+        free(node);
+        return -1;
+    }
+
+    int count = get_dword(node + 8);
+    if (count < fs->htree_capacity) {
+        htree_insert_entry(node, index[level] + 1, hash, block_number);
+        int ret = write_block(path[level], node);
+        free(node);
+        return ret;
+    }
+
+    if (level == 0 && node[6] >= HTREE_MAX_LEVELS - 1) {
+        printf("directory index is full\n");
+        free(node);
+        return -1;
+    }
+
+    int ret = -1;
+    int sibling = alloc_block(false);
+    if (sibling == INVALID_PTR || append_dir_block(inode, sibling) != 0) {
+        free(node);
+        return -1;
+    }
+
+    unsigned char *other = (unsigned char*)malloc(fs->block_bytes);
+    if (level == 0) {
+        // the root stays in dataPtr[0]: its entries move one level down
+        if (write_block(sibling, node) == 0) {
+            htree_init_node(other, node[6] + 1);
+            htree_insert_entry(other, 0, 0, sibling);
+            if (write_block(path[0], other) == 0) {
+                int new_path[2] = {path[0], sibling};
+                int new_index[2] = {0, index[0]};
+                ret = htree_add(inode, new_path, new_index, 1, hash, block_number);
+            }
+        }
+        free(other);
+        free(node);
+        return ret;
+    }
+
+    // move the upper half of the entries to the sibling
+    int half = count / 2;
+    int i;
+    unsigned int split_hash = get_dword(htree_entry(node, half));
+    htree_init_node(other, node[6]);
+    for (i = half; i < count; ++i) {
+        memcpy(htree_entry(other, i - half), htree_entry(node, i), HTREE_ENTRY_SIZE);
+    }
+    set_dword(other + 8, count - half);
+    set_dword(node + 8, half);
+
+    if (index[level] + 1 <= half) {
+        htree_insert_entry(node, index[level] + 1, hash, block_number);
+    } else {
+        htree_insert_entry(other, index[level] + 1 - half, hash, block_number);
+    }
+
+    if (write_block(path[level], node) == 0 && write_block(sibling, other) == 0) {
+        ret = htree_add(inode, path, index, level - 1, split_hash, sibling);
+    }
+
+    free(other);
+    free(node);
+    return ret;
+}
+
+struct hashed_slot {
+    unsigned int hash;
+    int slot;
+};
+
+int compare_hashed_slots(const void *a, const void *b) {
+    const struct hashed_slot *x = (const struct hashed_slot*)a;
+    const struct hashed_slot *y = (const struct hashed_slot*)b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->slot - y->slot;
+}
+
+/* Inserts a new record in an indexed directory. A full leaf is split at a
+   hash boundary, so names with the same hash always share a leaf. Inline
+   slots move with their record */
+int htree_insert(inode_t *inode, record_t *file, unsigned char *data) {
+    int path[HTREE_MAX_LEVELS + 2];
+    int index[HTREE_MAX_LEVELS + 1];
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+
+    int n = htree_walk(inode, name_hash(file->name), path, index, buffer);
+    if (n <= 0 || read_block(path[n], buffer) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    int ret = place_record(path[n], buffer, file, data);
+    if (ret <= 0) {
+        free(buffer);
+        return ret;
+    }
+
+    struct hashed_slot *slots = (struct hashed_slot*)malloc(fs->records_per_block * sizeof(struct hashed_slot));
+    record_t record;
+    int count = 0;
+    int i;
+    for (i = 0; i < fs->records_per_block; ++i) {
+        if (buffer[i * RECORD_SIZE] == TYPEVAL_INVALIDO) {
+            continue;
+        }
+        decode_record(buffer + i * RECORD_SIZE, &record);
+        slots[count].hash = name_hash(record.name);
+        slots[count].slot = i;
+        ++count;
+    }
+    qsort(slots, count, sizeof(struct hashed_slot), compare_hashed_slots);
+
+    int half = count / 2;
+    while (half > 0 && half < count && slots[half].hash == slots[half - 1].hash) {
+        ++half;
+    }
+    if (half == count) {
+        for (half = count / 2; half > 0 && slots[half].hash == slots[half - 1].hash; --half);
+    }
+
+    int leaf = half == 0 ? INVALID_PTR : alloc_block(false);
+    if (leaf == INVALID_PTR || append_dir_block(inode, leaf) != 0) {
+        printf("cannot split directory block %d\n", path[n]);
+        free(slots);
+        free(buffer);
+        return -1;
+    }
+
+    unsigned char *other = (unsigned char*)malloc(fs->block_bytes);
+    memset(other, TYPEVAL_INVALIDO, fs->block_bytes);
+    int used = 0;
+    int run;
+    for (i = half; i < count; ++i) {
+        run = 1 + slot_run(buffer, slots[i].slot);
+        memcpy(other + used * RECORD_SIZE, buffer + slots[i].slot * RECORD_SIZE, run * RECORD_SIZE);
+        used += run;
+    }
+    for (i = half; i < count; ++i) {
+        clear_slots(buffer, slots[i].slot);
+    }
+    compact_block(buffer);
+
+    ret = -1;
+    if (write_block(path[n], buffer) == 0 && write_block(leaf, other) == 0 &&
+        htree_add(inode, path, index, n - 1, slots[half].hash, leaf) == 0) {
+        ret = htree_insert(inode, file, data);
+    }
+
+    free(other);
+    free(slots);
+    free(buffer);
+    return ret;
+}
+
+/* Turns a one-block directory into an index root pointing to a copy of that block */
+int htree_convert(inode_t *inode) {
+    int leaf = alloc_block(false);
+    if (leaf == INVALID_PTR) {
+        return -1;
+    }
+
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int ret = -1;
+    if (read_block(inode->dataPtr[0], buffer) == 0 &&
+        write_block(leaf, buffer) == 0 &&
+        append_dir_block(inode, leaf) == 0) {
+        htree_init_node(buffer, 0);
+        htree_insert_entry(buffer, 0, 0, leaf);
+        ret = write_block(inode->dataPtr[0], buffer);
+    }
+
+    free(buffer);
+    return ret;
+}
+
+int identify2(char *name, int size) {
+    const char *names = "Leonardo Abreu Nahra: 242256\n" \
+                        "Pedro Frederico Kampmann: 242244\n";
+    strncpy(name, names, size);
+    return 0;
+}
+
+FILE2 create2(char *filename) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    FILE2 handle = create_file(filename);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return handle;
+}
+
+FILE2 create_file(char *filename) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    if (filename[0] != '/') {
+        printf("not an absolute path\n");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->files[i].file == 0) {
+            break;
+        }
+    }
+    if (i == MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    int inode_number = searchBitmap(BITMAP_INODE, 0);
+    if (inode_number < 0) {
+        return -1;
+    }
     printf("inode %d is free\n", inode_number);
 
     record_t *dir = (record_t*)malloc(RECORD_SIZE);
     record_t *file = (record_t*)malloc(RECORD_SIZE);
-    if (load_file(filename, dir, file) == 0) {
+    if (load_file(filename, dir, file, 0) == 0) {
         printf("file %s already exists\n", filename);
         free(dir);
         free(file);
@@ -667,6 +2447,7 @@ FILE2 create2(char *filename) {
     file->blocksFileSize = 0;
     file->bytesFileSize = 0;
     file->inodeNumber = inode_number;
+    file->compression = COMPRESSION_NONE;
 
     inode_t inode;
     inode.dataPtr[0] = INVALID_PTR;
@@ -682,55 +2463,79 @@ FILE2 create2(char *filename) {
     }
 
     printf("saving file %s in %s\n", file->name, dir->name);
-    if (save_file(file, dir) != 0) {
+    if (save_file(file, dir, 0) != 0) {
         free(dir);
         free(file);
         return -1;
     }
 
-    if (setBitmap2(BITMAP_INODE, inode_number, 1) != 0) {
+    if (setBitmap(BITMAP_INODE, inode_number, 1) != 0) {
         free(dir);
         free(file);
         return -1;
     }
 
-    files[i].dir = dir;
-    files[i].file = file;
-    files[i].p = 0;
+    fs->files[i].dir = dir;
+    fs->files[i].file = file;
+    fs->files[i].p = 0;
+    fs->files[i].data = fs->inline_max > 0 ? (unsigned char*)malloc(fs->inline_max) : 0;
+    fs->files[i].unit = 0;
+    fs->files[i].unit_number = -1;
 
     return i;
 }
 
 int delete2(char *filename) {
-    if (!t2fs_init) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = delete_file(filename);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int delete_file(char *filename) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
     record_t dir;
     record_t file;
-    if (load_file(filename, &dir, &file) != 0) {
+    if (load_file(filename, &dir, &file, 0) != 0) {
         printf("file %s doesn't exist\n", filename);
         return -1;
     }
 
+    // unlinked first: a crash in between leaks the i-node instead of
+    // leaving a record that points to freed blocks
     file.TypeVal = TYPEVAL_INVALIDO;
-    free_inode(file.inodeNumber);
-
-    if (save_file(&file, &dir) != 0) {
+    if (save_file(&file, &dir, 0) != 0) {
         return -1;
     }
 
-    return 0;
+    // a handle left open would save the record back when closed
+    int inode_number = file.inodeNumber;
+    block_list_t unlinked = {&inode_number, 1, 1};
+    drop_handles(&unlinked);
+
+    return release_inode(file.inodeNumber);
 }
 
 FILE2 open2(char *filename) {
-    if (!t2fs_init) {
+    pthread_mutex_lock(&fs->op_lock);
+    FILE2 ret = open_file(filename);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+FILE2 open_file(char *filename) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
     int i;
     for (i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (files[i].file == 0) {
+        if (fs->files[i].file == 0) {
             break;
         }
     }
@@ -738,15 +2543,21 @@ FILE2 open2(char *filename) {
         return -1;
     }
 
+    // an inline file is read along with its record, no other I/O needed
     record_t *dir = (record_t*)malloc(RECORD_SIZE);
     record_t *file = (record_t*)malloc(RECORD_SIZE);
-    if (load_file(filename, dir, file) == 0 &&
+    unsigned char *data = fs->inline_max > 0 ? (unsigned char*)malloc(fs->inline_max) : 0;
+    if (load_file(filename, dir, file, data) == 0 &&
         file->TypeVal == TYPEVAL_REGULAR) {
-        files[i].dir = dir;
-        files[i].file = file;
-        files[i].p = 0;
+        fs->files[i].dir = dir;
+        fs->files[i].file = file;
+        fs->files[i].p = 0;
+        fs->files[i].data = data;
+        fs->files[i].unit = 0;
+        fs->files[i].unit_number = -1;
         return i;
     } else {
+        free(data);
         free(file);
         free(dir);
         return -1;
@@ -754,366 +2565,2762 @@ FILE2 open2(char *filename) {
 }
 
 int close2(FILE2 handle) {
-    if (!t2fs_init) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = close_file(handle);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int close_file(FILE2 handle) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
-    record_t *file = files[handle].file;
-    record_t *dir = files[handle].dir;
+    record_t *file = fs->files[handle].file;
+    record_t *dir = fs->files[handle].dir;
 
     if (file == 0) {
         printf("no file opened with handle %d\n", handle);
         return -1;
     }
 
-    if (save_file(file, dir) != 0) {
+    if (save_file(file, dir, fs->files[handle].data) != 0) {
         return -1;
     }
 
+    free(fs->files[handle].data);
+    free(fs->files[handle].unit);
     free(file);
     free(dir);
-    file = 0;
-    dir = 0;
+    fs->files[handle].file = 0;
+    fs->files[handle].dir = 0;
+    fs->files[handle].data = 0;
+    fs->files[handle].unit = 0;
 
     return 0;
 }
 
-int get_n_block(inode_t *inode, int n, int block_number) {
+void split_ind(int n, int *high, int *low) {
+    if (fs->ptrs_shift >= 0) {
+        *high = n >> fs->ptrs_shift;
+        *low = n & (fs->ptrs_per_block - 1);
+    } else {
+        *high = n / fs->ptrs_per_block;
+        *low = n % fs->ptrs_per_block;
+    }
+}
+
+int get_n_block(inode_t *inode, int n, int *block_number) {
     if ( n < 0) {
        return -1;
     }
-    printf("get_n_block\n");
     if (n < 2) {
        if (inode->dataPtr[n] == INVALID_PTR) {
           return -1;
        }
-       block_number = inode->dataPtr[n];
+       *block_number = inode->dataPtr[n];
        return 0;
     }
-    if (n < 1026) {
+
+    n -= 2;
+    if (n < fs->ptrs_per_block) {
        if (inode->singleIndPtr == INVALID_PTR) {
           return -1;
        }
-       block_number = get_ind(inode->singleIndPtr, n-2);
+       *block_number = get_ind(inode->singleIndPtr, n);
        return 0;
     }
-    if (inode->doubleIndPtr == INVALID_PTR) {
+
+    n -= fs->ptrs_per_block;
+    int d_index;
+    int dd_index;
+    split_ind(n, &d_index, &dd_index);
+    if (inode->doubleIndPtr == INVALID_PTR || d_index >= fs->ptrs_per_block) {
        return -1;
     }
-    
-    int d_index = (n-2 / 1024) -1;
-    int p_d = get_ind(inode->doubleIndPtr, d_index);
 
+    int p_d = get_ind(inode->doubleIndPtr, d_index);
     if (p_d == INVALID_PTR) {
        return -1;
     }
 
-    int dd_index = (n-1026) - (d_index*1024);
-    block_number = get_ind(p_d, dd_index);
+    *block_number = get_ind(p_d, dd_index);
     return 0;
 }
 
-int read_from_sector( int sector_number, char *buffer, int n) { //read n bytes from sector
-    int read = 0;
-    unsigned char sector[SECTOR_SIZE];
+int read_block(int block_number, unsigned char *buffer) {
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize;
+    return journalReadSectors(sector_number, fs->superblock->blockSize, buffer);
+}
 
-    if (read_sector(sector_number, sector) != 0) {
-        return -1;
-    }
+int write_block(int block_number, unsigned char *buffer) {
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize;
     int i;
-    for (i=0; i< SECTOR_SIZE; ++i) {
-    	if (read >= n) {
-    		break;
-    	}
-    	buffer[read] = sector[i];
-    	read++;
+    for (i = 0; i < fs->superblock->blockSize; ++i) {
+        if (journalWrite(sector_number + i, buffer + i * SECTOR_SIZE) != 0) {
+            return -1;
+        }
     }
-    return read; //returns either n or SECTOR_SIZE bytes
+    return 0;
 }
 
-int read_from_block( int block_number, char *buffer, int n) { //read n bytes from block
-	int read = 0;
-	int counter;
-    unsigned int sector_number = block_area
-                                + block_number * superblock->blockSize;
-    int i = 0;
-    while (read < n && i < superblock->blockSize) {
-    	counter = read_from_sector(sector_number+i, buffer+read, n);
-    	if(counter < 0) {
-    		return -1;
-    	}
-    	read += counter;
-    	i++;
-    	n -= read;
+int alloc_data_block() {
+    int block_number = searchBitmap(BITMAP_DADOS, 0);
+    if (block_number <= 0) {
+        printf("no free blocks\n");
+        return INVALID_PTR;
     }
-    return read; //returns either n bytes or blockSize*SECTOR_SIZE (full block) bytes
+
+    if (setBitmap(BITMAP_DADOS, block_number, 1) != 0) {
+        return INVALID_PTR;
+    }
+    return block_number;
 }
 
-int read2(FILE2 handle, char *buffer, int size) {
-    if (!t2fs_init) {
-        initialize();
+/* Takes a free block and clears it: directory blocks get invalid records,
+   indirection blocks get INVALID_PTR in every entry */
+int alloc_block(bool ind) {
+    int block_number = alloc_data_block();
+    if (block_number == INVALID_PTR) {
+        return INVALID_PTR;
     }
 
-    record_t *file = files[handle].file;
-    unsigned int offset = files[handle].p;
-    if (file == 0) {
-        printf("no file opened with handle %d\n", handle);
-        return -1;
+    unsigned char sector[SECTOR_SIZE];
+    memset(sector, ind ? 0xFF : TYPEVAL_INVALIDO, SECTOR_SIZE);
+    unsigned int sector_number = fs->block_area
+                                 + block_number * fs->superblock->blockSize;
+    int i;
+    for (i = 0; i < fs->superblock->blockSize; ++i) {
+        if (journalWrite(sector_number + i, sector) != 0) {
+            setBitmap(BITMAP_DADOS, block_number, 0);
+            return INVALID_PTR;
+        }
     }
 
-    if (offset + (unsigned int) size >= file->bytesFileSize) {
+    return block_number;
+}
 
-       printf("cannot read %d bytes from the file\n", size);
-       return -1;
+/* Tells whether block n of a file, or an indirection block on the way to
+   it, is shared with a clone; writing to it must then go to a copy */
+bool is_shared(inode_t *inode, int n, int block_number) {
+    if (!(fs->superblock->features & T2FS_FEATURE_REFLINK)) {
+        return false;
     }
-
-    inode_t inode;
-    if (get_inode(file->inodeNumber, &inode) != 0) {
-       printf("error opening the file's inode\n");
-       return -1;
+    if (getRefcount(block_number) != 0) {
+        return true;
+    }
+    if (n < 2) {
+        return false;
     }
 
-    int index = (offset / superblock->blockSize*SECTOR_SIZE);
-    if (index > 0) {
-    	index-=1;
+    n -= 2;
+    if (n < fs->ptrs_per_block) {
+        return getRefcount(inode->singleIndPtr) != 0;
     }
-    int i = 0;
-    int counter = 0;
-    int read=0;
-    int block_number = 0;
-
-    while (read < size){
-    	if (get_n_block(&inode, index+i, block_number) != 0) {
-           return -1;
-    	}
-    	counter = read_from_block(block_number, buffer+read, size);
-    	if (counter < 0) {
-    		return -1;
-    	}
-    	read += counter;
-    	i++;
-	}
- 
- 	seek2(handle, offset+read);
-    return read-size;
+    if (getRefcount(inode->doubleIndPtr) != 0) {
+        return true;
+    }
+    int d_index;
+    int dd_index;
+    split_ind(n - fs->ptrs_per_block, &d_index, &dd_index);
+    return getRefcount(get_ind(inode->doubleIndPtr, d_index)) != 0;
 }
 
-int write2(FILE2 handle, char *buffer, int size) {
-    if (!t2fs_init) {
-        initialize();
+/* Replaces a shared indirection block, mapping "levels" deep, by a copy
+   of its own before it is changed. Whatever the block maps gets one more
+   reference, from the copy */
+int own_block(int *block_number, int levels) {
+    int refs = getRefcount(*block_number);
+    if (refs <= 0) {
+        return refs;
     }
 
-    record_t *file = files[handle].file;
+    int copy = alloc_data_block();
+    if (copy == INVALID_PTR) {
+        return -1;
+    }
+
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int *ptrs = (int*)malloc(fs->ptrs_per_block * sizeof(int));
+    int ret = read_block(*block_number, buffer);
+    int i;
+    for (i = 0; i < fs->ptrs_per_block; ++i) {
+        ptrs[i] = (int)get_dword(buffer + i * PTR_SIZE);
+    }
+    if (ret == 0) {
+        ret = shareBlocks(ptrs, fs->ptrs_per_block);
+    }
+    if (ret == 0) {
+        ret = write_block(copy, buffer);
+    }
+    free(ptrs);
+    free(buffer);
+    if (ret != 0) {
+        setBitmap(BITMAP_DADOS, copy, 0);
+        return -1;
+    }
+
+    // the original is freed here if its other owners went away meanwhile
+    block_list_t list = {0};
+    if (drop_ind(*block_number, levels, &list, false) < 0) {
+        ret = -1;
+    }
+    free_blocks(&list);
+    free(list.blocks);
+
+    *block_number = copy;
+    return ret;
+}
+
+/* Block number n of a file, allocating it and the indirection blocks on
+   the way if it is not mapped yet. "fresh" tells a new block, whose
+   contents are garbage. A block shared with a clone is replaced by a new
+   one too, along with the shared indirection blocks above it; "copy" then
+   gives the old block, whose contents are still to be copied, and is
+   INVALID_PTR otherwise */
+int map_block(inode_t *inode, int n, int *block_number, bool *fresh, int *copy) {
+    *fresh = false;
+    *copy = INVALID_PTR;
+    if (get_n_block(inode, n, block_number) == 0 && *block_number != INVALID_PTR) {
+        if (!is_shared(inode, n, *block_number)) {
+            return 0;
+        }
+        *copy = *block_number;
+    }
+
+    int block = alloc_data_block();
+    if (block == INVALID_PTR) {
+        return -1;
+    }
+    *block_number = block;
+    *fresh = *copy == INVALID_PTR;
+
+    int ret = -1;
+    if (n < 2) {
+        inode->dataPtr[n] = block;
+        ret = 0;
+    } else if (n - 2 < fs->ptrs_per_block) {
+        if (inode->singleIndPtr == INVALID_PTR) {
+            inode->singleIndPtr = alloc_block(true);
+        }
+        if (inode->singleIndPtr != INVALID_PTR &&
+            own_block(&inode->singleIndPtr, 1) == 0) {
+            ret = set_ind(inode->singleIndPtr, n - 2, block);
+        }
+    } else {
+        int d_index;
+        int dd_index;
+        split_ind(n - 2 - fs->ptrs_per_block, &d_index, &dd_index);
+        if (d_index < fs->ptrs_per_block) {
+            if (inode->doubleIndPtr == INVALID_PTR) {
+                inode->doubleIndPtr = alloc_block(true);
+            }
+            if (inode->doubleIndPtr != INVALID_PTR &&
+                own_block(&inode->doubleIndPtr, 2) == 0) {
+                int ind = get_ind(inode->doubleIndPtr, d_index);
+                int owned = ind;
+                if (ind == INVALID_PTR) {
+                    owned = alloc_block(true);
+                } else if (own_block(&owned, 1) != 0) {
+                    owned = INVALID_PTR;
+                }
+                if (owned != ind && owned != INVALID_PTR &&
+                    set_ind(inode->doubleIndPtr, d_index, owned) != 0) {
+                    owned = INVALID_PTR;
+                }
+                if (owned != INVALID_PTR) {
+                    ret = set_ind(owned, dd_index, block);
+                }
+            }
+        } else {
+            printf("file is too big\n");
+        }
+    }
+
+    if (ret != 0) {
+        setBitmap(BITMAP_DADOS, block, 0);
+        return ret;
+    }
+
+    // the old block loses the reference the file had
+    if (*copy != INVALID_PTR) {
+        block_list_t list = {0};
+        ret = drop_block(*copy, &list);
+        free_blocks(&list);
+        free(list.blocks);
+    }
+    return ret;
+}
+
+/* On a failed read, run->done moves past the sectors that were still read
+   whole and match their sums */
+int read_run(run_t *run) {
+    int good = run->count > 0 ? checkedReadSectors(run->sector, run->count, run->data) : 0;
+    int ret = good == run->count ? 0 : -1;
+    if (ret != 0 && good > 0) {
+        run->done += good * SECTOR_SIZE;
+    }
+    run->count = 0;
+    return ret;
+}
+
+int write_run(run_t *run) {
+    int ret = run->count > 0 ? checkedWriteSectors(run->sector, run->count, run->data) : 0;
+    run->count = 0;
+    return ret;
+}
+
+/* Copies file bytes to buffer; whole sectors are read straight into it, a
+   run of them at a time. Holes read as zeros */
+int read_data(inode_t *inode, QWORD offset, char *buffer, int size) {
+    unsigned char sector[SECTOR_SIZE];
+    run_t run = {0, 0, 0, 0};
+    int done = 0;
+    while (done < size) {
+        int n = (offset + done) / fs->block_bytes;
+        int begin = (offset + done) % fs->block_bytes;
+        int count = fs->block_bytes - begin;
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        int block_number;
+        if (get_n_block(inode, n, &block_number) != 0 || block_number == INVALID_PTR) {
+            memset(buffer + done, 0, count);
+            done += count;
+            continue;
+        }
+
+        unsigned int sector_number = fs->block_area
+                                     + block_number * fs->superblock->blockSize
+                                     + begin / SECTOR_SIZE;
+        int end = done + count;
+        while (done < end) {
+            int in = (offset + done) % SECTOR_SIZE;
+            int chunk = SECTOR_SIZE - in;
+            if (chunk > end - done) {
+                chunk = end - done;
+            }
+            if (chunk == SECTOR_SIZE) {
+                // the run grows while the sectors follow it on disk and in buffer
+                if (run.count > 0 && (run.sector + run.count != sector_number ||
+                                      run.done + run.count * SECTOR_SIZE != done) &&
+                    read_run(&run) != 0) {
+                    return run.done;
+                }
+                if (run.count == 0) {
+                    run.sector = sector_number;
+                    run.done = done;
+                    run.data = (unsigned char*)buffer + done;
+                }
+                ++run.count;
+            } else {
+                if (checkedRead(sector_number, sector) != 0) {
+                    return read_run(&run) == 0 ? done : run.done;
+                }
+                memcpy(buffer + done, sector + in, chunk);
+            }
+            ++sector_number;
+            done += chunk;
+        }
+    }
+
+    return read_run(&run) == 0 ? done : run.done;
+}
+
+/* Copies buffer to the file, mapping blocks as needed. Partly written
+   sectors are read first, except in fresh blocks, which are zeroed. The
+   sectors of blocks that follow each other on disk go out in one request */
+int write_data(record_t *file, inode_t *inode, QWORD offset, char *buffer, int size) {
+    if (file->compression != COMPRESSION_NONE) {
+        return write_units(file, inode, offset, buffer, size);
+    }
+
+    int run_sectors = RUN_SECTORS > fs->superblock->blockSize ? RUN_SECTORS : fs->superblock->blockSize;
+    unsigned char *block = (unsigned char*)malloc(fs->block_bytes);
+    run_t run = {0, 0, 0, (unsigned char*)malloc(run_sectors * SECTOR_SIZE)};
+    int done = 0;
+    while (done < size) {
+        int n = (offset + done) / fs->block_bytes;
+        int begin = (offset + done) % fs->block_bytes;
+        int count = fs->block_bytes - begin;
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        int block_number;
+        bool fresh;
+        int copy;
+        if (map_block(inode, n, &block_number, &fresh, &copy) != 0) {
+            break;
+        }
+
+        unsigned int sector_number = fs->block_area
+                                     + block_number * fs->superblock->blockSize;
+        int first = begin / SECTOR_SIZE;
+        int last = (begin + count - 1) / SECTOR_SIZE;
+        if (fresh) {
+            file->blocksFileSize++;
+            memset(block, 0, fs->block_bytes);
+            first = 0;
+            last = fs->superblock->blockSize - 1;
+        } else if (copy != INVALID_PTR) {
+            // the whole block is written, with the clone's bytes around ours
+            unsigned int copy_sector = fs->block_area + copy * fs->superblock->blockSize;
+            int i;
+            for (i = 0; i < fs->superblock->blockSize; ++i) {
+                if ((i < first || i > last || (i == first && begin % SECTOR_SIZE != 0) ||
+                     (i == last && (begin + count) % SECTOR_SIZE != 0)) &&
+                    checkedRead(copy_sector + i, block + i * SECTOR_SIZE) != 0) {
+                    break;
+                }
+            }
+            if (i < fs->superblock->blockSize) {
+                break;
+            }
+            first = 0;
+            last = fs->superblock->blockSize - 1;
+        } else {
+            if (begin % SECTOR_SIZE != 0 &&
+                checkedRead(sector_number + first, block + first * SECTOR_SIZE) != 0) {
+                break;
+            }
+            if ((begin + count) % SECTOR_SIZE != 0 &&
+                (last != first || begin % SECTOR_SIZE == 0) &&
+                checkedRead(sector_number + last, block + last * SECTOR_SIZE) != 0) {
+                break;
+            }
+        }
+
+        memcpy(block + begin, buffer + done, count);
+        int sectors = last - first + 1;
+        if (run.count > 0 && (run.sector + run.count != sector_number + first ||
+                              run.count + sectors > run_sectors) &&
+            write_run(&run) != 0) {
+            done = run.done;
+            break;
+        }
+        if (run.count == 0) {
+            run.sector = sector_number + first;
+            run.done = done;
+        }
+        memcpy(run.data + run.count * SECTOR_SIZE, block + first * SECTOR_SIZE, sectors * SECTOR_SIZE);
+        run.count += sectors;
+        done += count;
+    }
+    if (write_run(&run) != 0) {
+        done = run.done;
+    }
+
+    free(block);
+    free(run.data);
+    // the sums are logged after the sectors are written, in the operation's commit
+    return flushChecksums() == 0 ? done : -1;
+}
+
+/* Tells how unit u of a compressed file is stored, and its first block */
+int unit_state(inode_t *inode, int u, int *first) {
+    int last;
+    if (get_n_block(inode, u * UNIT_BLOCKS, first) != 0 || *first == INVALID_PTR) {
+        return UNIT_HOLE;
+    }
+    if (get_n_block(inode, (u + 1) * UNIT_BLOCKS - 1, &last) != 0 || last == INVALID_PTR) {
+        return UNIT_CODED;
+    }
+    return UNIT_RAW;
+}
+
+/* Reads just the sectors holding the code of unit u, and decodes it to
+   out, unit_bytes long */
+int decode_unit(inode_t *inode, int u, int first, unsigned char *code, unsigned char *out) {
+    if (checkedRead(fs->block_area + first * fs->superblock->blockSize, code) != 0) {
+        return -1;
+    }
+    int size = (int)get_dword(code);
+    if (size <= 0 || size > (UNIT_BLOCKS - 1) * fs->block_bytes - UNIT_HEADER) {
+        printf("unit %d has an invalid code\n", u);
+        return -1;
+    }
+
+    int sectors = (UNIT_HEADER + size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int block_number = first;
+    int i;
+    for (i = 1; i < sectors; ++i) {
+        if (i % fs->superblock->blockSize == 0 &&
+            (get_n_block(inode, u * UNIT_BLOCKS + i / fs->superblock->blockSize, &block_number) != 0 ||
+             block_number == INVALID_PTR)) {
+            return -1;
+        }
+        if (checkedRead(fs->block_area + block_number * fs->superblock->blockSize + i % fs->superblock->blockSize,
+                        code + i * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+    }
+
+    if (lzDecompress(code + UNIT_HEADER, size, out, fs->unit_bytes) != fs->unit_bytes) {
+        printf("unit %d has an invalid code\n", u);
+        return -1;
+    }
+    return 0;
+}
+
+/* The contents of unit u, zero past the end of file */
+int load_unit(record_t *file, inode_t *inode, int u, unsigned char *code, unsigned char *out) {
+    QWORD start = (QWORD)u * fs->unit_bytes;
+    int first;
+    int state = start < file->bytesFileSize ? unit_state(inode, u, &first) : UNIT_HOLE;
+    if (state == UNIT_HOLE) {
+        memset(out, 0, fs->unit_bytes);
+    } else if (state == UNIT_RAW) {
+        if (read_data(inode, start, (char*)out, fs->unit_bytes) != fs->unit_bytes) {
+            return -1;
+        }
+    } else if (decode_unit(inode, u, first, code, out) != 0) {
+        return -1;
+    }
+
+    if (file->bytesFileSize > start && file->bytesFileSize - start < (QWORD)fs->unit_bytes) {
+        memset(out + (file->bytesFileSize - start), 0, fs->unit_bytes - (file->bytesFileSize - start));
+    }
+    return 0;
+}
+
+/* Copies bytes of a compressed file to buffer. A unit wanted whole is
+   decoded straight into it; a part of one comes from the handle's copy of
+   the last unit decoded, so small reads do not decode it again */
+int read_units(FILE2 handle, inode_t *inode, QWORD offset, char *buffer, int size) {
+    unsigned char *code = (unsigned char*)malloc((UNIT_BLOCKS - 1) * fs->block_bytes);
+    int done = 0;
+    while (done < size) {
+        int u = (offset + done) / fs->unit_bytes;
+        int begin = (offset + done) % fs->unit_bytes;
+        int count = fs->unit_bytes - begin;
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        if (fs->files[handle].unit_number == u) {
+            memcpy(buffer + done, fs->files[handle].unit + begin, count);
+            done += count;
+            continue;
+        }
+
+        int first;
+        int state = unit_state(inode, u, &first);
+        if (state == UNIT_HOLE) {
+            memset(buffer + done, 0, count);
+        } else if (state == UNIT_RAW) {
+            if (read_data(inode, offset + done, buffer + done, count) != count) {
+                break;
+            }
+        } else if (count == fs->unit_bytes) {
+            if (decode_unit(inode, u, first, code, (unsigned char*)buffer + done) != 0) {
+                break;
+            }
+        } else {
+            if (fs->files[handle].unit == 0) {
+                fs->files[handle].unit = (unsigned char*)malloc(fs->unit_bytes);
+            }
+            fs->files[handle].unit_number = -1;
+            if (decode_unit(inode, u, first, code, fs->files[handle].unit) != 0) {
+                break;
+            }
+            fs->files[handle].unit_number = u;
+            memcpy(buffer + done, fs->files[handle].unit + begin, count);
+        }
+        done += count;
+    }
+
+    free(code);
+    return done;
+}
+
+/* Copies buffer to a compressed file. A unit written whole is coded
+   straight from it; others are decoded first and coded again */
+int write_units(record_t *file, inode_t *inode, QWORD offset, char *buffer, int size) {
+    // decoded copies kept by read2 for this file go stale
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->files[i].file != 0 && fs->files[i].file->inodeNumber == file->inodeNumber) {
+            fs->files[i].unit_number = -1;
+        }
+    }
+
+    unsigned char *code = (unsigned char*)malloc((UNIT_BLOCKS - 1) * fs->block_bytes);
+    unsigned char *unit = (unsigned char*)malloc(fs->unit_bytes);
+    int done = 0;
+    while (done < size) {
+        int u = (offset + done) / fs->unit_bytes;
+        int begin = (offset + done) % fs->unit_bytes;
+        int count = fs->unit_bytes - begin;
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        unsigned char *data = (unsigned char*)buffer + done;
+        if (count < fs->unit_bytes) {
+            if (load_unit(file, inode, u, code, unit) != 0) {
+                break;
+            }
+            memcpy(unit + begin, buffer + done, count);
+            data = unit;
+        }
+        if (store_unit(file, inode, u, data, code) != 0) {
+            break;
+        }
+        done += count;
+    }
+
+    free(unit);
+    free(code);
+    return flushChecksums() == 0 ? done : -1;
+}
+
+/* Writes a whole unit: as a hole if it is all zeros, as code if that
+   saves a block, as is otherwise */
+int store_unit(record_t *file, inode_t *inode, int u, unsigned char *data, unsigned char *code) {
+    int blocks[UNIT_BLOCKS];
+    int i;
+    for (i = 0; i < fs->unit_bytes && data[i] == 0; ++i);
+    if (i == fs->unit_bytes) {
+        return map_unit(file, inode, u, 0, blocks);
+    }
+
+    int sectors = UNIT_BLOCKS * fs->superblock->blockSize;
+    int size = lzCompress(data, fs->unit_bytes, code + UNIT_HEADER,
+                          (UNIT_BLOCKS - 1) * fs->block_bytes - UNIT_HEADER);
+    if (size > 0) {
+        set_dword(code, size);
+        sectors = (UNIT_HEADER + size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        memset(code + UNIT_HEADER + size, 0, sectors * SECTOR_SIZE - UNIT_HEADER - size);
+        data = code;
+    }
+
+    int used = (sectors + fs->superblock->blockSize - 1) / fs->superblock->blockSize;
+    if (map_unit(file, inode, u, used, blocks) != 0) {
+        return -1;
+    }
+    for (i = 0; i < sectors; ++i) {
+        unsigned int sector_number = fs->block_area
+                                     + blocks[i / fs->superblock->blockSize] * fs->superblock->blockSize
+                                     + i % fs->superblock->blockSize;
+        if (checkedWrite(sector_number, data + i * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+    }
+
+    // the sectors past the code keep whatever the block held before
+    int rest = used * fs->superblock->blockSize - sectors;
+    return rest > 0 ? clearChecksums(fs->block_area + blocks[used - 1] * fs->superblock->blockSize
+                                     + fs->superblock->blockSize - rest, rest) : 0;
+}
+
+/* Maps the first "used" blocks of unit u into blocks, and unmaps the rest */
+int map_unit(record_t *file, inode_t *inode, int u, int used, int *blocks) {
+    int i;
+    for (i = 0; i < used; ++i) {
+        bool fresh;
+        int copy;
+        if (map_block(inode, u * UNIT_BLOCKS + i, &blocks[i], &fresh, &copy) != 0) {
+            return -1;
+        }
+        if (fresh) {
+            file->blocksFileSize++;
+        }
+    }
+
+    block_list_t list = {0};
+    int ret = 0;
+    for (; i < UNIT_BLOCKS && ret == 0; ++i) {
+        int unmapped = unmap_block(inode, u * UNIT_BLOCKS + i, &list);
+        if (unmapped < 0) {
+            ret = -1;
+        } else {
+            file->blocksFileSize -= unmapped;
+        }
+    }
+    if (free_blocks(&list) != 0) {
+        ret = -1;
+    }
+    free(list.blocks);
+    return ret;
+}
+
+/* Unmaps block n of a file alone, copying the shared indirection blocks on
+   the way to it. Returns 1 if a block was unmapped, 0 for a hole, or -1 */
+int unmap_block(inode_t *inode, int n, block_list_t *list) {
+    int block_number;
+    if (get_n_block(inode, n, &block_number) != 0 || block_number == INVALID_PTR) {
+        return 0;
+    }
+
+    if (n < 2) {
+        inode->dataPtr[n] = INVALID_PTR;
+    } else if (n - 2 < fs->ptrs_per_block) {
+        if (own_block(&inode->singleIndPtr, 1) != 0 ||
+            set_ind(inode->singleIndPtr, n - 2, INVALID_PTR) != 0) {
+            return -1;
+        }
+    } else {
+        int d_index;
+        int dd_index;
+        split_ind(n - 2 - fs->ptrs_per_block, &d_index, &dd_index);
+        if (own_block(&inode->doubleIndPtr, 2) != 0) {
+            return -1;
+        }
+        int child = get_ind(inode->doubleIndPtr, d_index);
+        int owned = child;
+        if (own_block(&owned, 1) != 0 ||
+            (owned != child && set_ind(inode->doubleIndPtr, d_index, owned) != 0) ||
+            set_ind(owned, dd_index, INVALID_PTR) != 0) {
+            return -1;
+        }
+    }
+
+    return drop_block(block_number, list) == 0 ? 1 : -1;
+}
+
+int read2(FILE2 handle, char *buffer, int size) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = read_file(handle, buffer, size);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int read_file(FILE2 handle, char *buffer, int size) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    QWORD offset = fs->files[handle].p;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+
+    if (size < 0) {
+        return -1;
+    }
+    if (offset >= file->bytesFileSize) {
+        return 0;
+    }
+    if ((QWORD)size > file->bytesFileSize - offset) {
+        size = file->bytesFileSize - offset;
+    }
+
+    if (fs->files[handle].data != 0 && is_inline(file)) {
+        memcpy(buffer, fs->files[handle].data + offset, size);
+        fs->files[handle].p += size;
+        return size;
+    }
+
+    inode_t inode;
+    if (get_inode(file->inodeNumber, &inode) != 0) {
+       printf("error opening the file's inode\n");
+       return -1;
+    }
+
+    int read = file->compression != COMPRESSION_NONE
+               ? read_units(handle, &inode, offset, buffer, size)
+               : read_data(&inode, offset, buffer, size);
+    fs->files[handle].p += read;
+
+    // size stops at the end of file: reading nothing is a sector that
+    // failed, such as one that does not match its checksum
+    if (read == 0 && size > 0) {
+        return -1;
+    }
+    return read;
+}
+
+/* Blocks a long write or preallocation maps between two looks at the
+   journal: PART_SECTORS data sectors, in whole compression units */
+int part_blocks() {
+    int blocks = PART_SECTORS / fs->superblock->blockSize;
+    if (blocks < UNIT_BLOCKS) {
+        blocks = UNIT_BLOCKS;
+    }
+    return blocks - blocks % UNIT_BLOCKS;
+}
+
+int write2(FILE2 handle, char *buffer, int size) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = write_file(handle, buffer, size);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int write_file(FILE2 handle, char *buffer, int size) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    QWORD offset = fs->files[handle].p;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+
+    if (size < 0) {
+        return -1;
+    }
+    if (size > 0 && offset >= fs->max_file_bytes) {
+        printf("file is too big\n");
+        return -1;
+    }
+    if ((QWORD)size > fs->max_file_bytes - offset) {
+        size = fs->max_file_bytes - offset;
+    }
+
+    // small files are kept in memory and saved with their record by close2
+    if (fs->files[handle].data != 0 && file->blocksFileSize == 0 &&
+        file->bytesFileSize <= (unsigned int)fs->inline_max &&
+        offset + size <= (unsigned int)fs->inline_max) {
+        if (offset > file->bytesFileSize) {
+            memset(fs->files[handle].data + file->bytesFileSize, 0, offset - file->bytesFileSize);
+        }
+        memcpy(fs->files[handle].data + offset, buffer, size);
+        fs->files[handle].p += size;
+        if (fs->files[handle].p > file->bytesFileSize) {
+            file->bytesFileSize = fs->files[handle].p;
+        }
+        return size;
+    }
+
+    inode_t inode;
+    if (get_inode(file->inodeNumber, &inode) != 0) {
+       printf("error opening the file's inode\n");
+       return -1;
+    }
+
+    // an inline file that outgrows its record moves to data blocks
+    if (fs->files[handle].data != 0 && is_inline(file) &&
+        write_data(file, &inode, 0, (char*)fs->files[handle].data, file->bytesFileSize)
+            != (int)file->bytesFileSize) {
+        set_inode(file->inodeNumber, &inode);
+        return -1;
+    }
+
+    if (offset > file->bytesFileSize &&
+        clear_range(file, &inode, file->bytesFileSize, offset) != 0) {
+        set_inode(file->inodeNumber, &inode);
+        return -1;
+    }
+
+    // a big write goes in parts; between two of them the operation starts
+    // over once its commit fills half the journal
+    QWORD part_bytes = part_blocks() * (QWORD)fs->block_bytes;
+    int written = 0;
+    while (written < size) {
+        int part = size - written;
+        QWORD part_end = ((offset + written) / part_bytes + 1) * part_bytes;
+        if (offset + written + part > part_end) {
+            part = part_end - (offset + written);
+        }
+
+        int n = write_data(file, &inode, offset + written, buffer + written, part);
+        if (n < 0 && written == 0) {
+            written = -1;
+        }
+        if (n > 0) {
+            written += n;
+        }
+        if (n != part) {
+            break;
+        }
+        if (written < size && journalFull()) {
+            if (set_inode(file->inodeNumber, &inode) != 0) {
+                return -1;
+            }
+            journalStop();
+            journalStart();
+        }
+    }
+    if (set_inode(file->inodeNumber, &inode) != 0) {
+        return -1;
+    }
+
+    // the position may be past the end of file; only bytes written move it
+    if (written > 0) {
+        fs->files[handle].p += written;
+        if (fs->files[handle].p > file->bytesFileSize) {
+            file->bytesFileSize = fs->files[handle].p;
+        }
+    }
+    return written;
+}
+
+/* Unmaps every block from number "keep" on, listing the freed data and
+   indirection blocks. Partly kept indirection blocks are read and written
+   once; wholly freed ones are only read. Blocks shared with a clone lose a
+   reference instead of being listed, and a shared indirection block that
+   is partly kept is copied first. Returns the number of data blocks
+   unmapped, or -1 */
+int unmap_blocks(inode_t *inode, int keep, block_list_t *list) {
+    int unmapped = 0;
+    int ret;
+    int i;
+
+    for (i = keep; i < 2; ++i) {
+        if (inode->dataPtr[i] != INVALID_PTR) {
+            if (drop_block(inode->dataPtr[i], list) != 0) {
+                return -1;
+            }
+            inode->dataPtr[i] = INVALID_PTR;
+            ++unmapped;
+        }
+    }
+
+    keep = keep > 2 ? keep - 2 : 0;
+    if (inode->singleIndPtr != INVALID_PTR && keep < fs->ptrs_per_block) {
+        if (keep == 0) {
+            ret = drop_ind(inode->singleIndPtr, 1, list, true);
+            inode->singleIndPtr = INVALID_PTR;
+        } else if (own_block(&inode->singleIndPtr, 1) == 0) {
+            ret = drop_entries(inode->singleIndPtr, keep, 1, list, true);
+        } else {
+            ret = -1;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        unmapped += ret;
+    }
+
+    keep = keep > fs->ptrs_per_block ? keep - fs->ptrs_per_block : 0;
+    if (inode->doubleIndPtr != INVALID_PTR) {
+        int d_index;
+        int dd_index;
+        split_ind(keep, &d_index, &dd_index);
+        if (keep == 0) {
+            ret = drop_ind(inode->doubleIndPtr, 2, list, true);
+            inode->doubleIndPtr = INVALID_PTR;
+            return ret < 0 ? -1 : unmapped + ret;
+        }
+        if (d_index >= fs->ptrs_per_block) {
+            return unmapped;
+        }
+        if (own_block(&inode->doubleIndPtr, 2) != 0) {
+            return -1;
+        }
+
+        // the child holding the boundary keeps its first entries
+        if (dd_index > 0) {
+            int child = get_ind(inode->doubleIndPtr, d_index);
+            int owned = child;
+            if (child != INVALID_PTR) {
+                if (own_block(&owned, 1) != 0 ||
+                    (owned != child && set_ind(inode->doubleIndPtr, d_index, owned) != 0)) {
+                    return -1;
+                }
+                ret = drop_entries(owned, dd_index, 1, list, true);
+                if (ret < 0) {
+                    return -1;
+                }
+                unmapped += ret;
+            }
+            ++d_index;
+        }
+
+        // every later child goes away whole
+        if (d_index < fs->ptrs_per_block) {
+            ret = drop_entries(inode->doubleIndPtr, d_index, 2, list, true);
+            if (ret < 0) {
+                return -1;
+            }
+            unmapped += ret;
+        }
+    }
+
+    return unmapped;
+}
+
+/* Zeroes the end of the last kept block (unit, in a compressed file), so
+   a later write past the end of the file does not bring old bytes back. A
+   block shared with a clone is copied first, and the i-node saved again */
+int clear_tail(record_t *file, inode_t *inode, QWORD size) {
+    bool compressed = file->compression != COMPRESSION_NONE;
+    int span = compressed ? fs->unit_bytes : fs->block_bytes;
+    int begin = size % span;
+    int block_number;
+    if (begin == 0 || get_n_block(inode, size / span * (span / fs->block_bytes), &block_number) != 0 ||
+        block_number == INVALID_PTR) {
+        return 0;
+    }
+
+    // recoding a unit may map and unmap blocks
+    bool changed = compressed || is_shared(inode, size / fs->block_bytes, block_number);
+    char *zeros = (char*)calloc(span - begin, 1);
+    int ret = write_data(file, inode, size, zeros, span - begin);
+    free(zeros);
+    if (ret != span - begin) {
+        return -1;
+    }
+    return changed ? set_inode(file->inodeNumber, inode) : 0;
+}
+
+int truncate2(FILE2 handle) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = truncate_file(handle);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int truncate_file(FILE2 handle) {
+    if (!fs->t2fs_init) {
+       initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    QWORD size = fs->files[handle].p;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+    if (size == file->bytesFileSize) {
+        return 0;
+    }
+    if (size > fs->max_file_bytes) {
+        printf("file is too big\n");
+        return -1;
+    }
+
+    // growing only moves the end of file: the new range is a hole
+    if (size > file->bytesFileSize) {
+        unsigned char *data = fs->files[handle].data;
+        if (data != 0 && file->blocksFileSize == 0 &&
+            file->bytesFileSize <= (unsigned int)fs->inline_max &&
+            size <= (unsigned int)fs->inline_max) {
+            memset(data + file->bytesFileSize, 0, size - file->bytesFileSize);
+        } else if (data != 0 && is_inline(file)) {
+            if (spill_inline(file, data) != 0) {
+                return -1;
+            }
+        } else if (file->blocksFileSize > 0) {
+            inode_t inode;
+            if (get_inode(file->inodeNumber, &inode) != 0 ||
+                clear_range(file, &inode, file->bytesFileSize, size) != 0) {
+                return -1;
+            }
+        }
+        file->bytesFileSize = size;
+        return save_file(file, fs->files[handle].dir, data);
+    }
+
+    if (!(fs->files[handle].data != 0 && is_inline(file))) {
+        inode_t inode;
+        if (get_inode(file->inodeNumber, &inode) != 0) {
+            return -1;
+        }
+
+        // a compressed file keeps the whole unit holding the new end
+        int keep = file->compression != COMPRESSION_NONE
+                   ? (size + fs->unit_bytes - 1) / fs->unit_bytes * UNIT_BLOCKS
+                   : (size + fs->block_bytes - 1) / fs->block_bytes;
+        block_list_t list = {0};
+        int freed = unmap_blocks(&inode, keep, &list);
+        if (freed < 0 || set_inode(file->inodeNumber, &inode) != 0) {
+            free(list.blocks);
+            return -1;
+        }
+        free_blocks(&list);
+        free(list.blocks);
+
+        file->blocksFileSize = (int)file->blocksFileSize > freed ? file->blocksFileSize - freed : 0;
+        if (clear_tail(file, &inode, size) != 0) {
+            return -1;
+        }
+
+        // a sparse file left without blocks is small enough to become inline
+        if (fs->files[handle].data != 0 && file->blocksFileSize == 0 &&
+            size <= (unsigned int)fs->inline_max) {
+            memset(fs->files[handle].data, 0, size);
+        }
+    }
+
+    // the record is written once, with both sizes
+    file->bytesFileSize = size;
+    return save_file(file, fs->files[handle].dir, fs->files[handle].data);
+}
+
+int seek2(FILE2 handle, QWORD offset) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = seek_file(handle, offset);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int seek_file(FILE2 handle, QWORD offset) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+
+    // -1 places the position right after the last byte; positions past
+    // it are kept, and a write there leaves a hole
+    if (offset == (QWORD)-1) {
+        offset = file->bytesFileSize;
+    }
+
+    fs->files[handle].p = offset;
+    return 0;
+}
+
+/* Returns the first block from n on, below end, that is mapped (or that is a
+   hole, when mapped is false); end if there is none. An unset indirection
+   pointer skips its whole range without reading anything */
+int find_block(inode_t *inode, int n, int end, bool mapped) {
+    unsigned char *dbl = (unsigned char*)malloc(fs->block_bytes);
+    unsigned char *ind = (unsigned char*)malloc(fs->block_bytes);
+    int loaded = INVALID_PTR; // indirection block held in ind
+    bool dbl_loaded = false;
+    int ret = end;
+
+    while (n < end) {
+        int block_number = INVALID_PTR;
+        int next = n + 1;
+        int ptr = INVALID_PTR;
+        int index = 0;
+
+        if (n < 2) {
+            block_number = inode->dataPtr[n];
+        } else if (n - 2 < fs->ptrs_per_block) {
+            ptr = inode->singleIndPtr;
+            index = n - 2;
+            if (ptr == INVALID_PTR) {
+                next = 2 + fs->ptrs_per_block;
+            }
+        } else {
+            int d_index;
+            split_ind(n - 2 - fs->ptrs_per_block, &d_index, &index);
+            if (d_index >= fs->ptrs_per_block) {
+                break;
+            }
+            if (inode->doubleIndPtr == INVALID_PTR) {
+                next = end;
+            } else {
+                if (!dbl_loaded) {
+                    if (read_block(inode->doubleIndPtr, dbl) != 0) {
+                        ret = -1;
+                        break;
+                    }
+                    dbl_loaded = true;
+                }
+                ptr = (int)get_dword(dbl + d_index * PTR_SIZE);
+                if (ptr == INVALID_PTR) {
+                    next = n - index + fs->ptrs_per_block;
+                }
+            }
+        }
+
+        if (ptr != INVALID_PTR) {
+            if (ptr != loaded) {
+                if (read_block(ptr, ind) != 0) {
+                    ret = -1;
+                    break;
+                }
+                loaded = ptr;
+            }
+            block_number = (int)get_dword(ind + index * PTR_SIZE);
+        }
+
+        if ((block_number != INVALID_PTR) == mapped) {
+            ret = n;
+            break;
+        }
+        n = next;
+    }
+
+    free(dbl);
+    free(ind);
+    return ret;
+}
+
+int seek_data2(FILE2 handle, QWORD offset, int whence, QWORD *position) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = seek_data(handle, offset, whence, position);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int seek_data(FILE2 handle, QWORD offset, int whence, QWORD *position) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+    if (whence != SEEK_DATA2 && whence != SEEK_HOLE2) {
+        printf("invalid whence %d\n", whence);
+        return -1;
+    }
+    if (offset >= file->bytesFileSize) {
+        return -1;
+    }
+
+    // an inline file is data from start to end
+    QWORD found;
+    if (is_inline(file)) {
+        found = whence == SEEK_DATA2 ? offset : file->bytesFileSize;
+    } else {
+        inode_t inode;
+        if (get_inode(file->inodeNumber, &inode) != 0) {
+            return -1;
+        }
+
+        // a compressed file is searched by units, whose code may leave
+        // their last blocks unmapped: a hole only starts a unit
+        int span = file->compression != COMPRESSION_NONE ? UNIT_BLOCKS : 1;
+        int end = (file->bytesFileSize + span * fs->block_bytes - 1) / (span * fs->block_bytes) * span;
+        int n = find_block(&inode, offset / fs->block_bytes / span * span, end, whence == SEEK_DATA2);
+        while (whence == SEEK_HOLE2 && n >= 0 && n < end && n % span != 0) {
+            n = find_block(&inode, n - n % span + span, end, false);
+        }
+        if (n < 0 || (whence == SEEK_DATA2 && n == end)) {
+            return -1;
+        }
+
+        // the block holding offset counts from offset on; a hole may only
+        // start at the end of file inside the last block
+        found = (QWORD)n * fs->block_bytes;
+        if (found < offset) {
+            found = offset;
+        }
+        if (found > file->bytesFileSize) {
+            found = file->bytesFileSize;
+        }
+    }
+
+    fs->files[handle].p = found;
+    *position = found;
+    return 0;
+}
+
+/* Zeroes the mapped blocks in from..to. Blocks preallocated past the end of
+   file keep whatever the disk held, so the end of file cannot move over them
+   without this */
+int clear_range(record_t *file, inode_t *inode, QWORD from, QWORD to) {
+    // units are written whole, with zeros past the end of file
+    if (from >= to || file->compression != COMPRESSION_NONE) {
+        return 0;
+    }
+
+    char *zeros = (char*)calloc(fs->block_bytes, 1);
+    int end = (to - 1) / fs->block_bytes + 1;
+    int n = from / fs->block_bytes;
+    int ret = 0;
+    while ((n = find_block(inode, n, end, true)) < end) {
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+
+        QWORD begin = (QWORD)n * fs->block_bytes;
+        QWORD stop = begin + fs->block_bytes;
+        if (begin < from) {
+            begin = from;
+        }
+        if (stop > to) {
+            stop = to;
+        }
+        if (write_data(file, inode, begin, zeros, stop - begin) != (int)(stop - begin)) {
+            ret = -1;
+            break;
+        }
+        ++n;
+    }
+
+    free(zeros);
+    return ret;
+}
+
+int fallocate2(FILE2 handle, QWORD offset, QWORD length) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = fallocate_file(handle, offset, length);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int fallocate_file(FILE2 handle, QWORD offset, QWORD length) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
+    if (file == 0) {
+        printf("no file opened with handle %d\n", handle);
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    if (file->compression != COMPRESSION_NONE) {
+        printf("cannot preallocate a compressed file\n");
+        return -1;
+    }
+
+    if (offset + length < offset || offset + length > fs->max_file_bytes) {
+        printf("file is too big\n");
+        return -1;
+    }
+
+    // a file with blocks is no longer inline
+    if (fs->files[handle].data != 0 && is_inline(file) &&
+        spill_inline(file, fs->files[handle].data) != 0) {
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(file->inodeNumber, &inode) != 0) {
+        return -1;
+    }
+
+    prealloc_t pa;
+    pa.file = file;
+    pa.left = 0;
+    pa.inside = (file->bytesFileSize + fs->block_bytes - 1) / fs->block_bytes;
+    pa.zeros = (unsigned char*)calloc(fs->block_bytes, 1);
+
+    // mapped in parts; between two of them the operation starts over once
+    // its commit fills half the journal, with the blocks mapped so far saved
+    // and the reserved ones given back
+    int end = (offset + length - 1) / fs->block_bytes + 1;
+    int n = offset / fs->block_bytes;
+    int ret = 0;
+    while (ret == 0 && n < end) {
+        pa.end = (n / part_blocks() + 1) * part_blocks();
+        if (pa.end > end) {
+            pa.end = end;
+        }
+        ret = prealloc_blocks(&pa, &inode, n);
+        n = pa.end;
+
+        if (ret == 0 && n < end && journalFull()) {
+            if (pa.left > 0) {
+                setBitmapRange(BITMAP_DADOS, pa.next, pa.left, 0);
+                pa.left = 0;
+            }
+            if (flushChecksums() != 0 || set_inode(file->inodeNumber, &inode) != 0 ||
+                save_file(file, fs->files[handle].dir, fs->files[handle].data) != 0) {
+                ret = -1;
+            }
+            journalStop();
+            journalStart();
+        }
+    }
+
+    // whatever was mapped stays, even when the disk filled up halfway
+    if (pa.left > 0) {
+        setBitmapRange(BITMAP_DADOS, pa.next, pa.left, 0);
+    }
+    free(pa.zeros);
+    if (flushChecksums() != 0) {
+        ret = -1;
+    }
+    if (set_inode(file->inodeNumber, &inode) != 0) {
+        return -1;
+    }
+    if (save_file(file, fs->files[handle].dir, fs->files[handle].data) != 0) {
+        return -1;
+    }
+    return ret;
+}
+
+/* Maps every hole in blocks n..pa->end. Each indirection block is read and
+   written once, with all the pointers it gets; one shared with a clone is
+   copied first */
+int prealloc_blocks(prealloc_t *pa, inode_t *inode, int n) {
+    for (; n < pa->end && n < 2; ++n) {
+        if (inode->dataPtr[n] == INVALID_PTR) {
+            inode->dataPtr[n] = prealloc_take(pa, n);
+            if (inode->dataPtr[n] == INVALID_PTR) {
+                return -1;
+            }
+        }
+    }
+
+    unsigned char *buffer = (unsigned char*)malloc(fs->block_bytes);
+    int ret = 0;
+    if (n < pa->end && n < 2 + fs->ptrs_per_block) {
+        int to = pa->end < 2 + fs->ptrs_per_block ? pa->end : 2 + fs->ptrs_per_block;
+        if (inode->singleIndPtr == INVALID_PTR) {
+            inode->singleIndPtr = alloc_block(true);
+        }
+        if (inode->singleIndPtr == INVALID_PTR ||
+            own_block(&inode->singleIndPtr, 1) != 0 ||
+            prealloc_ind(pa, inode->singleIndPtr, n - 2, to - 2, n, buffer) != 0) {
+            free(buffer);
+            return -1;
+        }
+        n = to;
+    }
+
+    if (n < pa->end) {
+        unsigned char *dbl = (unsigned char*)malloc(fs->block_bytes);
+        bool dirty = false;
+        if (inode->doubleIndPtr == INVALID_PTR) {
+            inode->doubleIndPtr = alloc_block(true);
+            memset(dbl, 0xFF, fs->block_bytes);
+        } else if (own_block(&inode->doubleIndPtr, 2) != 0 ||
+                   read_block(inode->doubleIndPtr, dbl) != 0) {
+            ret = -1;
+        }
+        if (inode->doubleIndPtr == INVALID_PTR) {
+            ret = -1;
+        }
+
+        while (ret == 0 && n < pa->end) {
+            int d_index;
+            int dd_index;
+            split_ind(n - 2 - fs->ptrs_per_block, &d_index, &dd_index);
+            int to = n - dd_index + fs->ptrs_per_block;
+            if (to > pa->end) {
+                to = pa->end;
+            }
+
+            int child = (int)get_dword(dbl + d_index * PTR_SIZE);
+            int owned = child;
+            if (child == INVALID_PTR) {
+                owned = alloc_block(true);
+            } else if (own_block(&owned, 1) != 0) {
+                owned = INVALID_PTR;
+            }
+            if (owned == INVALID_PTR) {
+                ret = -1;
+                break;
+            }
+            if (owned != child) {
+                child = owned;
+                set_dword(dbl + d_index * PTR_SIZE, child);
+                dirty = true;
+            }
+            ret = prealloc_ind(pa, child, dd_index, dd_index + to - n, n, buffer);
+            n = to;
+        }
+
+        if (dirty && write_block(inode->doubleIndPtr, dbl) != 0) {
+            ret = -1;
+        }
+        free(dbl);
+    }
+
+    free(buffer);
+    return ret;
+}
+
+/* Hands out the next block of the reserved run, reserving a new run when it
+   is used up. A block inside the file was a hole, read as zeros */
+int prealloc_take(prealloc_t *pa, int n) {
+    if (pa->left == 0) {
+        int length;
+        int first = searchBitmapRun(BITMAP_DADOS, pa->end - n, &length);
+        if (first <= 0 || setBitmapRange(BITMAP_DADOS, first, length, 1) != 0) {
+            printf("no free blocks\n");
+            return INVALID_PTR;
+        }
+        pa->next = first;
+        pa->left = length;
+    }
+
+    // zeros are file data: written in place, not through the journal. A
+    // block past the end is not written, and the sums of its last owner go
+    int block_number = pa->next;
+    unsigned int sector_number = fs->block_area + block_number * fs->superblock->blockSize;
+    if (n < pa->inside) {
+        int i;
+        for (i = 0; i < fs->superblock->blockSize; ++i) {
+            if (checkedWrite(sector_number + i, pa->zeros) != 0) {
+                return INVALID_PTR;
+            }
+        }
+    } else if (clearChecksums(sector_number, fs->superblock->blockSize) != 0) {
+        return INVALID_PTR;
+    }
+    ++pa->next;
+    --pa->left;
+    pa->file->blocksFileSize++;
+    return block_number;
+}
+
+/* Fills the holes among entries from..to of an indirection block; n is the
+   file block of entry from */
+int prealloc_ind(prealloc_t *pa, int block_number, int from, int to, int n, unsigned char *buffer) {
+    if (read_block(block_number, buffer) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    bool dirty = false;
+    for (; from < to; ++from, ++n) {
+        if ((int)get_dword(buffer + from * PTR_SIZE) != INVALID_PTR) {
+            continue;
+        }
+        int block = prealloc_take(pa, n);
+        if (block == INVALID_PTR) {
+            ret = -1;
+            break;
+        }
+        set_dword(buffer + from * PTR_SIZE, block);
+        dirty = true;
+    }
+
+    if (dirty && write_block(block_number, buffer) != 0) {
+        return -1;
+    }
+    return ret;
+}
+
+int clone2(char *source, char *filename) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = clone_file(source, filename);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+/* The clone is created empty and takes the source's four pointers; each
+   block they name gets one more reference, and nothing below them is read
+   or written */
+int clone_file(char *source, char *filename) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t dir;
+    record_t file;
+    unsigned char *data = fs->inline_max > 0 ? (unsigned char*)malloc(fs->inline_max) : 0;
+    if (load_file(source, &dir, &file, data) != 0 || file.TypeVal != TYPEVAL_REGULAR) {
+        printf("file %s doesn't exist\n", source);
+        free(data);
+        return -1;
+    }
+
+    // an open source may have a size and inline contents not saved yet
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->files[i].file != 0 && fs->files[i].file->inodeNumber == file.inodeNumber) {
+            file = *fs->files[i].file;
+            if (data != 0) {
+                memcpy(data, fs->files[i].data, fs->inline_max);
+            }
+            break;
+        }
+    }
+
+    inode_t inode;
+    if (get_inode(file.inodeNumber, &inode) != 0) {
+        free(data);
+        return -1;
+    }
+    int ptrs[4] = {inode.dataPtr[0], inode.dataPtr[1], inode.singleIndPtr, inode.doubleIndPtr};
+    bool mapped = false;
+    for (i = 0; i < 4; ++i) {
+        mapped = mapped || ptrs[i] != INVALID_PTR;
+    }
+    if (mapped && !(fs->superblock->features & T2FS_FEATURE_REFLINK)) {
+        printf("disk formatted without reflink, cannot clone %s\n", source);
+        free(data);
+        return -1;
+    }
+
+    FILE2 handle = create_file(filename);
+    if (handle < 0) {
+        free(data);
+        return -1;
+    }
+
+    record_t *clone = fs->files[handle].file;
+    int ret = 0;
+    if (mapped) {
+        ret = shareBlocks(ptrs, 4);
+        if (ret == 0) {
+            ret = set_inode(clone->inodeNumber, &inode);
+        }
+    }
+    if (ret == 0) {
+        clone->blocksFileSize = file.blocksFileSize;
+        clone->bytesFileSize = file.bytesFileSize;
+        clone->compression = file.compression;
+        if (data != 0) {
+            memcpy(fs->files[handle].data, data, fs->inline_max);
+        }
+    }
+    free(data);
+
+    if (close_file(handle) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        delete_file(filename);
+    }
+    return ret;
+}
+
+int set_compression2(FILE2 handle, int mode) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = set_compression(handle, mode);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int set_compression(FILE2 handle, int mode) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t *file = fs->files[handle].file;
     if (file == 0) {
         printf("no file opened with handle %d\n", handle);
         return -1;
     }
+    if (mode != COMPRESSION_NONE && mode != COMPRESSION_LZ) {
+        printf("invalid compression mode %d\n", mode);
+        return -1;
+    }
+    if (mode != COMPRESSION_NONE && !(fs->superblock->features & T2FS_FEATURE_COMPRESSION)) {
+        printf("disk formatted without compression\n");
+        return -1;
+    }
+
+    // blocks already written are not coded again
+    if (file->bytesFileSize > 0 || file->blocksFileSize > 0) {
+        printf("cannot change the compression of a file that is not empty\n");
+        return -1;
+    }
+
+    file->compression = mode;
+    return save_file(file, fs->files[handle].dir, fs->files[handle].data);
+}
+
+int mkdir2(char *pathname) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = make_dir(pathname);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int make_dir(char *pathname) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    if (pathname[0] != '/') {
+        printf("not an absolute path\n");
+        return -1;
+    }
+
+    int inode_number = searchBitmap(BITMAP_INODE, 0);
+    if (inode_number < 0) {
+        return -1;
+    }
+    printf("inode %d is free\n", inode_number);
+
+    record_t *dir = (record_t*)malloc(RECORD_SIZE);
+    record_t *file = (record_t*)malloc(RECORD_SIZE);
+    if (load_file(pathname, dir, file, 0) == 0) {
+        printf("dir %s already exists\n", pathname);
+        free(dir);
+        free(file);
+        return -1;
+    }
+
+    char *begin = pathname + 1;
+    char *end;
+    do {
+        end = strchr(begin, '/');
+        if (end == 0) {
+            end = begin + strlen(begin);
+            break;
+        }
+        begin = end + 1;
+    } while (end != pathname + strlen(pathname));
+
+    file->TypeVal = TYPEVAL_DIRETORIO;
+    memcpy(file->name, begin, end - begin);
+    file->name[end - begin] = 0;
+    file->blocksFileSize = 1;
+    file->bytesFileSize = fs->block_bytes;
+    file->inodeNumber = inode_number;
+    file->compression = COMPRESSION_NONE;
+
+    inode_t inode;
+    inode.dataPtr[0] = INVALID_PTR;
+    inode.dataPtr[1] = INVALID_PTR;
+    inode.singleIndPtr = INVALID_PTR;
+    inode.doubleIndPtr = INVALID_PTR;
+
+    printf("saving inode %d\n", inode_number);
+    if (set_inode(inode_number, &inode) != 0) {
+        free(dir);
+        free(file);
+        return -1;
+    }
+
+    printf("saving file %s in %s\n", file->name, dir->name);
+    if (save_file(file, dir, 0) != 0) {
+        free(dir);
+        free(file);
+        return -1;
+    }
+
+    if (setBitmap(BITMAP_INODE, inode_number, 1) != 0) {
+        free(dir);
+        free(file);
+        return -1;
+    }
+
+    return 0;
+}
+
+int rmdir2(char *pathname) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = remove_dir(pathname);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int remove_dir(char *pathname) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t dir;
+    record_t file;
+    if (load_file(pathname, &dir, &file, 0) != 0 || file.TypeVal != TYPEVAL_DIRETORIO) {
+        printf("dir %s doesn't exist\n", pathname);
+        return -1;
+    }
+
+    // the entries would be left with no way to them; remove_tree2 takes
+    // them along
+    block_list_t entries = {0};
+    int ret = list_entries(file.inodeNumber, &entries, 0);
+    free(entries.blocks);
+    if (ret != 0) {
+        return -1;
+    }
+    if (entries.n > 0) {
+        printf("dir %s is not empty\n", pathname);
+        return -1;
+    }
+
+    // unlinked first: a crash in between leaks the i-node instead of
+    // leaving a record that points to freed blocks
+    file.TypeVal = TYPEVAL_INVALIDO;
+    if (save_file(&file, &dir, 0) != 0) {
+        return -1;
+    }
+
+    // a handle left open would save the record back when closed
+    int inode_number = file.inodeNumber;
+    block_list_t unlinked = {&inode_number, 1, 1};
+    drop_handles(&unlinked);
+
+    return release_inode(file.inodeNumber);
+}
+
+int remove_tree2(char *pathname) {
+    pthread_mutex_lock(&fs->op_lock);
+    journalStart();
+    int ret = remove_tree(pathname);
+    journalStop();
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int remove_tree(char *pathname) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    record_t dir;
+    record_t file;
+    if (load_file(pathname, &dir, &file, 0) != 0 || file.TypeVal != TYPEVAL_DIRETORIO) {
+        printf("dir %s doesn't exist\n", pathname);
+        return -1;
+    }
+    if (file.inodeNumber == fs->root->inodeNumber) {
+        printf("cannot remove the root\n");
+        return -1;
+    }
+
+    // the whole subtree is read before anything changes, its directories
+    // taken from a stack
+    block_list_t inodes = {0};
+    block_list_t dirs = {0};
+    list_add(&inodes, file.inodeNumber);
+    list_add(&dirs, file.inodeNumber);
+    int ret = 0;
+    while (ret == 0 && dirs.n > 0) {
+        ret = list_entries(dirs.blocks[--dirs.n], &inodes, &dirs);
+    }
+    free(dirs.blocks);
+
+    // unlinked first, as in remove_dir; the ancestors' usage drops by the
+    // whole subtree in this one save
+    file.TypeVal = TYPEVAL_INVALIDO;
+    if (ret != 0 || save_file(&file, &dir, 0) != 0) {
+        free(inodes.blocks);
+        return -1;
+    }
+
+    // freed in parts of PART_INODES, in order; between two of them the
+    // operation starts over once its commit fills half the journal. After a
+    // crash there, the i-nodes not freed yet are left unreachable for fsck2
+    qsort(inodes.blocks, inodes.n, sizeof(int), compare_block_numbers);
+    int i;
+    for (i = 0; i < inodes.n; i += PART_INODES) {
+        block_list_t part = {inodes.blocks + i, inodes.n - i, 0};
+        if (part.n > PART_INODES) {
+            part.n = PART_INODES;
+        }
+        if (free_inodes(&part) != 0) {
+            ret = -1;
+        }
+        if (i + part.n < inodes.n && journalFull()) {
+            journalStop();
+            journalStart();
+        }
+    }
+    drop_handles(&inodes);
+    free(inodes.blocks);
+    return ret;
+}
+
+DIR2 opendir2(char *pathname) {
+    pthread_mutex_lock(&fs->op_lock);
+    DIR2 ret = open_dir(pathname);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+DIR2 open_dir(char *pathname) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->dirs[i].dir == 0) {
+            break;
+        }
+    }
+    if (i == MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    record_t dir;
+    record_t *file = (record_t*)malloc(RECORD_SIZE);
+    if (load_file(pathname, &dir, file, 0) == 0 &&
+        file->TypeVal == TYPEVAL_DIRETORIO) {
+        fs->dirs[i].dir = file;
+        fs->dirs[i].p = 0;
+        fs->dirs[i].block = -1;
+        fs->dirs[i].buffer = (unsigned char*)malloc(fs->block_bytes);
+        return i;
+    } else {
+        free(file);
+        return -1;
+    }
+
+    return 0;
+}
+
+int readdir2(DIR2 handle, DIRENT2 *dentry) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = read_dir(handle, dentry);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int read_dir(DIR2 handle, DIRENT2 *dentry) {
+    if (read_dir_batch(handle, dentry, 1) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the next valid record of the directory: 0 if found, 1 at the end.
+   Records are decoded straight from the buffered block, so each directory
+   block is read once no matter how many entries it holds */
+int next_record(DIR2 handle, inode_t *inode, record_t *file) {
+    int p = fs->dirs[handle].p;
+    int block_number;
+    do {
+        int block = p / fs->records_per_block;
+        if (block != fs->dirs[handle].block) {
+            if (get_n_block(inode, block, &block_number) != 0 ||
+                block_number == INVALID_PTR) {
+                fs->dirs[handle].p = p;
+                return 1;
+            }
+            if (read_block(block_number, fs->dirs[handle].buffer) != 0) {
+                return -1;
+            }
+            fs->dirs[handle].block = block;
+        }
+
+        decode_record(fs->dirs[handle].buffer + (p % fs->records_per_block) * RECORD_SIZE, file);
+        ++p;
+    } while (file->TypeVal == TYPEVAL_INVALIDO);
+
+    fs->dirs[handle].p = p;
+    return 0;
+}
+
+int readdir_batch2(DIR2 handle, DIRENT2 *dentries, int n) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = read_dir_batch(handle, dentries, n);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int read_dir_batch(DIR2 handle, DIRENT2 *dentries, int n) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    if (handle < 0 || handle >= MAX_OPEN_FILES || fs->dirs[handle].dir == 0) {
+        printf("no dir opened with handle %d\n", handle);
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(fs->dirs[handle].dir->inodeNumber, &inode) != 0) {
+        return -1;
+    }
+
+    int count;
+    int ret = 0;
+    record_t file;
+    for (count = 0; count < n; ++count) {
+        ret = next_record(handle, &inode, &file);
+        if (ret != 0) {
+            break;
+        }
+
+        strncpy(dentries[count].name, file.name, 32);
+        dentries[count].name[32] = 0;
+        dentries[count].fileType = file.TypeVal;
+        dentries[count].fileSize = file.bytesFileSize;
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+    return count;
+}
+
+int compare_inode_numbers(const void *a, const void *b) {
+    const DIRENTPLUS2 *x = *(const DIRENTPLUS2**)a;
+    const DIRENTPLUS2 *y = *(const DIRENTPLUS2**)b;
+    return x->record.inodeNumber - y->record.inodeNumber;
+}
+
+int readdirplus2(DIR2 handle, DIRENTPLUS2 *entries, int n, int flags) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = read_dir_plus(handle, entries, n, flags);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int read_dir_plus(DIR2 handle, DIRENTPLUS2 *entries, int n, int flags) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
+
+    if (handle < 0 || handle >= MAX_OPEN_FILES || fs->dirs[handle].dir == 0) {
+        printf("no dir opened with handle %d\n", handle);
+        return -1;
+    }
+
+    inode_t inode;
+    if (get_inode(fs->dirs[handle].dir->inodeNumber, &inode) != 0) {
+        return -1;
+    }
 
+    int count;
+    int ret = 0;
+    for (count = 0; count < n; ++count) {
+        ret = next_record(handle, &inode, &entries[count].record);
+        if (ret != 0) {
+            break;
+        }
+    }
 
-//atualizar tamanho do arquivo em bytes, em blocos
-    return 0;
-}
+    if (ret < 0) {
+        return -1;
+    }
+    if (!(flags & READDIRPLUS_INODE) || count == 0) {
+        return count;
+    }
 
-int delete_from_block(int *block_number, int size, int begin, int end) {
-    
-return 0;
-}
+    // visit the entries in i-node order so each i-node sector is read once
+    DIRENTPLUS2 **order = (DIRENTPLUS2**)malloc(count * sizeof(DIRENTPLUS2*));
+    int i;
+    for (i = 0; i < count; ++i) {
+        order[i] = &entries[i];
+    }
+    qsort(order, count, sizeof(DIRENTPLUS2*), compare_inode_numbers);
 
-int truncate2(FILE2 handle) {
-    if (!t2fs_init) {
-       initialize();
+    unsigned char sector[SECTOR_SIZE];
+    int sector_number = -1;
+    for (i = 0; i < count; ++i) {
+        int inode_number = order[i]->record.inodeNumber;
+        if (fs->inode_area + inode_number / INODES_PER_SECTOR != sector_number) {
+            sector_number = fs->inode_area + inode_number / INODES_PER_SECTOR;
+            if (journalRead(sector_number, sector) != 0) {
+                free(order);
+                return -1;
+            }
+        }
+        decode_inode(sector + (inode_number % INODES_PER_SECTOR) * INODE_SIZE, &order[i]->inode);
     }
 
-    return -1;
+    free(order);
+    return count;
 }
 
-int seek2(FILE2 handle, unsigned int offset) {
-    if (!t2fs_init) {
+int scan_inodes2(DWORD *next, INODESCAN2 *entries, int n) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = scan_inodes(next, entries, n);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int scan_inodes(DWORD *next, INODESCAN2 *entries, int n) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
-    record_t *file = files[handle].file;
-    if (file == 0) {
-        printf("no file opened with handle %d\n", handle);
+    if (next == 0 || entries == 0 || n < 0) {
         return -1;
     }
 
-    if (offset >= file->bytesFileSize) {
-       return -1;
+    int total = fs->superblock->inodeAreaSize * INODES_PER_SECTOR;
+    if (total > fs->superblock->freeInodeBitmapSize * SECTOR_SIZE * 8) {
+        total = fs->superblock->freeInodeBitmapSize * SECTOR_SIZE * 8;
     }
 
-    files[handle].p = offset;
-    return 0;
+    unsigned char *buffer = (unsigned char*)malloc(SCAN_SECTORS * SECTOR_SIZE);
+    unsigned char bits[SCAN_SECTORS * INODES_PER_SECTOR / 8];
+    bool used[SCAN_SECTORS];
+    inode_t inodes[INODES_PER_SECTOR];
+    int number = *next;
+    int count = 0;
+    while (count < n && number < total) {
+        int first = number - number % INODES_PER_SECTOR;
+        int sectors = (total - first + INODES_PER_SECTOR - 1) / INODES_PER_SECTOR;
+        if (sectors > SCAN_SECTORS) {
+            sectors = SCAN_SECTORS;
+        }
+        if (getBitmapRange(BITMAP_INODE, first, sectors * INODES_PER_SECTOR, bits) != 0) {
+            free(buffer);
+            return -1;
+        }
+
+        // the sectors are taken only as far as the entries left to fill
+        int wanted = n - count;
+        int i;
+        int k;
+        int j;
+        for (k = 0; k < sectors && wanted > 0; ++k) {
+            used[k] = false;
+            for (i = k * INODES_PER_SECTOR; i < (k + 1) * INODES_PER_SECTOR; ++i) {
+                if (first + i >= number && ((bits[i / 8] >> (i % 8)) & 1)) {
+                    used[k] = true;
+                    --wanted;
+                }
+            }
+        }
+        sectors = k;
+
+        // a sector without i-nodes in use is not read at all, and each run
+        // of sectors with some is read in one request
+        for (k = 0; k < sectors; k = j) {
+            if (!used[k]) {
+                j = k + 1;
+                continue;
+            }
+            for (j = k + 1; j < sectors && used[j]; ++j);
+            if (journalReadSectors(fs->inode_area + first / INODES_PER_SECTOR + k, j - k,
+                                   buffer + k * SECTOR_SIZE) != 0) {
+                free(buffer);
+                return -1;
+            }
+        }
+
+        for (k = 0; k < sectors && count < n; ++k) {
+            int end = first + (k + 1) * INODES_PER_SECTOR;
+            if (!used[k]) {
+                number = end;
+                continue;
+            }
+            decode_inodes(buffer + k * SECTOR_SIZE, inodes, INODES_PER_SECTOR);
+            for (; number < end && count < n; ++number) {
+                i = number - first;
+                if ((bits[i / 8] >> (i % 8)) & 1) {
+                    entries[count].inodeNumber = number;
+                    entries[count].inode = inodes[i % INODES_PER_SECTOR];
+                    ++count;
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    *next = number;
+    return count;
 }
 
-int mkdir2(char *pathname) {
-    if (!t2fs_init) {
+int statfs2(STATFS2 *stats) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = stat_disk(stats);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int stat_disk(STATFS2 *stats) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
-    if (pathname[0] != '/') {
-        printf("not an absolute path\n");
+    if (stats == 0) {
         return -1;
     }
 
-    int inode_number = searchBitmap2(BITMAP_INODE, 0);
-    if (inode_number < 0) {
+    int free_blocks = countFreeBits(BITMAP_DADOS);
+    int free_inodes = countFreeBits(BITMAP_INODE);
+    if (free_blocks < 0 || free_inodes < 0) {
         return -1;
     }
-    printf("inode %d is free\n", inode_number);
 
-    record_t *dir = (record_t*)malloc(RECORD_SIZE);
-    record_t *file = (record_t*)malloc(RECORD_SIZE);
-    if (load_file(pathname, dir, file) == 0) {
-        printf("dir %s already exists\n", pathname);
-        free(dir);
-        free(file);
-        return -1;
+    int inodes = fs->superblock->inodeAreaSize * INODES_PER_SECTOR;
+    if (inodes > fs->superblock->freeInodeBitmapSize * SECTOR_SIZE * 8) {
+        inodes = fs->superblock->freeInodeBitmapSize * SECTOR_SIZE * 8;
     }
+    stats->blockSize = fs->block_bytes;
+    stats->blocks = fs->data_blocks;
+    stats->freeBlocks = free_blocks;
+    stats->inodes = inodes;
+    stats->freeInodes = free_inodes;
+    return 0;
+}
 
-    char *begin = pathname + 1;
-    char *end;
-    do {
-        end = strchr(begin, '/');
-        if (end == 0) {
-            end = begin + strlen(begin);
-            break;
-        }
-        begin = end + 1;
-    } while (end != pathname + strlen(pathname));
-
-    file->TypeVal = TYPEVAL_DIRETORIO;
-    memcpy(file->name, begin, end - begin);
-    file->name[end - begin] = 0;
-    file->blocksFileSize = 1;
-    file->bytesFileSize = superblock->blockSize*SECTOR_SIZE;
-    file->inodeNumber = inode_number;
+int du2(char *pathname, DU2 *usage) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = dir_usage(pathname, usage);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
 
-    inode_t inode;
-    inode.dataPtr[0] = INVALID_PTR;
-    inode.dataPtr[1] = INVALID_PTR;
-    inode.singleIndPtr = INVALID_PTR;
-    inode.doubleIndPtr = INVALID_PTR;
+int dir_usage(char *pathname, DU2 *usage) {
+    if (!fs->t2fs_init) {
+        initialize();
+    }
 
-    printf("saving inode %d\n", inode_number);
-    if (set_inode(inode_number, &inode) != 0) {
-        free(dir);
-        free(file);
+    if (usage == 0) {
         return -1;
     }
-
-    printf("saving file %s in %s\n", file->name, dir->name);
-    if (save_file(file, dir) != 0) {
-        free(dir);
-        free(file);
+    if (!(fs->superblock->features & T2FS_FEATURE_DIR_USAGE)) {
+        printf("the disk keeps no directory usage\n");
         return -1;
     }
 
-    if (setBitmap2(BITMAP_INODE, inode_number, 1) != 0) {
-        free(dir);
-        free(file);
+    record_t dir;
+    record_t file;
+    if (strcmp(pathname, "/") == 0) {
+        file = *fs->root;
+    } else if (load_file(pathname, &dir, &file, 0) != 0) {
         return -1;
     }
 
+    if (file.TypeVal == TYPEVAL_DIRETORIO) {
+        return getUsage(file.inodeNumber, usage);
+    }
+    usage->bytes = file.bytesFileSize;
+    usage->blocks = file.blocksFileSize;
+    usage->files = 1;
+    usage->dirs = 0;
     return 0;
 }
 
-int rmdir2(char *pathname) {
-    if (!t2fs_init) {
-        initialize();
+void walk_push(walk_t *walk, int w, walk_dir_t *dir) {
+    walk_prefetch(dir);
+
+    walk_queue_t *queue = &walk->queues[w];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->n == queue->size) {
+        int size = queue->size > 0 ? queue->size * 2 : 64;
+        walk_dir_t *dirs = (walk_dir_t*)malloc(size * sizeof(walk_dir_t));
+        int i;
+        for (i = 0; i < queue->n; ++i) {
+            dirs[i] = queue->dirs[(queue->first + i) % queue->size];
+        }
+        free(queue->dirs);
+        queue->dirs = dirs;
+        queue->first = 0;
+        queue->size = size;
     }
+    queue->dirs[(queue->first + queue->n) % queue->size] = *dir;
+    ++queue->n;
+
+    // counted before the queue is let go, as walk_take does, so an idle
+    // walker that finds "queued" nonzero also finds a directory to take
+    pthread_mutex_lock(&walk->lock);
+    ++walk->queued;
+    ++walk->pending;
+    pthread_cond_signal(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    record_t dir;
-    record_t file;
-    if (load_file(pathname, &dir, &file) != 0) {
-        printf("dir %s doesn't exist\n", pathname);
-        return -1;
+/* Takes the newest directory of the walker's own queue or, failing that,
+   the oldest of another walker's */
+bool walk_take(walk_t *walk, int w, walk_dir_t *dir) {
+    int i;
+    for (i = 0; i < walk->n_queues; ++i) {
+        walk_queue_t *queue = &walk->queues[(w + i) % walk->n_queues];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->n == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+        if (i == 0) {
+            *dir = queue->dirs[(queue->first + queue->n - 1) % queue->size];
+        } else {
+            *dir = queue->dirs[queue->first];
+            queue->first = (queue->first + 1) % queue->size;
+        }
+        --queue->n;
+
+        pthread_mutex_lock(&walk->lock);
+        --walk->queued;
+        pthread_mutex_unlock(&walk->lock);
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+    return false;
+}
+
+/* Ends the walk; the first value given is the one walk2 returns */
+void walk_stop(walk_t *walk, int ret) {
+    pthread_mutex_lock(&walk->lock);
+    if (walk->stop == 0) {
+        walk->stop = ret;
     }
+    pthread_cond_broadcast(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+}
 
-    file.TypeVal = TYPEVAL_INVALIDO;
-    free_inode(file.inodeNumber);
+bool walk_stopped(walk_t *walk) {
+    pthread_mutex_lock(&walk->lock);
+    bool stopped = walk->stop != 0;
+    pthread_mutex_unlock(&walk->lock);
+    return stopped;
+}
+
+/* Starts reading the first blocks of a directory being queued, so they are
+   on their way while the walkers finish the directories before it */
+void walk_prefetch(walk_dir_t *dir) {
+    inode_t inode;
+    if (get_inode(dir->inode_number, &inode) != 0) {
+        return;
+    }
 
-    if (save_file(&file, &dir) != 0) {
+    int blocks[3] = {inode.dataPtr[0], inode.dataPtr[1], inode.singleIndPtr};
+    int i;
+    for (i = 0; i < 3; ++i) {
+        if (blocks[i] != INVALID_PTR) {
+            prefetch_sectors(fs->block_area + blocks[i] * fs->superblock->blockSize,
+                             fs->superblock->blockSize);
+        }
+    }
+}
+
+/* Hands every record of a directory to the callback, queueing the
+   subdirectories it lets in. The blocks are read WALK_SECTORS at a time,
+   those that follow each other on disk in one request. A stop by another
+   walker is seen between reads */
+int walk_dir(walk_t *walk, int w, walk_dir_t *dir, unsigned char *buffer) {
+    inode_t inode;
+    if (get_inode(dir->inode_number, &inode) != 0) {
         return -1;
     }
 
+    int per_read = WALK_SECTORS / fs->superblock->blockSize;
+    if (per_read < 1) {
+        per_read = 1;
+    }
+    int b = 0;
+    int n = per_read;
+    bool stopped = false;
+    while (n == per_read && !stopped && !walk_stopped(walk)) {
+        n = read_dir_blocks(&inode, b, per_read, buffer);
+        if (n < 0) {
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < n * fs->records_per_block && !stopped; ++i) {
+            if (buffer[i * RECORD_SIZE] == TYPEVAL_INVALIDO) {
+                continue;
+            }
+            record_t file;
+            decode_record(buffer + i * RECORD_SIZE, &file);
+
+            char *path = (char*)malloc(strlen(dir->path) + 34);
+            sprintf(path, "%s/%.32s", strcmp(dir->path, "/") == 0 ? "" : dir->path, file.name);
+            int ret = walk->fn(path, &file, dir->depth + 1, walk->arg);
+            if (ret == WALK_CONTINUE && file.TypeVal == TYPEVAL_DIRETORIO) {
+                walk_dir_t child = {path, file.inodeNumber, dir->depth + 1};
+                walk_push(walk, w, &child);
+                continue;
+            }
+            free(path);
+            if (ret != WALK_CONTINUE && ret != WALK_SKIP) {
+                walk_stop(walk, ret);
+                stopped = true;
+            }
+        }
+        b += n;
+    }
     return 0;
 }
 
-DIR2 opendir2(char *pathname) {
-    if (!t2fs_init) {
-        initialize();
+/* Reads up to "count" blocks of a directory from its block "first" on, one
+   request per run of contiguous blocks. Returns the number read, fewer at
+   the end of the directory, or -1 */
+int read_dir_blocks(inode_t *inode, int first, int count, unsigned char *buffer) {
+    int blocks[WALK_SECTORS];
+    int n;
+    for (n = 0; n < count && n < WALK_SECTORS; ++n) {
+        if (get_n_block(inode, first + n, &blocks[n]) != 0 || blocks[n] == INVALID_PTR) {
+            break;
+        }
     }
 
     int i;
-    for (i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (dirs[i].dir == 0) {
-            break;
+    int j;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && blocks[j] == blocks[j - 1] + 1; ++j);
+        if (journalReadSectors(fs->block_area + blocks[i] * fs->superblock->blockSize,
+                               (j - i) * fs->superblock->blockSize,
+                               buffer + i * fs->block_bytes) != 0) {
+            return -1;
         }
     }
-    if (i == MAX_OPEN_FILES) {
+    return n;
+}
+
+/* Lists the i-nodes of a directory's entries, and those of its
+   subdirectories again in "dirs" when it is given */
+int list_entries(int inode_number, block_list_t *inodes, block_list_t *dirs) {
+    inode_t inode;
+    if (get_inode(inode_number, &inode) != 0) {
         return -1;
     }
 
-    record_t dir;
-    record_t *file = (record_t*)malloc(RECORD_SIZE);
-    if (load_file(pathname, &dir, file) == 0 &&
-        file->TypeVal == TYPEVAL_DIRETORIO) {
-        dirs[i].dir = file;
-        dirs[i].p = 0;
-        return i;
-    } else {
-        free(file);
-        return -1;
+    int per_read = WALK_SECTORS / fs->superblock->blockSize;
+    if (per_read < 1) {
+        per_read = 1;
     }
+    unsigned char *buffer = (unsigned char*)malloc(per_read * fs->block_bytes);
+    int b = 0;
+    int n = per_read;
+    while (n == per_read) {
+        n = read_dir_blocks(&inode, b, per_read, buffer);
+        if (n < 0) {
+            free(buffer);
+            return -1;
+        }
 
+        int i;
+        for (i = 0; i < n * fs->records_per_block; ++i) {
+            if (buffer[i * RECORD_SIZE] == TYPEVAL_INVALIDO) {
+                continue;
+            }
+            record_t file;
+            decode_record(buffer + i * RECORD_SIZE, &file);
+            list_add(inodes, file.inodeNumber);
+            if (dirs != 0 && file.TypeVal == TYPEVAL_DIRETORIO) {
+                list_add(dirs, file.inodeNumber);
+            }
+        }
+        b += n;
+    }
+    free(buffer);
     return 0;
 }
 
-int readdir2(DIR2 handle, DIRENT2 *dentry) {
-    if (!t2fs_init) {
+/* A walker reads directories until none is left or being read */
+void walk_run(walk_t *walk, int w) {
+    int sectors = WALK_SECTORS > fs->superblock->blockSize ? WALK_SECTORS : fs->superblock->blockSize;
+    unsigned char *buffer = (unsigned char*)malloc(sectors * SECTOR_SIZE);
+    if (buffer == 0) {
+        walk_stop(walk, -1);
+        return;
+    }
+
+    walk_dir_t dir;
+    while (1) {
+        if (!walk_take(walk, w, &dir)) {
+            pthread_mutex_lock(&walk->lock);
+            while (walk->queued == 0 && walk->pending > 0 && walk->stop == 0) {
+                pthread_cond_wait(&walk->work, &walk->lock);
+            }
+            bool done = walk->queued == 0 || walk->stop != 0;
+            pthread_mutex_unlock(&walk->lock);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        if (!walk_stopped(walk) && walk_dir(walk, w, &dir, buffer) != 0) {
+            printf("cannot read directory %s\n", dir.path);
+            walk_stop(walk, -1);
+        }
+        free(dir.path);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->pending == 0) {
+            pthread_cond_broadcast(&walk->work);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+    free(buffer);
+}
+
+void *walk_thread(void *arg) {
+    walker_t *self = (walker_t*)arg;
+    use_context(self->walk->context);
+    walk_run(self->walk, self->w);
+    return arg;
+}
+
+int walk2(char *pathname, WALK2_FN fn, void *arg, int flags) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = walk_tree(pathname, fn, arg, flags);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int walk_tree(char *pathname, WALK2_FN fn, void *arg, int flags) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
-    record_t *dir = dirs[handle].dir;
-    if (dir == 0) {
-        printf("no dir opened with handle %d\n", handle);
+    if (fn == 0 || (flags & ~WALK_SERIAL)) {
         return -1;
     }
 
-    inode_t inode;
-    if (get_inode(dir->inodeNumber, &inode) != 0) {
+    record_t dir;
+    record_t file;
+    if (strcmp(pathname, "/") == 0) {
+        file = *fs->root;
+    } else if (load_file(pathname, &dir, &file, 0) != 0) {
         return -1;
     }
 
-    int p = dirs[handle].p;
-    record_t file;
-    if (get_record(inode.dataPtr[0], p, &file) != 0) {
+    int ret = fn(pathname, &file, 0, arg);
+    if (ret == WALK_SKIP || (ret == WALK_CONTINUE && file.TypeVal != TYPEVAL_DIRETORIO)) {
+        return 0;
+    } else if (ret != WALK_CONTINUE) {
+        return ret;
+    }
+
+    walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.context = fs;
+    walk.fn = fn;
+    walk.arg = arg;
+    walk.n_queues = 1;
+    if (!(flags & WALK_SERIAL)) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        walk.n_queues = n < 1 ? 1 : n > WALK_THREADS ? WALK_THREADS : n;
+    }
+    walk.queues = (walk_queue_t*)calloc(walk.n_queues, sizeof(walk_queue_t));
+    walker_t *walkers = (walker_t*)calloc(walk.n_queues, sizeof(walker_t));
+    if (walk.queues == 0 || walkers == 0) {
+        free(walk.queues);
+        free(walkers);
         return -1;
     }
+    pthread_mutex_init(&walk.lock, 0);
+    pthread_cond_init(&walk.work, 0);
+    int i;
+    for (i = 0; i < walk.n_queues; ++i) {
+        pthread_mutex_init(&walk.queues[i].lock, 0);
+    }
 
-    dirs[handle].p++;
-    memcpy(dentry->name, file.name, strlen(file.name));
-    dentry->name[strlen(file.name)] = 0;
-    dentry->fileType = file.TypeVal;
-    dentry->fileSize = file.bytesFileSize;
+    walk_dir_t top = {strdup(pathname), file.inodeNumber, 0};
+    walk_push(&walk, 0, &top);
 
-    return 0;
+    // the caller is the first walker; the others only steal at first
+    for (i = 1; i < walk.n_queues; ++i) {
+        walkers[i].walk = &walk;
+        walkers[i].w = i;
+        walkers[i].running = pthread_create(&walkers[i].thread, 0, walk_thread, &walkers[i]) == 0;
+    }
+    walk_run(&walk, 0);
+    for (i = 1; i < walk.n_queues; ++i) {
+        if (walkers[i].running) {
+            pthread_join(walkers[i].thread, 0);
+        }
+    }
+
+    // a stopped walk leaves directories behind
+    for (i = 0; i < walk.n_queues; ++i) {
+        walk_queue_t *queue = &walk.queues[i];
+        for (; queue->n > 0; --queue->n, queue->first = (queue->first + 1) % queue->size) {
+            free(queue->dirs[queue->first].path);
+        }
+        free(queue->dirs);
+        pthread_mutex_destroy(&queue->lock);
+    }
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.work);
+    free(walk.queues);
+    free(walkers);
+    return walk.stop;
 }
 
 int closedir2(DIR2 handle) {
-    if (!t2fs_init) {
+    pthread_mutex_lock(&fs->op_lock);
+    int ret = close_dir(handle);
+    pthread_mutex_unlock(&fs->op_lock);
+    return ret;
+}
+
+int close_dir(DIR2 handle) {
+    if (!fs->t2fs_init) {
         initialize();
     }
 
-    record_t *dir = dirs[handle].dir;
+    record_t *dir = fs->dirs[handle].dir;
     if (dir == 0) {
         printf("no dir opened with handle %d\n", handle);
         return -1;
     }
 
     free(dir);
-    dir = 0;
+    free(fs->dirs[handle].buffer);
+    fs->dirs[handle].dir = 0;
+    fs->dirs[handle].buffer = 0;
 
     return 0;
 }
+
+// the calls above on a mounted image: each runs in the caller's thread with the
+// context switched for its duration
+
+FILE2 create2_ctx(T2FS_CONTEXT *context, char *filename) {
+    T2FS_CONTEXT *previous = use_context(context);
+    FILE2 ret = create2(filename);
+    use_context(previous);
+    return ret;
+}
+
+int delete2_ctx(T2FS_CONTEXT *context, char *filename) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = delete2(filename);
+    use_context(previous);
+    return ret;
+}
+
+FILE2 open2_ctx(T2FS_CONTEXT *context, char *filename) {
+    T2FS_CONTEXT *previous = use_context(context);
+    FILE2 ret = open2(filename);
+    use_context(previous);
+    return ret;
+}
+
+int close2_ctx(T2FS_CONTEXT *context, FILE2 handle) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = close2(handle);
+    use_context(previous);
+    return ret;
+}
+
+int read2_ctx(T2FS_CONTEXT *context, FILE2 handle, char *buffer, int size) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = read2(handle, buffer, size);
+    use_context(previous);
+    return ret;
+}
+
+int write2_ctx(T2FS_CONTEXT *context, FILE2 handle, char *buffer, int size) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = write2(handle, buffer, size);
+    use_context(previous);
+    return ret;
+}
+
+int truncate2_ctx(T2FS_CONTEXT *context, FILE2 handle) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = truncate2(handle);
+    use_context(previous);
+    return ret;
+}
+
+int seek2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = seek2(handle, offset);
+    use_context(previous);
+    return ret;
+}
+
+int mkdir2_ctx(T2FS_CONTEXT *context, char *pathname) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = mkdir2(pathname);
+    use_context(previous);
+    return ret;
+}
+
+int rmdir2_ctx(T2FS_CONTEXT *context, char *pathname) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = rmdir2(pathname);
+    use_context(previous);
+    return ret;
+}
+
+DIR2 opendir2_ctx(T2FS_CONTEXT *context, char *pathname) {
+    T2FS_CONTEXT *previous = use_context(context);
+    DIR2 ret = opendir2(pathname);
+    use_context(previous);
+    return ret;
+}
+
+int readdir2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENT2 *dentry) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = readdir2(handle, dentry);
+    use_context(previous);
+    return ret;
+}
+
+int closedir2_ctx(T2FS_CONTEXT *context, DIR2 handle) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = closedir2(handle);
+    use_context(previous);
+    return ret;
+}
+
+int readdir_batch2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENT2 *dentries, int n) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = readdir_batch2(handle, dentries, n);
+    use_context(previous);
+    return ret;
+}
+
+int readdirplus2_ctx(T2FS_CONTEXT *context, DIR2 handle, DIRENTPLUS2 *entries, int n, int flags) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = readdirplus2(handle, entries, n, flags);
+    use_context(previous);
+    return ret;
+}
+
+int set_delete_mode2_ctx(T2FS_CONTEXT *context, int mode) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = set_delete_mode2(mode);
+    use_context(previous);
+    return ret;
+}
+
+int seek_data2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset, int whence, QWORD *position) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = seek_data2(handle, offset, whence, position);
+    use_context(previous);
+    return ret;
+}
+
+int fallocate2_ctx(T2FS_CONTEXT *context, FILE2 handle, QWORD offset, QWORD length) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = fallocate2(handle, offset, length);
+    use_context(previous);
+    return ret;
+}
+
+int sync2_ctx(T2FS_CONTEXT *context) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = sync2();
+    use_context(previous);
+    return ret;
+}
+
+int clone2_ctx(T2FS_CONTEXT *context, char *source, char *filename) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = clone2(source, filename);
+    use_context(previous);
+    return ret;
+}
+
+int set_compression2_ctx(T2FS_CONTEXT *context, FILE2 handle, int mode) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = set_compression2(handle, mode);
+    use_context(previous);
+    return ret;
+}
+
+int scan_inodes2_ctx(T2FS_CONTEXT *context, DWORD *next, INODESCAN2 *entries, int n) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = scan_inodes2(next, entries, n);
+    use_context(previous);
+    return ret;
+}
+
+int statfs2_ctx(T2FS_CONTEXT *context, STATFS2 *stats) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = statfs2(stats);
+    use_context(previous);
+    return ret;
+}
+
+int du2_ctx(T2FS_CONTEXT *context, char *pathname, DU2 *usage) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = du2(pathname, usage);
+    use_context(previous);
+    return ret;
+}
+
+int walk2_ctx(T2FS_CONTEXT *context, char *pathname, WALK2_FN fn, void *arg, int flags) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = walk2(pathname, fn, arg, flags);
+    use_context(previous);
+    return ret;
+}
+
+int remove_tree2_ctx(T2FS_CONTEXT *context, char *pathname) {
+    T2FS_CONTEXT *previous = use_context(context);
+    int ret = remove_tree2(pathname);
+    use_context(previous);
+    return ret;
+}
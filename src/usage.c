@@ -0,0 +1,200 @@
+#include <usage.h>
+#include <apidisk.h>
+#include <journal.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define ENTRY_SIZE 32
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / ENTRY_SIZE)
+#define MAX_DEPTH 65536     // a parent chain longer than this is a loop
+
+#define SECTOR_LOADED 1
+#define SECTOR_DIRTY 2
+
+// the table of a disk; writers of different directories share the sectors
+// of their common ancestors
+struct usage {
+    unsigned int first_sector;
+    int sectors;
+    unsigned char *entries;     // the table, filled a sector at a time
+    unsigned char *state;       // SECTOR_* flags of each sector
+    pthread_mutex_t lock;
+};
+
+// the implicit disk's table, used by threads that picked no other
+static struct usage default_usage = {0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct usage *current = &default_usage;
+
+/* The entry of an i-node, reading its sector on first use; 0 if out of range */
+static unsigned char *get_entry(int inode_number) {
+    if (current->entries == 0 || inode_number < 0 || inode_number >= current->sectors * ENTRIES_PER_SECTOR) {
+        return 0;
+    }
+
+    int sector = inode_number / ENTRIES_PER_SECTOR;
+    if (!(current->state[sector] & SECTOR_LOADED)) {
+        if (journalRead(current->first_sector + sector, current->entries + sector * SECTOR_SIZE) != 0) {
+            printf("cannot read usage sector %d\n", sector);
+            return 0;
+        }
+        current->state[sector] |= SECTOR_LOADED;
+    }
+    return current->entries + inode_number * ENTRY_SIZE;
+}
+
+static unsigned int get32(unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static QWORD get64(unsigned char *p) {
+    return get32(p) | (QWORD)get32(p + 4) << 32;
+}
+
+static void put32(unsigned char *p, unsigned int value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static void put64(unsigned char *p, QWORD value) {
+    put32(p, (unsigned int)value);
+    put32(p + 4, (unsigned int)(value >> 32));
+}
+
+/* Writes the sector holding an i-node's entry, if it is still dirty */
+static int write_sector_of(int inode_number) {
+    int sector = inode_number / ENTRIES_PER_SECTOR;
+    if (!(current->state[sector] & SECTOR_DIRTY)) {
+        return 0;
+    }
+    current->state[sector] &= ~SECTOR_DIRTY;
+    return journalWrite(current->first_sector + sector, current->entries + sector * SECTOR_SIZE);
+}
+
+struct usage *newUsage(void) {
+    struct usage *usage = (struct usage*)calloc(1, sizeof(struct usage));
+    if (usage != 0) {
+        pthread_mutex_init(&usage->lock, 0);
+    }
+    return usage;
+}
+
+void freeUsage(struct usage *usage) {
+    if (usage == 0) {
+        return;
+    }
+    free(usage->entries);
+    free(usage->state);
+    pthread_mutex_destroy(&usage->lock);
+    free(usage);
+}
+
+struct usage *useUsage(struct usage *usage) {
+    struct usage *previous = current;
+    current = usage != 0 ? usage : &default_usage;
+    return previous;
+}
+
+int initUsage(unsigned int firstSector, int sectorCount) {
+    free(current->entries);
+    free(current->state);
+    current->first_sector = firstSector;
+    current->sectors = sectorCount;
+    current->entries = (unsigned char*)malloc(current->sectors * SECTOR_SIZE);
+    current->state = (unsigned char*)calloc(current->sectors, 1);
+    if (current->entries == 0 || current->state == 0) {
+        free(current->entries);
+        free(current->state);
+        current->entries = 0;
+        current->state = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int hasUsage(void) {
+    return current->entries != 0;
+}
+
+int getUsage(int inodeNumber, DU2 *usage) {
+    pthread_mutex_lock(&current->lock);
+    unsigned char *entry = get_entry(inodeNumber);
+    if (entry != 0) {
+        usage->files = get32(entry + 4);
+        usage->dirs = get32(entry + 8);
+        usage->blocks = get64(entry + 16);
+        usage->bytes = get64(entry + 24);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return entry != 0 ? 0 : -1;
+}
+
+int resetUsage(int inodeNumber, int parent) {
+    if (current->entries == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    unsigned char *entry = get_entry(inodeNumber);
+    int ret = -1;
+    if (entry != 0) {
+        int i;
+        for (i = 0; i < ENTRY_SIZE; ++i) {
+            entry[i] = 0;
+        }
+        put32(entry, parent);
+        current->state[inodeNumber / ENTRIES_PER_SECTOR] |= SECTOR_DIRTY;
+        ret = write_sector_of(inodeNumber);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+int addUsage(int inodeNumber, long long bytes, long long blocks, int files, int dirs) {
+    if (current->entries == 0 || (bytes == 0 && blocks == 0 && files == 0 && dirs == 0)) {
+        return 0;
+    }
+
+    // the totals change on the way up; the sectors are written on a second
+    // walk, so ancestors that share one write it once
+    pthread_mutex_lock(&current->lock);
+    int ret = 0;
+    int inode_number = inodeNumber;
+    int depth;
+    for (depth = 0; depth < MAX_DEPTH; ++depth) {
+        unsigned char *entry = get_entry(inode_number);
+        if (entry == 0) {
+            ret = -1;
+            break;
+        }
+        put32(entry + 4, get32(entry + 4) + files);
+        put32(entry + 8, get32(entry + 8) + dirs);
+        put64(entry + 16, get64(entry + 16) + blocks);
+        put64(entry + 24, get64(entry + 24) + bytes);
+        current->state[inode_number / ENTRIES_PER_SECTOR] |= SECTOR_DIRTY;
+        if (inode_number == 0) {
+            break;
+        }
+        inode_number = get32(entry);
+    }
+    if (depth == MAX_DEPTH) {
+        printf("usage of inode %d has no way to the root\n", inodeNumber);
+        ret = -1;
+    }
+
+    for (inode_number = inodeNumber, depth = 0; depth < MAX_DEPTH; ++depth) {
+        if (write_sector_of(inode_number) != 0) {
+            ret = -1;
+        }
+        unsigned char *entry = get_entry(inode_number);
+        if (entry == 0 || inode_number == 0) {
+            break;
+        }
+        inode_number = get32(entry);
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
@@ -0,0 +1,124 @@
+/**
+
+    bench: mede o custo das somas de verificação do T2FS (T2FS_FEATURE_CHECKSUM)
+
+    usage: bench [megabytes]
+
+    Calcula o CRC32C de setores de 256 bytes pela instrução do processador,
+    um setor por chamada e 64 por chamada (como na leitura), e pelas
+    tabelas, e mede a leitura sequencial com read2 de um arquivo de
+    "megabytes" MB (16 por padrão) gravado no disco t2fs_disk.dat. Rodando em
+    discos formatados com e sem "-O checksum", a diferença entre as leituras é
+    o custo das somas. Os resultados vão para stderr, separados das mensagens
+    da biblioteca.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <t2fs.h>
+#include <crc32c.h>
+
+#define CHUNK 65536
+#define PASSES 5
+#define CRC_BYTES (64 << 20)
+#define BATCH 64
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* MB/s of a CRC32C function over CRC_BYTES bytes, a sector at a time */
+static double crc_speed(unsigned int (*crc)(unsigned int, const unsigned char*, int)) {
+    static unsigned char sector[SECTOR_SIZE];
+    unsigned int sum = 0;
+    int i;
+    for (i = 0; i < SECTOR_SIZE; ++i) {
+        sector[i] = rand();
+    }
+
+    double start = now();
+    for (i = 0; i < CRC_BYTES / SECTOR_SIZE; ++i) {
+        sum = crc(sum, sector, SECTOR_SIZE);
+    }
+    double seconds = now() - start;
+    sector[0] = sum; // keeps the loop from being optimized out
+    return CRC_BYTES / seconds / (1 << 20);
+}
+
+/* MB/s of crc32cMany over CRC_BYTES bytes, BATCH sectors at a time */
+static double many_speed(void) {
+    static unsigned char sectors[BATCH * SECTOR_SIZE];
+    unsigned int crcs[BATCH];
+    unsigned int sum = 0;
+    int i;
+    for (i = 0; i < BATCH * SECTOR_SIZE; ++i) {
+        sectors[i] = rand();
+    }
+
+    double start = now();
+    for (i = 0; i < CRC_BYTES / (BATCH * SECTOR_SIZE); ++i) {
+        crc32cMany(sectors, BATCH, SECTOR_SIZE, crcs);
+        sum += crcs[i % BATCH];
+    }
+    double seconds = now() - start;
+    sectors[0] = sum;
+    return CRC_BYTES / seconds / (1 << 20);
+}
+
+int main(int argc, char *argv[]) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 16;
+    char *buffer = malloc(CHUNK);
+    int i;
+
+    fprintf(stderr, "crc32c: %s, %.0f MB/s, %.0f MB/s %d sectors at a time; tables %.0f MB/s\n",
+            crc32cHardware() ? "sse4.2" : "tables",
+            crc_speed(crc32c), many_speed(), BATCH, crc_speed(crc32cPortable));
+
+    FILE2 handle = create2("/bench");
+    if (handle < 0) {
+        fprintf(stderr, "cannot create /bench\n");
+        return 1;
+    }
+    for (i = 0; i < CHUNK; ++i) {
+        buffer[i] = rand();
+    }
+    for (i = 0; i < megabytes * ((1 << 20) / CHUNK); ++i) {
+        if (write2(handle, buffer, CHUNK) != CHUNK) {
+            fprintf(stderr, "cannot write /bench\n");
+            return 1;
+        }
+    }
+    close2(handle);
+
+    // the best of a few passes, with the image in the page cache
+    double best = 0;
+    int pass;
+    for (pass = 0; pass < PASSES; ++pass) {
+        handle = open2("/bench");
+        double start = now();
+        int total = 0;
+        int n;
+        while ((n = read2(handle, buffer, CHUNK)) > 0) {
+            total += n;
+        }
+        double seconds = now() - start;
+        close2(handle);
+        if (n < 0 || total != megabytes << 20) {
+            fprintf(stderr, "read %d bytes of %d\n", total, megabytes << 20);
+            return 1;
+        }
+        if (pass == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    fprintf(stderr, "read2: %d MB in %.3f s, %.0f MB/s\n", megabytes, best, megabytes / best);
+
+    delete2("/bench");
+    free(buffer);
+    return 0;
+}
@@ -23,6 +23,10 @@ void cmdMkdir(void);
 void cmdRmdir(void);
 void cmdLs(void);
 void cmdTrunc(void);
+void cmdDf(void);
+void cmdDu(void);
+void cmdFind(void);
+void cmdRmtree(void);
 
 
 static void dump(char *buffer, int size) {
@@ -74,6 +78,10 @@ int main()
             else if (strcmp(token,"rmdir")==0 || strcmp(token,"rm")==0) cmdRmdir();
             else if (strcmp(token,"ls")==0 || strcmp(token,"dir")==0) cmdLs();
 	    else if (strcmp(token,"trunc")==0) cmdTrunc();
+            else if (strcmp(token,"df")==0) cmdDf();
+            else if (strcmp(token,"du")==0) cmdDu();
+            else if (strcmp(token,"find")==0) cmdFind();
+            else if (strcmp(token,"rmtree")==0) cmdRmtree();
             else printf ("???\n");
         }
     }
@@ -101,9 +109,13 @@ void cmdMan(void) {
     printf ("close   [hdl]       -> close [hdl]\n");
     printf ("read    [hdl] [siz] -> read [siz] bytes from file [hdl]\n");
     printf ("trunc   [hdl] [siz] -> truncate file [hdl] to [size] bytes\n");
+    printf ("df                  -> free blocks and i-nodes of T2FS\n");
+    printf ("du      [pathname]  -> bytes, files and dirs under [pathname]\n");
+    printf ("find    [pathname]  -> list everything under [pathname]\n");
     printf ("ls      [pathname]  -> list files in [pathname]\n");
     printf ("md      [pathname]  -> create [pathname] dir in T2FS\n");
     printf ("rm      [pathname]  -> deletes [pathname] dir in T2FS\n");
+    printf ("rmtree  [pathname]  -> deletes [pathname] dir and all under it\n");
     printf ("cp      [src] [dst] -> copy files: src -> dst\n");
     printf ("fscp -t [src] [dst] -> copy HostFS -> T2FS\n");
     printf ("fscp -f [src] [dst] -> copy T2FS   -> HostFS\n");
@@ -443,7 +455,7 @@ void cmdLs(void) {
     // Coloca diretorio na tela
     DIRENT2 dentry;
     while ( readdir2(d, &dentry) == 0 ) {
-        printf ("%c %8u %s\n", (dentry.fileType?'d':'-'), dentry.fileSize, dentry.name);
+        printf ("%c %8llu %s\n", (dentry.fileType?'d':'-'), dentry.fileSize, dentry.name);
     }
 
     closedir2(d);
@@ -499,4 +511,66 @@ void cmdTrunc(void) {
     printf ("file-handle %d truncated to %d bytes\n", handle, size );
 }
 
+/**
+Mostra os blocos e i-nodes livres, lidos com statfs2
+*/
+void cmdDf(void) {
+    STATFS2 stats;
+    int err = statfs2(&stats);
+    if (err) {
+        printf ("Error statfs2: %d\n", err);
+        return;
+    }
+    printf ("blocks: %u of %u free (%u bytes each)\n", stats.freeBlocks, stats.blocks, stats.blockSize);
+    printf ("inodes: %u of %u free\n", stats.freeInodes, stats.inodes);
+}
+
+void cmdDu(void) {
+    // get first parameter => pathname
+    char *token = strtok(NULL," \t");
+    if (token==NULL) {
+        printf ("Missing parameter\n");
+        return;
+    }
+    DU2 usage;
+    int err = du2(token, &usage);
+    if (err) {
+        printf ("Error du2: %d\n", err);
+        return;
+    }
+    printf ("%llu bytes in %llu blocks, %u files, %u dirs\n", usage.bytes, usage.blocks, usage.files, usage.dirs);
+}
+
+static int printEntry(char *path, struct t2fs_record *record, int depth, void *arg) {
+    printf ("%c %10llu %s\n", record->TypeVal==TYPEVAL_DIRETORIO ? 'd' : '-', record->bytesFileSize, path);
+    return WALK_CONTINUE;
+}
+
+void cmdFind(void) {
+    // get first parameter => pathname
+    char *token = strtok(NULL," \t");
+    if (token==NULL) {
+        printf ("Missing parameter\n");
+        return;
+    }
+    int err = walk2(token, printEntry, NULL, 0);
+    if (err) {
+        printf ("Error walk2: %d\n", err);
+    }
+}
+
+void cmdRmtree(void) {
+    // get first parameter => pathname
+    char *token = strtok(NULL," \t");
+    if (token==NULL) {
+        printf ("Missing parameter\n");
+        return;
+    }
+    int err = remove_tree2(token);
+    if (err) {
+        printf ("Error remove_tree2: %d\n", err);
+        return;
+    }
 
+    printf ("Directory tree was erased\n");
+}
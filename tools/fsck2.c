@@ -0,0 +1,1069 @@
+/**
+
+    fsck2: checks a T2FS image and optionally repairs it
+
+    usage: fsck2 [-r] [-j workers] [-v] [image...]
+
+    The directory tree is walked from i-node 0 by a pool of workers, each one
+    taking a directory from a shared queue. Every i-node and block reached is
+    claimed in rebuilt bitmaps; a second claim is a double allocation. The
+    rebuilt bitmaps are then compared with the ones on disk to find leaks.
+    Bitmaps and the i-node area are read with one request each. The pointers
+    of an i-node or an indirection block are claimed first, and the blocks
+    they reach that must be read are then read in batches, one request per
+    run of consecutive block numbers.
+
+    With -r the on-disk bitmaps are replaced by the rebuilt ones, doubly
+    allocated data blocks are copied to fresh blocks, and pointers that cannot
+    be kept (out of range, shared indirection blocks, duplicated links) are
+    cleared.
+
+    I-nodes waiting in the orphan list for the background reclaimer are not
+    linked anywhere; they and their blocks are counted as in use. Entries
+    naming a linked or invalid i-node are dropped.
+
+    On images with a metadata journal, a complete commit that was not copied
+    to its place yet is replayed first (with -r) as the library would on its
+    next start; without -r the image is left alone and reported as such.
+    Data blocks end where the journal begins.
+
+    On images with reflink, blocks of regular files may be reached through
+    several pointers: the first one walks the block and the others only count
+    it. The counts, less the first reference, must match the refcount table;
+    -r writes the table rebuilt from them.
+
+    On images with dir_usage, the bytes, blocks, files and subdirectories of
+    every reachable directory's subtree are summed from the records and
+    compared with the usage table, as is the parent kept for each directory;
+    -r writes the entries that differ.
+
+    The free block and i-node counts of the superblock are compared with the
+    rebuilt bitmaps; the library only writes them at sync2 and unmount, so a
+    difference is not an error. -r writes the right ones.
+
+    On images with checksums, every data block of a regular file is read
+    whole and each sector is compared with its CRC32C in the table. A sector
+    that does not match cannot be repaired: -r clears its sum, so the library
+    reads it again, unchecked.
+
+    A disk striped over several images by mkfs2 is checked by naming all of
+    them, in the order they were formatted; sector offsets are mapped to the
+    images through the stripe layout kept in the superblock.
+
+    Exit status: 0 clean, 1 errors corrected, 4 errors left uncorrected, 8 failure.
+
+*/
+
+#include <t2fs.h>
+#include <crc32c.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEFAULT_DISK_NAME "t2fs_disk.dat"
+#define MAX_REPORTS 10
+#define MAX_IMAGES 64
+#define READ_BATCH 64   // directory, indirection or checked data blocks read together
+
+#define RECORD_SIZE 64
+#define INODE_SIZE 16
+#define PTR_SIZE 4
+#define BITS_PER_SECTOR (SECTOR_SIZE * 8)
+#define TAGS_PER_SECTOR ((SECTOR_SIZE - 12) / 4)
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+typedef struct t2fs_superbloco superblock_t;
+
+enum conflict_kind {
+    SHARED_BLOCK,   // data block also owned by another file: copy it
+    DROP_POINTER,   // pointer cannot be kept: set it to INVALID_PTR
+    DROP_RECORD,    // directory record cannot be kept: invalidate it
+    BAD_CHECKSUM    // sector does not match its sum: clear the sum
+};
+
+// an entry of the usage table, as summed from the records
+typedef struct {
+    QWORD bytes;
+    QWORD blocks;
+    unsigned int files;
+    unsigned int dirs;
+} usage_t;
+
+typedef struct {
+    enum conflict_kind kind;
+    off_t where;    // byte offset in the image of the pointer, record or sum
+    int block;
+} conflict_t;
+
+static int fds[MAX_IMAGES];
+static int images = 1;
+static unsigned int stripe;     // sectors per stripe unit, zero with one image
+static int do_repair = 0;
+static int verbose = 0;
+
+static superblock_t sb;
+static unsigned int inode_area;
+static unsigned int block_area;
+static unsigned int block_bytes;
+static unsigned int ptrs_per_block;
+static int n_blocks;
+static int n_inodes;
+static int orphan_block;
+static unsigned int journal_start;  // zero without a journal
+static unsigned int refcount_start; // zero without reflink
+static unsigned int refcount_size;
+static unsigned int checksum_start; // zero without checksums
+static unsigned int checksum_size;
+static unsigned int usage_start;    // zero without dir_usage
+static unsigned int usage_size;
+static bool large_file;
+
+static unsigned char *disk_blocks;   // bitmaps as found on disk
+static unsigned char *disk_inodes;
+static unsigned char *used_blocks;   // bitmaps rebuilt from reachable data
+static unsigned char *used_inodes;
+static unsigned char *inodes;        // whole i-node area
+static int *refs;                    // pointers reaching each block, with reflink
+static unsigned char *sums;          // whole checksum table, with checksums
+static usage_t *usage_of;            // totals of the files right in each directory, with dir_usage
+static int *parents;                 // directory holding each directory, -1 if none
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more_work = PTHREAD_COND_INITIALIZER;
+static int *queue;
+static int queued = 0;
+static int queue_size = 0;
+static int busy = 0;
+
+static conflict_t *conflicts;
+static int n_conflicts = 0;
+static int conflicts_size = 0;
+static int errors = 0;
+static int reports = 0;
+
+static unsigned int get32(unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* Moves "size" bytes at a byte offset of the disk, a stripe unit at a time
+   on a striped one */
+static int disk_io(off_t offset, void *buffer, size_t size, bool write) {
+    unsigned char *p = buffer;
+    while (size > 0) {
+        int image = 0;
+        off_t at = offset;
+        size_t count = size;
+        if (images > 1) {
+            off_t unit_bytes = (off_t)stripe * SECTOR_SIZE;
+            off_t unit = offset / unit_bytes;
+            image = unit % images;
+            at = unit / images * unit_bytes + offset % unit_bytes;
+            if (count > (size_t)(unit_bytes - offset % unit_bytes)) {
+                count = unit_bytes - offset % unit_bytes;
+            }
+        }
+        ssize_t done = write ? pwrite(fds[image], p, count, at) : pread(fds[image], p, count, at);
+        if (done != (ssize_t)count) {
+            return -1;
+        }
+        offset += count;
+        p += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int read_at(off_t sector, void *buffer, size_t n) {
+    return disk_io(sector * SECTOR_SIZE, buffer, n * SECTOR_SIZE, false);
+}
+
+static int write_at(off_t sector, void *buffer, size_t n) {
+    return disk_io(sector * SECTOR_SIZE, buffer, n * SECTOR_SIZE, true);
+}
+
+static void close_images(void) {
+    int i;
+    for (i = 0; i < images; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+static off_t block_offset(int block) {
+    return ((off_t)block_area + (off_t)block * sb.blockSize) * SECTOR_SIZE;
+}
+
+static int get_bit(unsigned char *bitmap, int n) {
+    return (bitmap[n / 8] >> (n % 8)) & 1;
+}
+
+/* Returns the previous value of the bit, so only one claimer ever sees 0 */
+static int claim_bit(unsigned char *bitmap, int n) {
+    unsigned char mask = 1 << (n % 8);
+    return (__sync_fetch_and_or(&bitmap[n / 8], mask) & mask) != 0;
+}
+
+static void report(const char *fmt, int a, int b) {
+    pthread_mutex_lock(&lock);
+    ++errors;
+    if (verbose || reports++ < MAX_REPORTS) {
+        printf(fmt, a, b);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void add_conflict(enum conflict_kind kind, off_t where, int block) {
+    pthread_mutex_lock(&lock);
+    if (n_conflicts == conflicts_size) {
+        conflicts_size = conflicts_size ? conflicts_size * 2 : 64;
+        conflicts = realloc(conflicts, conflicts_size * sizeof(conflict_t));
+    }
+    conflicts[n_conflicts].kind = kind;
+    conflicts[n_conflicts].where = where;
+    conflicts[n_conflicts].block = block;
+    ++n_conflicts;
+    pthread_mutex_unlock(&lock);
+}
+
+static void push_dir(int inode_number) {
+    pthread_mutex_lock(&lock);
+    if (queued == queue_size) {
+        queue_size = queue_size ? queue_size * 2 : 64;
+        queue = realloc(queue, queue_size * sizeof(int));
+    }
+    queue[queued++] = inode_number;
+    pthread_cond_signal(&more_work);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Claims the block "where" points to; returns 0 if this i-node owns it alone,
+   1 if it is a clone's block already walked through another pointer */
+static int claim_block(int owner, int block, off_t where, bool is_ind, bool is_dir) {
+    if (block < 0 || block >= n_blocks) {
+        report("inode %d: pointer to invalid block %d\n", owner, block);
+        add_conflict(DROP_POINTER, where, block);
+        return -1;
+    }
+
+    // directories are never cloned, so their blocks are not counted
+    if (refs != 0 && !is_dir && __sync_fetch_and_add(&refs[block], 1) > 0) {
+        return 1;
+    }
+    if (claim_bit(used_blocks, block)) {
+        report("inode %d: block %d is allocated twice\n", owner, block);
+        add_conflict(is_ind ? DROP_POINTER : SHARED_BLOCK, where, block);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void check_dir_block(int owner, int block, unsigned char *buffer);
+
+/* Reads a list of blocks into consecutive buffers, one request per run of
+   consecutive numbers */
+static int read_blocks(int *blocks, int n, unsigned char *buffer) {
+    int i = 0;
+    while (i < n) {
+        int j;
+        for (j = i + 1; j < n && blocks[j] == blocks[j - 1] + 1; ++j);
+        if (read_at(block_offset(blocks[i]) / SECTOR_SIZE,
+                    buffer + (size_t)i * block_bytes, (j - i) * sb.blockSize) != 0) {
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+/* Compares each sector of a file's block with its sum; zero is no sum */
+static void check_sums(int owner, int block, unsigned char *buffer) {
+    unsigned int first = block * sb.blockSize;
+    unsigned int crcs[64];
+    int i;
+    for (i = 0; i < sb.blockSize; ++i) {
+        if (i % 64 == 0) {
+            crc32cMany(buffer + i * SECTOR_SIZE, sb.blockSize - i < 64 ? sb.blockSize - i : 64,
+                       SECTOR_SIZE, crcs);
+        }
+        unsigned int sum = get32(sums + (first + i) * 4);
+        if (sum != 0 && sum != ~crcs[i % 64]) {
+            report("inode %d: sector %d does not match its checksum\n",
+                   owner, block_area + first + i);
+            add_conflict(BAD_CHECKSUM,
+                         (off_t)checksum_start * SECTOR_SIZE + (first + i) * 4, block);
+        }
+    }
+}
+
+/* Claims the data blocks of "n" pointers stored at "where", and reads the
+   ones whose content is checked READ_BATCH at a time into "buffer" */
+static void check_data(int owner, unsigned char *ptrs, int n, off_t where, bool is_dir, unsigned char *buffer) {
+    int blocks[READ_BATCH];
+    int batched = 0;
+    int i;
+    for (i = 0; i <= n; ++i) {
+        if (i < n) {
+            int block = get32(ptrs + i * PTR_SIZE);
+            if (block == INVALID_PTR
+                || claim_block(owner, block, where + i * PTR_SIZE, false, is_dir) != 0) {
+                continue;
+            }
+            if (is_dir || (sums != 0 && (block + 1) * sb.blockSize <= checksum_size * (SECTOR_SIZE / 4))) {
+                blocks[batched++] = block;
+            }
+        }
+        if (batched == 0 || (batched < READ_BATCH && i < n)) {
+            continue;
+        }
+
+        int k;
+        if (read_blocks(blocks, batched, buffer) != 0) {
+            for (k = 0; k < batched; ++k) {
+                report(is_dir ? "inode %d: cannot read directory block %d\n"
+                              : "inode %d: cannot read data block %d\n", owner, blocks[k]);
+            }
+        } else {
+            for (k = 0; k < batched; ++k) {
+                if (is_dir) {
+                    check_dir_block(owner, blocks[k], buffer + (size_t)k * block_bytes);
+                } else {
+                    check_sums(owner, blocks[k], buffer + (size_t)k * block_bytes);
+                }
+            }
+        }
+        batched = 0;
+    }
+}
+
+/* Claims the indirection blocks of "n" pointers stored at "where", which map
+   "levels" deep, reads them READ_BATCH at a time and walks what they map */
+static void check_ind(int owner, unsigned char *ptrs, int n, off_t where, int levels, bool is_dir, unsigned char *buffer) {
+    unsigned char *ind = 0;
+    int blocks[READ_BATCH];
+    int batched = 0;
+    int i;
+    for (i = 0; i <= n; ++i) {
+        if (i < n) {
+            int block = get32(ptrs + i * PTR_SIZE);
+            if (block != INVALID_PTR
+                && claim_block(owner, block, where + i * PTR_SIZE, true, is_dir) == 0) {
+                blocks[batched++] = block;
+            }
+        }
+        if (batched == 0 || (batched < READ_BATCH && i < n)) {
+            continue;
+        }
+
+        if (ind == 0) {
+            ind = malloc((size_t)READ_BATCH * block_bytes);
+        }
+        int k;
+        if (read_blocks(blocks, batched, ind) != 0) {
+            for (k = 0; k < batched; ++k) {
+                report("inode %d: cannot read indirection block %d\n", owner, blocks[k]);
+            }
+        } else {
+            for (k = 0; k < batched; ++k) {
+                if (levels == 1) {
+                    check_data(owner, ind + (size_t)k * block_bytes, ptrs_per_block,
+                               block_offset(blocks[k]), is_dir, buffer);
+                } else {
+                    check_ind(owner, ind + (size_t)k * block_bytes, ptrs_per_block,
+                              block_offset(blocks[k]), levels - 1, is_dir, buffer);
+                }
+            }
+        }
+        batched = 0;
+    }
+    free(ind);
+}
+
+static void check_inode(int inode_number, bool is_dir, unsigned char *buffer) {
+    // the i-node's pointers are read where the whole area was loaded
+    unsigned char *ptrs = inodes + inode_number * INODE_SIZE;
+
+    // the blocks of a file whose sums are checked are read into a buffer of
+    // their own: the caller's one holds the directory blocks being walked
+    if (!is_dir && sums != 0) {
+        buffer = malloc((size_t)READ_BATCH * block_bytes);
+    }
+
+    off_t where = (off_t)inode_area * SECTOR_SIZE + inode_number * INODE_SIZE;
+    check_data(inode_number, ptrs, 2, where, is_dir, buffer);
+    check_ind(inode_number, ptrs + 8, 1, where + 8, 1, is_dir, buffer);
+    check_ind(inode_number, ptrs + 12, 1, where + 12, 2, is_dir, buffer);
+
+    if (!is_dir && sums != 0) {
+        free(buffer);
+    }
+}
+
+/* Checks the records of a directory block already read into "buffer" */
+static void check_dir_block(int owner, int block, unsigned char *buffer) {
+    unsigned int i;
+    for (i = 0; i < block_bytes / RECORD_SIZE; ++i) {
+        unsigned char *record = buffer + i * RECORD_SIZE;
+        off_t where = block_offset(block) + i * RECORD_SIZE;
+        BYTE type = record[0];
+        int inode_number = get32(record + 41);
+
+        if (type == TYPEVAL_INVALIDO) {
+            continue;
+        }
+        if (type != TYPEVAL_REGULAR && type != TYPEVAL_DIRETORIO) {
+            report("inode %d: record with invalid type %d\n", owner, type);
+            add_conflict(DROP_RECORD, where, 0);
+            continue;
+        }
+        if (inode_number <= 0 || inode_number >= n_inodes) {
+            report("inode %d: record points to invalid inode %d\n", owner, inode_number);
+            add_conflict(DROP_RECORD, where, 0);
+            continue;
+        }
+        if (claim_bit(used_inodes, inode_number)) {
+            report("inode %d: inode %d is linked twice\n", owner, inode_number);
+            add_conflict(DROP_RECORD, where, 0);
+            continue;
+        }
+
+        // a directory is walked by one worker at a time, so its totals
+        // need no lock
+        if (usage_of != 0 && type == TYPEVAL_DIRETORIO) {
+            parents[inode_number] = owner;
+            ++usage_of[owner].dirs;
+        } else if (usage_of != 0) {
+            usage_of[owner].bytes += get32(record + 37) | (large_file ? (QWORD)get32(record + 46) << 32 : 0);
+            usage_of[owner].blocks += get32(record + 33);
+            ++usage_of[owner].files;
+        }
+
+        if (type == TYPEVAL_DIRETORIO) {
+            push_dir(inode_number);
+        } else {
+            check_inode(inode_number, false, 0);
+        }
+    }
+}
+
+static void *worker(void *arg) {
+    unsigned char *buffer = malloc((size_t)READ_BATCH * block_bytes);
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (queued == 0 && busy > 0) {
+            pthread_cond_wait(&more_work, &lock);
+        }
+        if (queued == 0) {
+            break;
+        }
+
+        int inode_number = queue[--queued];
+        ++busy;
+        pthread_mutex_unlock(&lock);
+
+        check_inode(inode_number, true, buffer);
+
+        pthread_mutex_lock(&lock);
+        if (--busy == 0 && queued == 0) {
+            pthread_cond_broadcast(&more_work);
+        }
+    }
+    pthread_cond_broadcast(&more_work);
+    pthread_mutex_unlock(&lock);
+
+    free(buffer);
+    return arg;
+}
+
+/* Orphans still own their blocks until the library frees them */
+static void check_orphans(void) {
+    if (orphan_block == 0 || orphan_block == INVALID_PTR) {
+        return;
+    }
+    if (orphan_block < 0 || orphan_block >= n_blocks || claim_bit(used_blocks, orphan_block)) {
+        report("orphan list in invalid or shared block %d\n", orphan_block, 0);
+        add_conflict(DROP_POINTER, 24, orphan_block); // superblock field
+        return;
+    }
+
+    unsigned char *list = malloc(block_bytes);
+    if (read_at(block_offset(orphan_block) / SECTOR_SIZE, list, sb.blockSize) != 0) {
+        report("cannot read orphan list in block %d\n", orphan_block, 0);
+        free(list);
+        return;
+    }
+
+    unsigned int i;
+    for (i = 0; i < ptrs_per_block; ++i) {
+        int inode_number = get32(list + i * PTR_SIZE);
+        off_t where = block_offset(orphan_block) + i * PTR_SIZE;
+        if (inode_number == INVALID_PTR) {
+            continue;
+        }
+        if (inode_number <= 0 || inode_number >= n_inodes) {
+            report("orphan list: invalid inode %d\n", inode_number, 0);
+            add_conflict(DROP_POINTER, where, inode_number);
+        } else if (claim_bit(used_inodes, inode_number)) {
+            report("orphan list: inode %d is still linked\n", inode_number, 0);
+            add_conflict(DROP_POINTER, where, inode_number);
+        } else {
+            check_inode(inode_number, false, 0);
+        }
+    }
+    free(list);
+}
+
+/* Bits past the last block or i-node are kept busy, as written by mkfs2 */
+static unsigned char *new_bitmap(int sectors, int used) {
+    unsigned char *bitmap = calloc(sectors, SECTOR_SIZE);
+    int i;
+    for (i = used; i < sectors * BITS_PER_SECTOR; ++i) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+    return bitmap;
+}
+
+static int compare(const char *what, unsigned char *disk, unsigned char *used, int n) {
+    int leaked = 0;
+    int lost = 0;
+    int i;
+    for (i = 0; i < n; ++i) {
+        int d = get_bit(disk, i);
+        int u = get_bit(used, i);
+        if (d && !u) {
+            if (verbose || leaked < MAX_REPORTS) {
+                printf("%s %d is marked used but is unreachable\n", what, i);
+            }
+            ++leaked;
+        } else if (!d && u) {
+            if (verbose || lost < MAX_REPORTS) {
+                printf("%s %d is in use but is marked free\n", what, i);
+            }
+            ++lost;
+        }
+    }
+    if (leaked || lost) {
+        printf("%s bitmap: %d leaked, %d marked free while in use\n", what, leaked, lost);
+    }
+    return leaked + lost;
+}
+
+static unsigned int count_free(unsigned char *bitmap, int sectors) {
+    unsigned int free = 0;
+    int i;
+    for (i = 0; i < sectors * SECTOR_SIZE; ++i) {
+        free += 8 - __builtin_popcount(bitmap[i]);
+    }
+    return free;
+}
+
+/* The free counts in the superblock are only as fresh as the last sync2, so
+   they are not errors; -r writes the ones of the rebuilt bitmaps */
+static void check_free_counts(void) {
+    unsigned char sector[SECTOR_SIZE];
+    if (read_at(0, sector, 1) != 0) {
+        return;
+    }
+    unsigned int blocks = count_free(used_blocks, sb.freeBlocksBitmapSize);
+    unsigned int inodes = count_free(used_inodes, sb.freeInodeBitmapSize);
+    if (get32(sector + 60) == blocks && get32(sector + 64) == inodes) {
+        return;
+    }
+    if (verbose) {
+        printf("superblock free counts %u blocks, %u inodes; found %u, %u\n",
+               get32(sector + 60), get32(sector + 64), blocks, inodes);
+    }
+    if (do_repair) {
+        put32(sector + 60, blocks);
+        put32(sector + 64, inodes);
+        write_at(0, sector, 1);
+    }
+}
+
+/* The table holds the references past the first one of each block */
+static int compare_refcounts(void) {
+    unsigned char *table = malloc(refcount_size * SECTOR_SIZE);
+    if (read_at(refcount_start, table, refcount_size) != 0) {
+        printf("cannot read the refcount table\n");
+        free(table);
+        return 1;
+    }
+
+    int wrong = 0;
+    int i;
+    for (i = 0; i < n_blocks && (unsigned int)i < refcount_size * SECTOR_SIZE / 2; ++i) {
+        int found = table[2 * i] | table[2 * i + 1] << 8;
+        int expected = refs[i] > 0 ? refs[i] - 1 : 0;
+        if (found != expected) {
+            if (verbose || wrong < MAX_REPORTS) {
+                printf("block %d has refcount %d, expected %d\n", i, found, expected);
+            }
+            table[2 * i] = expected & 0xFF;
+            table[2 * i + 1] = (expected >> 8) & 0xFF;
+            ++wrong;
+        }
+    }
+    if (wrong) {
+        printf("refcount table: %d wrong counters\n", wrong);
+        if (do_repair && write_at(refcount_start, table, refcount_size) == 0) {
+            wrong = -wrong;
+        }
+    }
+    free(table);
+    return wrong;
+}
+
+static QWORD get64(unsigned char *p) {
+    return get32(p) | (QWORD)get32(p + 4) << 32;
+}
+
+static void put64(unsigned char *p, QWORD v) {
+    put32(p, (unsigned int)v);
+    put32(p + 4, (unsigned int)(v >> 32));
+}
+
+/* Each directory's own totals are added to it and every directory above it;
+   then the reachable directories' entries must match the sums */
+static int compare_usage(void) {
+    unsigned char *table = malloc(usage_size * SECTOR_SIZE);
+    usage_t *subtree = malloc(n_inodes * sizeof(usage_t));
+    if (read_at(usage_start, table, usage_size) != 0) {
+        printf("cannot read the usage table\n");
+        free(table);
+        free(subtree);
+        return 1;
+    }
+    memcpy(subtree, usage_of, n_inodes * sizeof(usage_t));
+
+    int i;
+    int p;
+    for (i = 1; i < n_inodes; ++i) {
+        if (parents[i] < 0) {
+            continue;
+        }
+        for (p = parents[i]; p >= 0; p = p == 0 ? -1 : parents[p]) {
+            subtree[p].bytes += usage_of[i].bytes;
+            subtree[p].blocks += usage_of[i].blocks;
+            subtree[p].files += usage_of[i].files;
+            subtree[p].dirs += usage_of[i].dirs;
+        }
+    }
+
+    int wrong = 0;
+    for (i = 0; i < n_inodes && (unsigned int)i < usage_size * SECTOR_SIZE / 32; ++i) {
+        if (i > 0 && parents[i] < 0) {
+            continue;
+        }
+        unsigned char *entry = table + i * 32;
+        unsigned int parent = i > 0 ? (unsigned int)parents[i] : 0;
+        if (get32(entry) == parent && get32(entry + 4) == subtree[i].files
+            && get32(entry + 8) == subtree[i].dirs && get64(entry + 16) == subtree[i].blocks
+            && get64(entry + 24) == subtree[i].bytes) {
+            continue;
+        }
+        if (verbose || wrong < MAX_REPORTS) {
+            printf("directory %d has usage %llu bytes, %u files, %u dirs; expected %llu, %u, %u\n",
+                   i, get64(entry + 24), get32(entry + 4), get32(entry + 8),
+                   subtree[i].bytes, subtree[i].files, subtree[i].dirs);
+        }
+        memset(entry, 0, 32);
+        put32(entry, parent);
+        put32(entry + 4, subtree[i].files);
+        put32(entry + 8, subtree[i].dirs);
+        put64(entry + 16, subtree[i].blocks);
+        put64(entry + 24, subtree[i].bytes);
+        ++wrong;
+    }
+    if (wrong) {
+        printf("usage table: %d wrong entries\n", wrong);
+        if (do_repair && write_at(usage_start, table, usage_size) == 0) {
+            wrong = -wrong;
+        }
+    }
+    free(table);
+    free(subtree);
+    return wrong;
+}
+
+static int find_free_block() {
+    int i;
+    for (i = 0; i < n_blocks; ++i) {
+        if (!claim_bit(used_blocks, i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int fix_conflict(conflict_t *c) {
+    unsigned char ptr[PTR_SIZE];
+
+    switch (c->kind) {
+    case SHARED_BLOCK: {
+        int block = find_free_block();
+        if (block < 0) {
+            return -1;
+        }
+        unsigned char *data = malloc(block_bytes);
+        int ret = read_at(block_offset(c->block) / SECTOR_SIZE, data, sb.blockSize)
+                  | write_at(block_offset(block) / SECTOR_SIZE, data, sb.blockSize);
+        free(data);
+        // the copy takes the sums of the original sectors along
+        if (ret == 0 && sums != 0) {
+            size_t size = sb.blockSize * 4;
+            off_t table = (off_t)checksum_start * SECTOR_SIZE;
+            ret = disk_io(table + block * size, sums + c->block * size, size, true);
+        }
+        if (ret != 0) {
+            return -1;
+        }
+        put32(ptr, block);
+        break;
+    }
+    case DROP_POINTER:
+        put32(ptr, INVALID_PTR);
+        break;
+    case DROP_RECORD:
+        ptr[0] = TYPEVAL_INVALIDO;
+        return disk_io(c->where, ptr, 1, true);
+    case BAD_CHECKSUM:
+        put32(ptr, 0);
+        break;
+    }
+
+    return disk_io(c->where, ptr, PTR_SIZE, true);
+}
+
+static unsigned int checksum(unsigned int sum, unsigned char *data) {
+    int i;
+    for (i = 0; i < SECTOR_SIZE; ++i) {
+        sum = (sum ^ data[i]) * FNV_PRIME;
+    }
+    return sum;
+}
+
+/* Returns 1 when the journal holds a complete commit past the header's
+   sequence number, 0 when there is nothing to replay */
+static int pending_commit(unsigned int start, unsigned int size, unsigned int *n) {
+    unsigned char header[SECTOR_SIZE];
+    unsigned char sector[SECTOR_SIZE];
+    if (read_at(start, header, 1) != 0 || memcmp(header, "T2JH", 4) != 0 ||
+        read_at(start + 1, sector, 1) != 0) {
+        return -1;
+    }
+
+    unsigned int seq = get32(header + 4) + 1;
+    *n = get32(sector + 8);
+    if (memcmp(sector, "T2JD", 4) != 0 || get32(sector + 4) != seq || *n == 0) {
+        return 0;
+    }
+    unsigned int descriptors = (*n + TAGS_PER_SECTOR - 1) / TAGS_PER_SECTOR;
+    if (2 + descriptors + *n > size) {
+        return 0;
+    }
+
+    unsigned int sum = FNV_BASIS;
+    unsigned int i;
+    for (i = 0; i < *n; ++i) {
+        if (read_at(start + 1 + descriptors + i, sector, 1) != 0) {
+            return -1;
+        }
+        sum = checksum(sum, sector);
+    }
+    if (read_at(start + 1 + descriptors + *n, sector, 1) != 0) {
+        return -1;
+    }
+    return memcmp(sector, "T2JC", 4) == 0 && get32(sector + 4) == seq &&
+           get32(sector + 8) == *n && get32(sector + 12) == sum;
+}
+
+/* Returns 1 when a commit is waiting and cannot be replayed without -r */
+static int replay_journal(void) {
+    unsigned char sector[SECTOR_SIZE];
+    if (read_at(0, sector, 1) != 0 || !(get32(sector + 20) & T2FS_FEATURE_JOURNAL)) {
+        return 0;
+    }
+
+    unsigned int start = get32(sector + 28);
+    unsigned int size = get32(sector + 32);
+    unsigned int n;
+    int pending = start < get32(sector + 16) ? pending_commit(start, size, &n) : -1;
+    if (pending < 0) {
+        printf("invalid journal\n");
+        return -1;
+    }
+    if (pending == 0) {
+        return 0;
+    }
+    if (!do_repair) {
+        printf("journal holds a commit of %u sectors not yet replayed\n", n);
+        return 1;
+    }
+
+    unsigned int descriptors = (n + TAGS_PER_SECTOR - 1) / TAGS_PER_SECTOR;
+    unsigned char tags[SECTOR_SIZE];
+    unsigned int i;
+    for (i = 0; i < n; ++i) {
+        if (i % TAGS_PER_SECTOR == 0 &&
+            read_at(start + 1 + i / TAGS_PER_SECTOR, tags, 1) != 0) {
+            return -1;
+        }
+        if (read_at(start + 1 + descriptors + i, sector, 1) != 0 ||
+            write_at(get32(tags + 12 + (i % TAGS_PER_SECTOR) * 4), sector, 1) != 0) {
+            return -1;
+        }
+    }
+
+    if (read_at(start, sector, 1) != 0) {
+        return -1;
+    }
+    put32(sector + 4, get32(sector + 4) + 1);
+    if (write_at(start, sector, 1) != 0) {
+        return -1;
+    }
+    printf("journal: replayed %u sectors\n", n);
+    return 0;
+}
+
+/* The stripe layout is in the superblock, at the start of the first image */
+static int read_stripes(void) {
+    unsigned char sector[SECTOR_SIZE];
+    if (pread(fds[0], sector, SECTOR_SIZE, 0) != SECTOR_SIZE) {
+        printf("not a T2FS image\n");
+        return -1;
+    }
+    unsigned int width = get32(sector + 56) > 1 ? get32(sector + 56) : 1;
+    if (width != (unsigned int)images) {
+        printf("the disk is striped over %u images, not %d\n", width, images);
+        return -1;
+    }
+    stripe = get32(sector + 52);
+    if (images > 1 && stripe == 0) {
+        printf("invalid superblock\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int load(void) {
+    unsigned char sector[SECTOR_SIZE];
+    if (read_at(0, sector, 1) != 0 || memcmp(sector, "T2FS", 4) != 0) {
+        printf("not a T2FS image\n");
+        return -1;
+    }
+
+    sb.superblockSize = sector[6] | sector[7] << 8;
+    sb.freeBlocksBitmapSize = sector[8] | sector[9] << 8;
+    sb.freeInodeBitmapSize = sector[10] | sector[11] << 8;
+    sb.inodeAreaSize = sector[12] | sector[13] << 8;
+    sb.blockSize = sector[14] | sector[15] << 8;
+    sb.diskSize = get32(sector + 16);
+    orphan_block = get32(sector + 24);
+    if (get32(sector + 20) & T2FS_FEATURE_JOURNAL) {
+        journal_start = get32(sector + 28);
+    }
+    if (get32(sector + 20) & T2FS_FEATURE_REFLINK) {
+        refcount_start = get32(sector + 36);
+        refcount_size = get32(sector + 40);
+    }
+    if (get32(sector + 20) & T2FS_FEATURE_CHECKSUM) {
+        checksum_start = get32(sector + 44);
+        checksum_size = get32(sector + 48);
+    }
+    if (get32(sector + 20) & T2FS_FEATURE_DIR_USAGE) {
+        usage_start = get32(sector + 68);
+        usage_size = get32(sector + 72);
+    }
+    large_file = (get32(sector + 20) & T2FS_FEATURE_LARGE_FILE) != 0;
+
+    inode_area = sb.superblockSize + sb.freeBlocksBitmapSize + sb.freeInodeBitmapSize;
+    block_area = inode_area + sb.inodeAreaSize;
+    block_bytes = sb.blockSize * SECTOR_SIZE;
+    ptrs_per_block = block_bytes / PTR_SIZE;
+    if (sb.blockSize == 0 || block_area >= sb.diskSize) {
+        printf("invalid superblock\n");
+        return -1;
+    }
+
+    unsigned int data_end = journal_start > block_area ? journal_start : sb.diskSize;
+    if (refcount_start > block_area && refcount_start < data_end) {
+        data_end = refcount_start;
+    }
+    if (checksum_start > block_area && checksum_start < data_end) {
+        data_end = checksum_start;
+    }
+    if (usage_start > block_area && usage_start < data_end) {
+        data_end = usage_start;
+    }
+    n_blocks = (data_end - block_area) / sb.blockSize;
+    if (n_blocks > sb.freeBlocksBitmapSize * BITS_PER_SECTOR) {
+        n_blocks = sb.freeBlocksBitmapSize * BITS_PER_SECTOR;
+    }
+    n_inodes = sb.inodeAreaSize * (SECTOR_SIZE / INODE_SIZE);
+    if (n_inodes > sb.freeInodeBitmapSize * BITS_PER_SECTOR) {
+        n_inodes = sb.freeInodeBitmapSize * BITS_PER_SECTOR;
+    }
+
+    disk_blocks = malloc(sb.freeBlocksBitmapSize * SECTOR_SIZE);
+    disk_inodes = malloc(sb.freeInodeBitmapSize * SECTOR_SIZE);
+    inodes = malloc(sb.inodeAreaSize * SECTOR_SIZE);
+    if (read_at(sb.superblockSize, disk_blocks, sb.freeBlocksBitmapSize) != 0
+        || read_at(sb.superblockSize + sb.freeBlocksBitmapSize,
+                   disk_inodes, sb.freeInodeBitmapSize) != 0
+        || read_at(inode_area, inodes, sb.inodeAreaSize) != 0) {
+        printf("cannot read metadata areas\n");
+        return -1;
+    }
+
+    used_blocks = new_bitmap(sb.freeBlocksBitmapSize, n_blocks);
+    used_inodes = new_bitmap(sb.freeInodeBitmapSize, n_inodes);
+    if (refcount_start > 0) {
+        refs = calloc(n_blocks, sizeof(int));
+    }
+    if (usage_start > 0) {
+        usage_of = calloc(n_inodes, sizeof(usage_t));
+        parents = malloc(n_inodes * sizeof(int));
+        memset(parents, 0xFF, n_inodes * sizeof(int));
+    }
+    if (checksum_start > 0) {
+        sums = malloc(checksum_size * SECTOR_SIZE);
+        if (read_at(checksum_start, sums, checksum_size) != 0) {
+            printf("cannot read the checksum table\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(char *name) {
+    printf("usage: %s [-r] [-j workers] [-v] [image...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    char *default_name = DEFAULT_DISK_NAME;
+    char **disk_names = &default_name;
+    long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:vh")) != -1) {
+        switch (opt) {
+        case 'r':
+            do_repair = 1;
+            break;
+        case 'j':
+            n_workers = strtol(optarg, 0, 0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 8;
+        }
+    }
+    if (optind < argc) {
+        disk_names = argv + optind;
+        images = argc - optind;
+    }
+    if (n_workers < 1) {
+        n_workers = 1;
+    }
+    if (images > MAX_IMAGES) {
+        usage(argv[0]);
+        return 8;
+    }
+
+    long i;
+    for (i = 0; i < images; ++i) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < images; ++i) {
+        fds[i] = open(disk_names[i], do_repair ? O_RDWR : O_RDONLY);
+        if (fds[i] < 0) {
+            perror(disk_names[i]);
+            close_images();
+            return 8;
+        }
+    }
+    if (read_stripes() != 0) {
+        close_images();
+        return 8;
+    }
+    int pending = replay_journal();
+    if (pending != 0) {
+        close_images();
+        return pending > 0 ? 4 : 8;
+    }
+    if (load() != 0) {
+        close_images();
+        return 8;
+    }
+
+    claim_bit(used_inodes, 0);
+    push_dir(0);
+
+    pthread_t *threads = malloc(n_workers * sizeof(pthread_t));
+    for (i = 0; i < n_workers; ++i) {
+        pthread_create(&threads[i], 0, worker, 0);
+    }
+    for (i = 0; i < n_workers; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+    check_orphans();
+
+    int unfixed = errors;
+    if (do_repair) {
+        for (i = 0; i < n_conflicts; ++i) {
+            if (fix_conflict(&conflicts[i]) == 0) {
+                --unfixed;
+            }
+        }
+    }
+
+    int bitmap_errors = compare("block", disk_blocks, used_blocks, n_blocks)
+                        + compare("inode", disk_inodes, used_inodes, n_inodes);
+    errors += bitmap_errors;
+    if (bitmap_errors && do_repair
+        && write_at(sb.superblockSize, used_blocks, sb.freeBlocksBitmapSize) == 0
+        && write_at(sb.superblockSize + sb.freeBlocksBitmapSize,
+                    used_inodes, sb.freeInodeBitmapSize) == 0) {
+        bitmap_errors = 0;
+    }
+    unfixed += bitmap_errors;
+    check_free_counts();
+
+    if (refs != 0) {
+        int wrong = compare_refcounts();
+        errors += wrong > 0 ? wrong : -wrong;
+        unfixed += wrong > 0 ? wrong : 0;
+    }
+    if (usage_of != 0) {
+        int wrong = compare_usage();
+        errors += wrong > 0 ? wrong : -wrong;
+        unfixed += wrong > 0 ? wrong : 0;
+    }
+
+    close_images();
+
+    printf("%s: %d errors, %d left\n", disk_names[0], errors, unfixed);
+    if (unfixed) {
+        return 4;
+    }
+    return errors ? 1 : 0;
+}
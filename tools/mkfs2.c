@@ -0,0 +1,447 @@
+/**
+
+    mkfs2: formats a T2FS image with the requested geometry
+
+    usage: mkfs2 [-s disk_sectors] [-b block_sectors] [-i inodes] [-O features]
+                 [-J journal_sectors] [-S stripe_sectors] [image...]
+
+    Optional features are given as a comma separated list:
+        dir_index   index directories by name hash once they outgrow a block
+        inline_data keep files of up to 1 KB in their directory block
+        journal     log metadata writes in a region at the end of the disk
+                    (-J sectors, 1024 by default, at least 256)
+        reflink     let clone2 share data blocks, counted in a table of 16-bit
+                    reference counters past the last data block
+        compression let set_compression2 store files coded in units of 4 blocks
+        checksum    keep a CRC32C of every data sector, checked when it is read,
+                    in a table of 32-bit sums past the refcount table
+        large_file  keep the high half of file sizes in the directory record,
+                    so files may pass 4 GB
+        dir_usage   keep the bytes, blocks, files and subdirectories under
+                    every directory for du2, in a table of 32-byte entries
+                    per i-node past the checksum table
+
+    Given several images, the disk is striped over them (RAID-0): sector s
+    belongs to stripe unit s / stripe_sectors (64 by default), and unit u is
+    stored on image u % images, after the units of the rows before it. The
+    disk size is rounded down to whole rows, so the images are the same size;
+    mount them with t2fs_mount_striped, in the order given here.
+
+    The image is created as a sparse file: only the superblock, the bitmaps,
+    the root i-node sector and the root directory block are written, so huge
+    images are created instantly and every run produces the same bytes.
+
+*/
+
+#include <t2fs.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFAULT_DISK_NAME "t2fs_disk.dat"
+#define DEFAULT_DISK_SIZE 32768
+#define DEFAULT_BLOCK_SIZE 16
+#define DEFAULT_INODES 2048
+#define DEFAULT_JOURNAL_SIZE 1024
+// long operations restart once a commit holds half the journal, and one of
+// their parts logs up to about a hundred sectors
+#define MIN_JOURNAL_SIZE 256
+#define DEFAULT_STRIPE_SIZE 64
+#define MAX_IMAGES 64
+
+#define T2FS_VERSION 0x7E02
+#define BITS_PER_SECTOR (SECTOR_SIZE * 8)
+#define INODES_PER_SECTOR (SECTOR_SIZE / sizeof(struct t2fs_inode))
+#define REFCOUNTS_PER_SECTOR (SECTOR_SIZE / 2)
+#define CHECKSUMS_PER_SECTOR (SECTOR_SIZE / 4)
+#define USAGE_PER_SECTOR (SECTOR_SIZE / 32)
+#define MAX_WORD 0xFFFF
+
+typedef struct t2fs_superbloco superblock_t;
+
+static int fds[MAX_IMAGES];
+static int images = 1;
+static unsigned int stripe = 0;     // sectors per stripe unit, zero with one image
+
+static struct {
+    const char *name;
+    DWORD flag;
+} feature_names[] = {
+    {"dir_index", T2FS_FEATURE_DIR_INDEX},
+    {"inline_data", T2FS_FEATURE_INLINE_DATA},
+    {"journal", T2FS_FEATURE_JOURNAL},
+    {"reflink", T2FS_FEATURE_REFLINK},
+    {"compression", T2FS_FEATURE_COMPRESSION},
+    {"checksum", T2FS_FEATURE_CHECKSUM},
+    {"large_file", T2FS_FEATURE_LARGE_FILE},
+    {"dir_usage", T2FS_FEATURE_DIR_USAGE},
+    {0, 0}
+};
+
+static void put16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned int div_up(unsigned int a, unsigned int b) {
+    return (a + b - 1) / b;
+}
+
+/* Writes n sectors of the disk, a stripe unit at a time on a striped one */
+static int write_at(unsigned int sector, unsigned char *buffer, unsigned int n) {
+    while (n > 0) {
+        int image = 0;
+        off_t offset = (off_t)sector * SECTOR_SIZE;
+        unsigned int count = n;
+        if (images > 1) {
+            unsigned int unit = sector / stripe;
+            image = unit % images;
+            offset = ((off_t)(unit / images) * stripe + sector % stripe) * SECTOR_SIZE;
+            if (count > stripe - sector % stripe) {
+                count = stripe - sector % stripe;
+            }
+        }
+        if (pwrite(fds[image], buffer, (size_t)count * SECTOR_SIZE, offset) != (ssize_t)count * SECTOR_SIZE) {
+            perror("pwrite");
+            return -1;
+        }
+        sector += count;
+        buffer += (size_t)count * SECTOR_SIZE;
+        n -= count;
+    }
+    return 0;
+}
+
+static void close_images(void) {
+    int i;
+    for (i = 0; i < images; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+/* Chooses the largest number of data blocks whose bitmap (and refcount, checksum and usage tables) still fits in the disk */
+static int layout(superblock_t *sb, unsigned int inodes, unsigned int *blocks) {
+    unsigned int inode_area = div_up(inodes, INODES_PER_SECTOR);
+    unsigned int inode_bitmap = div_up(inodes, BITS_PER_SECTOR);
+    unsigned int meta = 1 + inode_bitmap + inode_area;
+    unsigned int usage_table = sb->features & T2FS_FEATURE_DIR_USAGE ? div_up(inodes, USAGE_PER_SECTOR) : 0;
+    if (meta + usage_table + sb->journalSize >= sb->diskSize || inode_area > MAX_WORD) {
+        printf("too many inodes for a disk of %u sectors\n", sb->diskSize);
+        return -1;
+    }
+
+    // the journal takes the end of the disk, past the last data block
+    unsigned int space = sb->diskSize - sb->journalSize - usage_table;
+    unsigned int n = (space - meta) / sb->blockSize;
+    unsigned int block_bitmap = div_up(n, BITS_PER_SECTOR);
+    unsigned int refcounts = sb->features & T2FS_FEATURE_REFLINK ? div_up(n, REFCOUNTS_PER_SECTOR) : 0;
+    unsigned int checksums = sb->features & T2FS_FEATURE_CHECKSUM
+                             ? div_up(n * sb->blockSize, CHECKSUMS_PER_SECTOR) : 0;
+    while (n > 0 && meta + block_bitmap + n * sb->blockSize + refcounts + checksums > space) {
+        --n;
+        block_bitmap = div_up(n, BITS_PER_SECTOR);
+        refcounts = sb->features & T2FS_FEATURE_REFLINK ? div_up(n, REFCOUNTS_PER_SECTOR) : 0;
+        checksums = sb->features & T2FS_FEATURE_CHECKSUM
+                    ? div_up(n * sb->blockSize, CHECKSUMS_PER_SECTOR) : 0;
+    }
+    if (n == 0 || block_bitmap > MAX_WORD) {
+        printf("cannot fit data blocks in a disk of %u sectors\n", sb->diskSize);
+        return -1;
+    }
+
+    memcpy(sb->id, "T2FS", 4);
+    sb->version = T2FS_VERSION;
+    sb->superblockSize = 1;
+    sb->freeBlocksBitmapSize = block_bitmap;
+    sb->freeInodeBitmapSize = inode_bitmap;
+    sb->inodeAreaSize = inode_area;
+    // the table follows the data blocks; the sparse image already reads as zeros
+    sb->refcountStart = refcounts > 0 ? meta + block_bitmap + n * sb->blockSize : 0;
+    sb->refcountSize = refcounts;
+    sb->checksumStart = checksums > 0 ? meta + block_bitmap + n * sb->blockSize + refcounts : 0;
+    sb->checksumSize = checksums;
+    // the root's entry, the only one in use, is all zeros
+    sb->usageStart = usage_table > 0 ? meta + block_bitmap + n * sb->blockSize + refcounts + checksums : 0;
+    sb->usageSize = usage_table;
+    *blocks = n;
+    return 0;
+}
+
+static int write_superblock(superblock_t *sb) {
+    unsigned char sector[SECTOR_SIZE] = {0};
+    memcpy(sector, sb->id, 4);
+    put16(sector + 4, sb->version);
+    put16(sector + 6, sb->superblockSize);
+    put16(sector + 8, sb->freeBlocksBitmapSize);
+    put16(sector + 10, sb->freeInodeBitmapSize);
+    put16(sector + 12, sb->inodeAreaSize);
+    put16(sector + 14, sb->blockSize);
+    put32(sector + 16, sb->diskSize);
+    put32(sector + 20, sb->features);
+    put32(sector + 28, sb->journalStart);
+    put32(sector + 32, sb->journalSize);
+    put32(sector + 36, sb->refcountStart);
+    put32(sector + 40, sb->refcountSize);
+    put32(sector + 44, sb->checksumStart);
+    put32(sector + 48, sb->checksumSize);
+    put32(sector + 52, sb->stripeSectors);
+    put32(sector + 56, sb->stripeWidth);
+    put32(sector + 60, sb->freeBlocks);
+    put32(sector + 64, sb->freeInodes);
+    put32(sector + 68, sb->usageStart);
+    put32(sector + 72, sb->usageSize);
+    return write_at(0, sector, 1);
+}
+
+/* Bit 0 (root) is taken and every bit past "used" is marked busy so it is never allocated */
+static int write_bitmap(unsigned int first, unsigned int size, unsigned int used) {
+    unsigned char *bitmap = calloc(size, SECTOR_SIZE);
+    if (bitmap == 0) {
+        return -1;
+    }
+
+    unsigned int i;
+    bitmap[0] = 1;
+    for (i = used; i < size * BITS_PER_SECTOR; ++i) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    int ret = write_at(first, bitmap, size);
+    free(bitmap);
+    return ret;
+}
+
+static int write_root(superblock_t *sb, unsigned int inode_area, unsigned int block_area) {
+    unsigned char sector[SECTOR_SIZE];
+    memset(sector, 0xFF, SECTOR_SIZE); // every pointer INVALID_PTR
+    put32(sector, 0);
+    if (write_at(inode_area, sector, 1) != 0) {
+        return -1;
+    }
+
+    unsigned char *block = calloc(sb->blockSize, SECTOR_SIZE);
+    if (block == 0) {
+        return -1;
+    }
+    int ret = write_at(block_area, block, sb->blockSize);
+    free(block);
+    return ret;
+}
+
+/* An empty journal: sequence number zero and nothing to replay */
+static int write_journal(superblock_t *sb) {
+    unsigned char sector[SECTOR_SIZE] = {0};
+    memcpy(sector, "T2JH", 4);
+    return write_at(sb->journalStart, sector, 1);
+}
+
+static int parse_features(char *list, DWORD *features) {
+    char *name;
+    for (name = strtok(list, ","); name != 0; name = strtok(0, ",")) {
+        int i;
+        for (i = 0; feature_names[i].name != 0; ++i) {
+            if (strcmp(name, feature_names[i].name) == 0) {
+                break;
+            }
+        }
+        if (feature_names[i].name == 0) {
+            printf("unknown feature %s\n", name);
+            return -1;
+        }
+        *features |= feature_names[i].flag;
+    }
+    return 0;
+}
+
+/* Reads a numeric option of at most "max"; -1 unless the whole text is one */
+static int parse_number(char *text, unsigned long max, unsigned int *value) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(text, &end, 0);
+    if (errno != 0 || end == text || *end != '\0' || strchr(text, '-') != 0 || n > max) {
+        printf("invalid number %s\n", text);
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+static void usage(char *name) {
+    printf("usage: %s [-s disk_sectors] [-b block_sectors] [-i inodes] [-O features]"
+           " [-J journal_sectors] [-S stripe_sectors] [image...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    superblock_t sb;
+    char *default_name = DEFAULT_DISK_NAME;
+    char **disk_names = &default_name;
+    unsigned int inodes = DEFAULT_INODES;
+    unsigned int blocks;
+    unsigned int journal = DEFAULT_JOURNAL_SIZE;
+
+    sb.diskSize = DEFAULT_DISK_SIZE;
+    sb.blockSize = DEFAULT_BLOCK_SIZE;
+    sb.features = 0;
+
+    int opt;
+    unsigned int value;
+    stripe = DEFAULT_STRIPE_SIZE;
+    while ((opt = getopt(argc, argv, "s:b:i:O:J:S:h")) != -1) {
+        switch (opt) {
+        case 's':
+            if (parse_number(optarg, UINT_MAX, &sb.diskSize) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (parse_number(optarg, MAX_WORD, &value) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            sb.blockSize = value;
+            break;
+        case 'i':
+            if (parse_number(optarg, UINT_MAX - INODES_PER_SECTOR, &inodes) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'O':
+            if (parse_features(optarg, &sb.features) != 0) {
+                return 1;
+            }
+            break;
+        case 'J':
+            if (parse_number(optarg, UINT_MAX, &journal) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            if (parse_number(optarg, UINT_MAX, &stripe) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        disk_names = argv + optind;
+        images = argc - optind;
+    }
+
+    if (sb.blockSize == 0 || inodes == 0 || stripe == 0 || images > MAX_IMAGES) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // readers count whole sectors of i-nodes, so the last one is filled up
+    inodes = div_up(inodes, INODES_PER_SECTOR) * INODES_PER_SECTOR;
+
+    // every image holds the same number of whole rows of stripe units
+    sb.stripeSectors = 0;
+    sb.stripeWidth = 0;
+    if (images > 1) {
+        sb.diskSize -= sb.diskSize % (stripe * images);
+        sb.stripeSectors = stripe;
+        sb.stripeWidth = images;
+    } else {
+        stripe = 0;
+    }
+
+    sb.journalSize = 0;
+    sb.journalStart = 0;
+    if (sb.features & T2FS_FEATURE_JOURNAL) {
+        if (journal < MIN_JOURNAL_SIZE || journal >= sb.diskSize) {
+            printf("invalid journal size %u\n", journal);
+            return 1;
+        }
+        sb.journalSize = journal;
+        sb.journalStart = sb.diskSize - journal;
+    }
+
+    if (layout(&sb, inodes, &blocks) != 0) {
+        return 1;
+    }
+
+    // the root takes the first block and the first i-node
+    sb.freeBlocks = blocks - 1;
+    sb.freeInodes = inodes - 1;
+
+    unsigned int inode_area = sb.superblockSize
+                              + sb.freeInodeBitmapSize
+                              + sb.freeBlocksBitmapSize;
+    unsigned int block_area = inode_area + sb.inodeAreaSize;
+
+    int i;
+    for (i = 0; i < images; ++i) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < images; ++i) {
+        fds[i] = open(disk_names[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fds[i] < 0) {
+            perror(disk_names[i]);
+            close_images();
+            return 1;
+        }
+        if (ftruncate(fds[i], (off_t)(sb.diskSize / images) * SECTOR_SIZE) != 0) {
+            perror("ftruncate");
+            close_images();
+            return 1;
+        }
+    }
+
+    if (write_superblock(&sb) != 0
+        || write_bitmap(sb.superblockSize, sb.freeBlocksBitmapSize, blocks) != 0
+        || write_bitmap(sb.superblockSize + sb.freeBlocksBitmapSize,
+                        sb.freeInodeBitmapSize, inodes) != 0
+        || write_root(&sb, inode_area, block_area) != 0
+        || (sb.journalSize > 0 && write_journal(&sb) != 0)) {
+        close_images();
+        return 1;
+    }
+
+    close_images();
+
+    printf("%s: %u sectors, %u blocks of %u sectors, %u inodes\n",
+           disk_names[0], sb.diskSize, blocks, sb.blockSize, inodes);
+    if (images > 1) {
+        printf("striped over %d images in units of %u sectors\n", images, stripe);
+    }
+    printf("superblock 0, block bitmap %u (%u), inode bitmap %u (%u), inodes %u (%u), data %u\n",
+           sb.superblockSize, sb.freeBlocksBitmapSize,
+           sb.superblockSize + sb.freeBlocksBitmapSize, sb.freeInodeBitmapSize,
+           inode_area, sb.inodeAreaSize, block_area);
+    if (sb.journalSize > 0) {
+        printf("journal %u (%u)\n", sb.journalStart, sb.journalSize);
+    }
+    if (sb.refcountSize > 0) {
+        printf("refcounts %u (%u)\n", sb.refcountStart, sb.refcountSize);
+    }
+    if (sb.checksumSize > 0) {
+        printf("checksums %u (%u)\n", sb.checksumStart, sb.checksumSize);
+    }
+    if (sb.usageSize > 0) {
+        printf("usage %u (%u)\n", sb.usageStart, sb.usageSize);
+    }
+
+    return 0;
+}